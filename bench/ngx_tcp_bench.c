@@ -0,0 +1,921 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+/*
+ * A loopback load generator for the tcp module, Linux only.
+ *
+ * Every thread drives its share of the connections through its own
+ * epoll instance.  The modes are:
+ *
+ *     connect   connections are opened and reset as fast as possible;
+ *     session   a connection sends one message, reads it back and closes;
+ *     echo      persistent connections send a message and wait for it;
+ *     bulk      persistent connections write and read without waiting;
+ *     sink      persistent connections only read.
+ *
+ * With -p the session and echo modes send that many messages at once,
+ * each ending with CRLF, and wait for all of them.
+ *
+ * The result is printed as one JSON object per line.  With -e the
+ * program is an echo server instead, it is used as the upstream of the
+ * proxied servers.  With -g it copies what the server sends until it
+ * closes the connection, e.g. the stats protocol, to the output.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+
+#define BENCH_CONNECT     0
+#define BENCH_SESSION     1
+#define BENCH_ECHO        2
+#define BENCH_BULK        3
+#define BENCH_SINK        4
+
+#define BENCH_CONNECTING  0
+#define BENCH_WRITING     1
+#define BENCH_READING     2
+
+#define BENCH_EVENTS      512
+
+
+/*
+ * the latency histograms are log-linear as in the stats zone, 16 exact
+ * buckets, then 8 buckets per power of two, but in nanoseconds and up to
+ * 2^40 ns; the stats zone counts microseconds up to 2^32 us, so only the
+ * percentiles reported in microseconds compare, not the buckets
+ */
+
+#define BENCH_BUCKETS     (16 + 8 * 36)
+
+
+typedef struct {
+    int                  fd;
+    int                  state;
+    size_t               sent;
+    size_t               received;
+    uint64_t             start;
+    size_t               size;       /* the echo server: bytes pending */
+    size_t               pos;
+} bench_conn_t;
+
+
+typedef struct {
+    pthread_t            tid;
+    int                  ep;
+    int                  listen;
+
+    bench_conn_t        *conns;
+    int                  nconns;
+
+    uint64_t             ops;
+    uint64_t             errors;
+    uint64_t             bytes_sent;
+    uint64_t             bytes_received;
+    uint64_t             hist[BENCH_BUCKETS];
+
+    char                *buf;
+} bench_thread_t;
+
+
+static const char *bench_modes[] = {
+    "connect", "session", "echo", "bulk", "sink"
+};
+
+static struct sockaddr_in  bench_addr;
+static int                 bench_mode = BENCH_ECHO;
+static int                 bench_threads = 1;
+static int                 bench_connections = 16;
+static int                 bench_duration = 10;
+static size_t              bench_size = 64;
+static int                 bench_pipeline = 1;
+static size_t              bench_round;
+static const char         *bench_name;
+static int                 bench_server_port;
+static int                 bench_get;
+
+static volatile int        bench_stop;
+
+
+static uint64_t
+bench_now(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static int
+bench_bucket(uint64_t nsec)
+{
+    int  i, m;
+
+    if (nsec < 16) {
+        return (int) nsec;
+    }
+
+    for (m = 4; nsec >> (m + 1); m++) { /* void */ }
+
+    i = 16 + (m - 4) * 8 + (int) ((nsec >> (m - 3)) & 7);
+
+    return (i < BENCH_BUCKETS) ? i : BENCH_BUCKETS - 1;
+}
+
+
+static uint64_t
+bench_bucket_max(int i)
+{
+    int  m, sub;
+
+    if (i < 16) {
+        return i;
+    }
+
+    m = (i - 16) / 8 + 4;
+    sub = (i - 16) % 8;
+
+    return ((uint64_t) (8 + sub + 1) << (m - 3)) - 1;
+}
+
+
+static void
+bench_record(bench_thread_t *t, uint64_t start)
+{
+    uint64_t  now;
+
+    now = bench_now();
+
+    t->hist[bench_bucket(now - start)]++;
+    t->ops++;
+}
+
+
+static void
+bench_close(bench_conn_t *c, int reset)
+{
+    struct linger  l;
+
+    if (reset) {
+
+        /* the client side would run out of ports in TIME_WAIT otherwise */
+
+        l.l_onoff = 1;
+        l.l_linger = 0;
+
+        (void) setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+    }
+
+    (void) close(c->fd);
+
+    c->fd = -1;
+}
+
+
+static int
+bench_connect(bench_thread_t *t, bench_conn_t *c)
+{
+    int                  fd, one;
+    struct epoll_event   ee;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        perror("socket()");
+        return -1;
+    }
+
+    one = 1;
+    (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->fd = fd;
+    c->state = BENCH_CONNECTING;
+    c->sent = 0;
+    c->received = 0;
+    c->start = bench_now();
+
+    if (connect(fd, (struct sockaddr *) &bench_addr, sizeof(bench_addr)) == -1
+        && errno != EINPROGRESS)
+    {
+        t->errors++;
+        bench_close(c, 0);
+        return -1;
+    }
+
+    ee.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ee.data.ptr = c;
+
+    if (epoll_ctl(t->ep, EPOLL_CTL_ADD, fd, &ee) == -1) {
+        perror("epoll_ctl()");
+        bench_close(c, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * a bulk connection writes until the socket is full and drains whatever
+ * has come back after each chunk, a sink connection only drains;
+ * returns 1 if the connection has to be reopened
+ */
+
+static int
+bench_bulk(bench_thread_t *t, bench_conn_t *c)
+{
+    int      blocked;
+    ssize_t  n;
+
+    for ( ;; ) {
+        blocked = 1;
+
+        if (bench_mode == BENCH_BULK) {
+            n = send(c->fd, t->buf, bench_size, MSG_NOSIGNAL);
+
+            if (n == -1) {
+                if (errno != EAGAIN) {
+                    t->errors++;
+                    return 1;
+                }
+
+            } else {
+                t->bytes_sent += n;
+                blocked = 0;
+            }
+        }
+
+        for ( ;; ) {
+            n = recv(c->fd, t->buf, bench_size, 0);
+
+            if (n == -1) {
+                if (errno != EAGAIN) {
+                    t->errors++;
+                    return 1;
+                }
+
+                break;
+            }
+
+            if (n == 0) {
+                t->errors++;
+                return 1;
+            }
+
+            t->bytes_received += n;
+        }
+
+        if (blocked) {
+            return 0;
+        }
+    }
+}
+
+
+/* returns 1 if the connection has to be reopened */
+
+static int
+bench_handle(bench_thread_t *t, bench_conn_t *c, uint32_t events)
+{
+    int        err;
+    ssize_t    n;
+    size_t     size;
+    socklen_t  len;
+
+    if (c->state == BENCH_CONNECTING) {
+
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            return 0;
+        }
+
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+            t->errors++;
+            return 1;
+        }
+
+        if (bench_mode == BENCH_CONNECT) {
+            bench_record(t, c->start);
+            return 1;
+        }
+
+        c->state = BENCH_WRITING;
+        c->start = bench_now();
+    }
+
+    if (bench_mode >= BENCH_BULK) {
+        return bench_bulk(t, c);
+    }
+
+    for ( ;; ) {
+
+        if (c->state == BENCH_WRITING) {
+            size = bench_round - c->sent;
+
+            n = send(c->fd, t->buf + c->sent, size, MSG_NOSIGNAL);
+
+            if (n == -1) {
+                if (errno == EAGAIN) {
+                    return 0;
+                }
+
+                t->errors++;
+                return 1;
+            }
+
+            t->bytes_sent += n;
+            c->sent += n;
+
+            if (c->sent < bench_round) {
+                continue;
+            }
+
+            c->sent = 0;
+            c->state = BENCH_READING;
+        }
+
+        /* BENCH_READING */
+
+        /* the echo lands where it came from, the messages stay intact */
+
+        n = recv(c->fd, t->buf + c->received, bench_round - c->received, 0);
+
+        if (n == -1) {
+            if (errno == EAGAIN) {
+                return 0;
+            }
+
+            t->errors++;
+            return 1;
+        }
+
+        if (n == 0) {
+            t->errors++;
+            return 1;
+        }
+
+        t->bytes_received += n;
+        c->received += n;
+
+        if (c->received < bench_round) {
+            continue;
+        }
+
+        bench_record(t, c->start);
+
+        if (bench_mode == BENCH_SESSION) {
+            return 1;
+        }
+
+        c->received = 0;
+        c->state = BENCH_WRITING;
+        c->start = bench_now();
+    }
+}
+
+
+static void *
+bench_client(void *data)
+{
+    bench_thread_t  *t = data;
+
+    int                  i, n;
+    bench_conn_t        *c;
+    struct epoll_event   events[BENCH_EVENTS];
+
+    for (i = 0; i < t->nconns; i++) {
+        (void) bench_connect(t, &t->conns[i]);
+    }
+
+    while (!bench_stop) {
+        n = epoll_wait(t->ep, events, BENCH_EVENTS, 100);
+
+        for (i = 0; i < n; i++) {
+            c = events[i].data.ptr;
+
+            if (c->fd == -1) {
+                continue;
+            }
+
+            if (bench_handle(t, c, events[i].events)) {
+                bench_close(c, bench_mode <= BENCH_SESSION);
+
+                if (!bench_stop) {
+                    (void) bench_connect(t, c);
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < t->nconns; i++) {
+        if (t->conns[i].fd != -1) {
+            bench_close(&t->conns[i], 1);
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+bench_echo(bench_thread_t *t, bench_conn_t *c)
+{
+    ssize_t  n;
+
+    for ( ;; ) {
+
+        if (c->pos < c->size) {
+            n = send(c->fd, t->buf + c->pos, c->size - c->pos, MSG_NOSIGNAL);
+
+            if (n == -1) {
+                if (errno == EAGAIN) {
+                    return;
+                }
+
+                goto close;
+            }
+
+            c->pos += n;
+
+            if (c->pos < c->size) {
+                continue;
+            }
+        }
+
+        n = recv(c->fd, t->buf, bench_size, 0);
+
+        if (n == -1) {
+            if (errno == EAGAIN) {
+                c->pos = 0;
+                c->size = 0;
+                return;
+            }
+
+            goto close;
+        }
+
+        if (n == 0) {
+            goto close;
+        }
+
+        c->pos = 0;
+        c->size = n;
+    }
+
+close:
+
+    (void) close(c->fd);
+    free(c);
+}
+
+
+/*
+ * the connections of an echo server thread share its buffer, so the
+ * unsent bytes of a connection may be overwritten by another one; only
+ * the number of bytes matters to the clients
+ */
+
+static void *
+bench_server(void *data)
+{
+    bench_thread_t  *t = data;
+
+    int                  i, n, fd, one;
+    bench_conn_t        *c;
+    struct epoll_event   ee, events[BENCH_EVENTS];
+
+    while (!bench_stop) {
+        n = epoll_wait(t->ep, events, BENCH_EVENTS, 100);
+
+        for (i = 0; i < n; i++) {
+            c = events[i].data.ptr;
+
+            if (c != NULL) {
+                bench_echo(t, c);
+                continue;
+            }
+
+            for ( ;; ) {
+                fd = accept4(t->listen, NULL, NULL, SOCK_NONBLOCK);
+                if (fd == -1) {
+                    break;
+                }
+
+                one = 1;
+                (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+                                  &one, sizeof(one));
+
+                c = calloc(1, sizeof(bench_conn_t));
+                if (c == NULL) {
+                    (void) close(fd);
+                    continue;
+                }
+
+                c->fd = fd;
+
+                ee.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                ee.data.ptr = c;
+
+                if (epoll_ctl(t->ep, EPOLL_CTL_ADD, fd, &ee) == -1) {
+                    (void) close(fd);
+                    free(c);
+                    continue;
+                }
+
+                bench_echo(t, c);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+static int
+bench_listen(bench_thread_t *t)
+{
+    int                  one;
+    struct sockaddr_in   sin;
+    struct epoll_event   ee;
+
+    t->listen = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (t->listen == -1) {
+        perror("socket()");
+        return -1;
+    }
+
+    /* every thread has its own listening socket */
+
+    one = 1;
+    (void) setsockopt(t->listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    (void) setsockopt(t->listen, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(bench_server_port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(t->listen, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+        perror("bind()");
+        return -1;
+    }
+
+    if (listen(t->listen, 4096) == -1) {
+        perror("listen()");
+        return -1;
+    }
+
+    ee.events = EPOLLIN | EPOLLET;
+    ee.data.ptr = NULL;
+
+    if (epoll_ctl(t->ep, EPOLL_CTL_ADD, t->listen, &ee) == -1) {
+        perror("epoll_ctl()");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void
+bench_report(bench_thread_t *threads, double elapsed)
+{
+    int       i, j, k;
+    double    p[3];
+    uint64_t  ops, errors, sent, received, total, sum, rank;
+    uint64_t  hist[BENCH_BUCKETS];
+
+    static const int  permille[] = { 5000, 9900, 9990 };
+
+    ops = 0;
+    errors = 0;
+    sent = 0;
+    received = 0;
+
+    memset(hist, 0, sizeof(hist));
+
+    for (i = 0; i < bench_threads; i++) {
+        ops += threads[i].ops;
+        errors += threads[i].errors;
+        sent += threads[i].bytes_sent;
+        received += threads[i].bytes_received;
+
+        for (j = 0; j < BENCH_BUCKETS; j++) {
+            hist[j] += threads[i].hist[j];
+        }
+    }
+
+    /* the percentiles are the upper bounds of the buckets */
+
+    total = ops;
+    sum = 0;
+    j = 0;
+
+    for (k = 0; k < 3; k++) {
+        rank = (total * permille[k] + 9999) / 10000;
+
+        while (j < BENCH_BUCKETS && sum + hist[j] < rank) {
+            sum += hist[j];
+            j++;
+        }
+
+        p[k] = total ? bench_bucket_max(j) / 1000.0 : 0;
+    }
+
+    printf("{\"name\":\"%s\",\"mode\":\"%s\",\"threads\":%d,"
+           "\"connections\":%d,\"size\":%zu,\"pipeline\":%d,"
+           "\"duration\":%.3f,"
+           "\"ops\":%llu,\"ops_per_sec\":%.1f,\"errors\":%llu,"
+           "\"bytes_sent_per_sec\":%.0f,\"bytes_received_per_sec\":%.0f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}\n",
+           bench_name ? bench_name : bench_modes[bench_mode],
+           bench_modes[bench_mode], bench_threads, bench_connections,
+           bench_size, bench_pipeline, elapsed, (unsigned long long) ops, ops / elapsed,
+           (unsigned long long) errors, sent / elapsed, received / elapsed,
+           p[0], p[1], p[2]);
+
+    fflush(stdout);
+}
+
+
+static int
+bench_fetch(void)
+{
+    int      fd;
+    char     buf[4096];
+    ssize_t  n;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket()");
+        return 1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &bench_addr, sizeof(bench_addr))
+        == -1)
+    {
+        perror("connect()");
+        return 1;
+    }
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (fwrite(buf, 1, n, stdout) != (size_t) n) {
+            return 1;
+        }
+    }
+
+    if (n == -1) {
+        perror("read()");
+        return 1;
+    }
+
+    (void) close(fd);
+
+    return 0;
+}
+
+
+static void
+bench_usage(void)
+{
+    fprintf(stderr,
+            "usage: ngx_tcp_bench [-m connect|session|echo|bulk|sink] "
+            "[-t threads] [-c connections]\n"
+            "                     [-d seconds] [-s size] [-p depth] "
+            "[-n name] host:port\n"
+            "       ngx_tcp_bench -e port [-t threads] [-s size]\n"
+            "       ngx_tcp_bench -g host:port\n");
+
+    exit(2);
+}
+
+
+static int
+bench_parse_addr(char *text)
+{
+    char             *port;
+    struct addrinfo   hints, *res;
+
+    port = strrchr(text, ':');
+    if (port == NULL) {
+        return -1;
+    }
+
+    *port++ = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(text, port, &hints, &res) != 0) {
+        return -1;
+    }
+
+    memcpy(&bench_addr, res->ai_addr, sizeof(bench_addr));
+
+    freeaddrinfo(res);
+
+    return 0;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int              i, n, opt, per, rest;
+    double           elapsed;
+    uint64_t         start;
+    bench_thread_t  *threads, *t;
+
+    while ((opt = getopt(argc, argv, "m:t:c:d:s:p:n:e:g")) != -1) {
+
+        switch (opt) {
+
+        case 'm':
+            for (i = 0; i <= BENCH_SINK; i++) {
+                if (strcmp(optarg, bench_modes[i]) == 0) {
+                    break;
+                }
+            }
+
+            if (i > BENCH_SINK) {
+                bench_usage();
+            }
+
+            bench_mode = i;
+            break;
+
+        case 't':
+            bench_threads = atoi(optarg);
+            break;
+
+        case 'c':
+            bench_connections = atoi(optarg);
+            break;
+
+        case 'd':
+            bench_duration = atoi(optarg);
+            break;
+
+        case 's':
+            bench_size = (size_t) atol(optarg);
+            break;
+
+        case 'p':
+            bench_pipeline = atoi(optarg);
+            break;
+
+        case 'n':
+            bench_name = optarg;
+            break;
+
+        case 'e':
+            bench_server_port = atoi(optarg);
+            break;
+
+        case 'g':
+            bench_get = 1;
+            break;
+
+        default:
+            bench_usage();
+        }
+    }
+
+    if (bench_threads <= 0 || bench_connections <= 0 || bench_duration <= 0
+        || bench_size == 0 || bench_pipeline <= 0)
+    {
+        bench_usage();
+    }
+
+    if (bench_server_port == 0) {
+        if (optind != argc - 1 || bench_parse_addr(argv[optind]) != 0) {
+            bench_usage();
+        }
+
+        if (bench_get) {
+            return bench_fetch();
+        }
+
+        if (bench_threads > bench_connections) {
+            bench_threads = bench_connections;
+        }
+
+    } else if (bench_size < 16384) {
+        bench_size = 16384;
+    }
+
+    bench_round = bench_size * bench_pipeline;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    threads = calloc(bench_threads, sizeof(bench_thread_t));
+    if (threads == NULL) {
+        return 1;
+    }
+
+    per = bench_connections / bench_threads;
+    rest = bench_connections % bench_threads;
+
+    for (i = 0; i < bench_threads; i++) {
+        t = &threads[i];
+
+        t->ep = epoll_create1(0);
+        t->buf = malloc(bench_round);
+
+        if (t->ep == -1 || t->buf == NULL) {
+            perror("epoll_create1()");
+            return 1;
+        }
+
+        memset(t->buf, 'x', bench_round);
+
+        /* each message is a line, e.g. for "echo_frame delimiter" */
+
+        for (n = 1; bench_size > 1 && n <= bench_pipeline; n++) {
+            t->buf[n * bench_size - 2] = '\r';
+            t->buf[n * bench_size - 1] = '\n';
+        }
+
+        if (bench_server_port) {
+            if (bench_listen(t) != 0) {
+                return 1;
+            }
+
+            if (pthread_create(&t->tid, NULL, bench_server, t) != 0) {
+                return 1;
+            }
+
+            continue;
+        }
+
+        t->nconns = per + (i < rest);
+
+        t->conns = calloc(t->nconns, sizeof(bench_conn_t));
+        if (t->conns == NULL) {
+            return 1;
+        }
+
+        for (n = 0; n < t->nconns; n++) {
+            t->conns[n].fd = -1;
+        }
+    }
+
+    if (bench_server_port) {
+
+        /* runs until it is killed */
+
+        for (i = 0; i < bench_threads; i++) {
+            pthread_join(threads[i].tid, NULL);
+        }
+
+        return 0;
+    }
+
+    start = bench_now();
+
+    for (i = 0; i < bench_threads; i++) {
+        if (pthread_create(&threads[i].tid, NULL, bench_client, &threads[i])
+            != 0)
+        {
+            return 1;
+        }
+    }
+
+    sleep(bench_duration);
+
+    bench_stop = 1;
+
+    for (i = 0; i < bench_threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+    }
+
+    elapsed = (bench_now() - start) / 1e9;
+
+    bench_report(threads, elapsed);
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+#!/bin/sh
+
+# Copyright (C) Ngwsx
+
+# Runs the loopback benchmarks and prints one JSON object per test.
+#
+#     run.sh nginx ngx_tcp_bench [seconds]
+#
+# The load generator is also the echo server behind the proxied servers,
+# the "direct" tests measure it alone as the baseline.  The "core" tests
+# use the built-in echo, discard and chargen protocols to measure the
+# per-connection cost of the module without a real protocol, the "lines"
+# and "pipeline" ones the framed echo with one and with 16 requests
+# in flight.
+#
+# The "accept" tests run a second nginx with several workers, see
+# nginx-reuseport.conf, and open connections to a shared listen socket
+# and to a "reuseport" one; each is followed by a "balance" object with
+# the connections every worker has accepted, from the stats zone.
+
+
+set -e
+
+NGINX=$1
+BENCH=$2
+DURATION=${3:-10}
+THREADS=${NGX_BENCH_THREADS:-2}
+WORKERS=${NGX_BENCH_WORKERS:-4}
+
+if [ -z "$NGINX" ] || [ -z "$BENCH" ]; then
+    echo "usage: $0 nginx ngx_tcp_bench [seconds]" >&2
+    exit 2
+fi
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+PREFIX=$(mktemp -d "${TMPDIR:-/tmp}/ngx_tcp_bench.XXXXXX")
+
+mkdir -p "$PREFIX/logs"
+
+sed "s/^worker_processes .*/worker_processes  $WORKERS;/" \
+    "$DIR/nginx-reuseport.conf" > "$PREFIX/nginx-reuseport.conf"
+
+"$BENCH" -e 19000 -t "$THREADS" &
+ECHO=$!
+
+cleanup() {
+    "$NGINX" -p "$PREFIX/" -c "$DIR/nginx.conf" -s stop 2>/dev/null || true
+    "$NGINX" -p "$PREFIX/" -c "$PREFIX/nginx-reuseport.conf" -s stop \
+        2>/dev/null || true
+    kill $ECHO 2>/dev/null || true
+    rm -rf "$PREFIX"
+}
+
+trap cleanup EXIT
+
+"$NGINX" -p "$PREFIX/" -c "$DIR/nginx.conf"
+"$NGINX" -p "$PREFIX/" -c "$PREFIX/nginx-reuseport.conf"
+
+sleep 1
+
+run() {
+    name=$1
+    shift
+    "$BENCH" -n "$name" -t "$THREADS" -d "$DURATION" "$@"
+}
+
+# "pid accepted" of every worker of the stats zone
+
+accepted() {
+    "$BENCH" -g 127.0.0.1:19010 \
+        | sed 's/],"servers".*//' | tr '{' '\n' \
+        | sed -n 's/.*"pid":\([0-9]*\),"accepted":\([0-9]*\).*/\1 \2/p'
+}
+
+# the connections accepted by each worker during an accept test
+
+balance() {
+    name=$1
+    shift
+
+    accepted > "$PREFIX/before"
+    run "$name" "$@"
+    accepted > "$PREFIX/after"
+
+    awk -v name="$name" '
+        NR == FNR { before[$1] = $2; next }
+        {
+            n = $2 - before[$1]
+            list = list (list == "" ? "" : ",") n
+            if (workers == 0 || n < min) min = n
+            if (n > max) max = n
+            sum += n
+            workers++
+        }
+        END {
+            printf "{\"name\":\"%s_balance\",\"workers\":[%s],", \
+                   name, list
+            printf "\"min\":%d,\"max\":%d,\"max_over_mean\":%.3f}\n", \
+                   min, max, sum ? max * workers / sum : 0
+        }' "$PREFIX/before" "$PREFIX/after"
+}
+
+run direct_echo   -m echo    -c 64  -s 64     127.0.0.1:19000
+run direct_bulk   -m bulk    -c 16  -s 65536  127.0.0.1:19000
+
+run core_connect  -m connect -c 64            127.0.0.1:19003
+run core_session  -m session -c 64  -s 64     127.0.0.1:19003
+run core_echo     -m echo    -c 64  -s 64     127.0.0.1:19003
+run core_discard  -m bulk    -c 16  -s 65536  127.0.0.1:19004
+run core_chargen  -m sink    -c 16  -s 65536  127.0.0.1:19005
+run core_lines    -m echo    -c 64  -s 64     127.0.0.1:19006
+run core_pipeline -m echo    -c 64  -s 64  -p 16 127.0.0.1:19006
+
+run proxy_connect -m connect -c 64            127.0.0.1:19001
+run proxy_session -m session -c 64  -s 64     127.0.0.1:19001
+run proxy_echo    -m echo    -c 64  -s 64     127.0.0.1:19001
+run proxy_bulk    -m bulk    -c 16  -s 65536  127.0.0.1:19001
+run splice_bulk   -m bulk    -c 16  -s 65536  127.0.0.1:19002
+
+balance accept_shared    -m connect -c 64  127.0.0.1:19011
+balance accept_reuseport -m connect -c 64  127.0.0.1:19012
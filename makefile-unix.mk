@@ -16,3 +16,20 @@ CONF_ARGS= \
 	--add-module=$(ADDON_DIR)
 
 include $(NGINX_DIR)/unix.mk
+
+
+# the loopback benchmarks, see bench/run.sh
+
+BENCH_BIN=bench/ngx_tcp_bench
+BENCH_NGINX=$(NGINX_DIR)/objs/$(NGINX_BIN)
+BENCH_DURATION=10
+BENCH_OUT=bench.json
+
+bench: $(BENCH_BIN)
+	sh bench/run.sh $(BENCH_NGINX) $(BENCH_BIN) $(BENCH_DURATION) \
+		> $(BENCH_OUT)
+
+$(BENCH_BIN): bench/ngx_tcp_bench.c
+	$(CC) -O2 -Wall -pthread -o $(BENCH_BIN) bench/ngx_tcp_bench.c
+
+.PHONY: bench
@@ -12,7 +12,10 @@
 static char *ngx_tcp_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static ngx_int_t ngx_tcp_add_ports(ngx_conf_t *cf, ngx_array_t *ports,
     ngx_tcp_listen_t *listen);
-static char *ngx_tcp_optimize_servers(ngx_conf_t *cf, ngx_array_t *ports);
+static char *ngx_tcp_optimize_servers(ngx_conf_t *cf,
+    ngx_tcp_core_main_conf_t *cmcf, ngx_array_t *ports);
+static ngx_int_t ngx_tcp_index_addrs(ngx_tcp_core_main_conf_t *cmcf,
+    ngx_listening_t *ls);
 static ngx_int_t ngx_tcp_add_addrs(ngx_conf_t *cf, ngx_tcp_port_t *tport,
     ngx_tcp_conf_addr_t *addr);
 #if (NGX_HAVE_INET6)
@@ -20,6 +23,10 @@ static ngx_int_t ngx_tcp_add_addrs6(ngx_conf_t *cf, ngx_tcp_port_t *tport,
     ngx_tcp_conf_addr_t *addr);
 #endif
 static ngx_int_t ngx_tcp_cmp_conf_addrs(const void *one, const void *two);
+static ngx_int_t ngx_tcp_cmp_in_addrs(const void *one, const void *two);
+#if (NGX_HAVE_INET6)
+static ngx_int_t ngx_tcp_cmp_in6_addrs(const void *one, const void *two);
+#endif
 
 
 static ngx_command_t  ngx_tcp_commands[] = {
@@ -65,6 +72,7 @@ static char *
 ngx_tcp_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     char                       *rv;
+    size_t                      size;
     ngx_uint_t                  i, m, mi, s;
     ngx_conf_t                  pcf;
     ngx_array_t                 ports;
@@ -204,6 +212,17 @@ ngx_tcp_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     *cf = pcf;
 
 
+    /* the session blocks are recycled between the servers */
+
+    for (s = 0; s < cmcf->servers.nelts; s++) {
+        size = ngx_tcp_session_size(cscfp[s]->protocol);
+
+        if (size > cmcf->session_size) {
+            cmcf->session_size = size;
+        }
+    }
+
+
     if (ngx_array_init(&ports, cf->temp_pool, 4, sizeof(ngx_tcp_conf_port_t))
         != NGX_OK)
     {
@@ -218,7 +237,7 @@ ngx_tcp_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         }
     }
 
-    return ngx_tcp_optimize_servers(cf, &ports);
+    return ngx_tcp_optimize_servers(cf, cmcf, &ports);
 }
 
 
@@ -290,27 +309,43 @@ found:
     addr->sockaddr = (struct sockaddr *) &listen->sockaddr;
     addr->socklen = listen->socklen;
     addr->ctx = listen->ctx;
+    addr->backlog = listen->backlog;
+    addr->rcvbuf = listen->rcvbuf;
+    addr->sndbuf = listen->sndbuf;
+#if (NGX_HAVE_TCP_FASTOPEN)
+    addr->fastopen = listen->fastopen;
+#endif
     addr->bind = listen->bind;
     addr->wildcard = listen->wildcard;
 #if (NGX_TCP_SSL)
     addr->ssl = listen->ssl;
 #endif
+    addr->proxy_protocol = listen->proxy_protocol;
 #if (NGX_HAVE_INET6 && defined IPV6_V6ONLY)
     addr->ipv6only = listen->ipv6only;
 #endif
+#if (NGX_HAVE_REUSEPORT)
+    addr->reuseport = listen->reuseport;
+#endif
+#if (NGX_HAVE_DEFERRED_ACCEPT && defined TCP_DEFER_ACCEPT)
+    addr->deferred_accept = listen->deferred_accept;
+#endif
 
     return NGX_OK;
 }
 
 
 static char *
-ngx_tcp_optimize_servers(ngx_conf_t *cf, ngx_array_t *ports)
+ngx_tcp_optimize_servers(ngx_conf_t *cf, ngx_tcp_core_main_conf_t *cmcf,
+    ngx_array_t *ports)
 {
-    ngx_uint_t            i, p, last, bind_wildcard;
-    ngx_listening_t      *ls;
-    ngx_tcp_port_t       *tport;
-    ngx_tcp_conf_port_t  *port;
-    ngx_tcp_conf_addr_t  *addr;
+    size_t                    size;
+    ngx_uint_t                i, p, last, bind_wildcard;
+    ngx_listening_t          *ls;
+    ngx_tcp_port_t           *tport;
+    ngx_tcp_conf_port_t      *port;
+    ngx_tcp_conf_addr_t      *addr;
+    ngx_tcp_core_srv_conf_t  *cscf;
 
     port = ports->elts;
     for (p = 0; p < ports->nelts; p++) {
@@ -355,18 +390,64 @@ ngx_tcp_optimize_servers(ngx_conf_t *cf, ngx_array_t *ports)
 
             ls->addr_ntop = 1;
             ls->handler = ngx_tcp_init_connection;
-            /* TODO: ls->pool_size */
-            ls->pool_size = ngx_pagesize;
+
+            /*
+             * the pool of the default server, grown if needed to hold
+             * what ngx_event_accept() allocates, the peer address, its
+             * log and its text, and then the session block allocated in
+             * ngx_tcp_init_connection(); the address lookup may select
+             * any server of the port, so the largest session of all
+             * servers is used, unless the sessions are recycled and so
+             * taken from the free list instead of the pool
+             */
+
+            cscf = addr[i].ctx->srv_conf[ngx_tcp_core_module.ctx_index];
+
+            size = sizeof(ngx_pool_t)
+                   + ngx_align(NGX_SOCKADDRLEN, NGX_ALIGNMENT)
+                   + ngx_align(sizeof(ngx_log_t), NGX_ALIGNMENT)
+                   + ngx_align(ls->addr_text_max_len, NGX_ALIGNMENT);
+
+            if (cmcf->recycled_sessions == 0) {
+                size += cmcf->session_size;
+            }
+
+            size = ngx_align(size, NGX_POOL_ALIGNMENT);
+
+            ls->pool_size = ngx_max(cscf->connection_pool_size, size);
 
             /* TODO: error_log directive */
             ls->logp = &cf->cycle->new_log;
             ls->log.data = &ls->addr_text;
             ls->log.handler = ngx_accept_log_error;
 
+            ls->backlog = addr[i].backlog;
+            ls->rcvbuf = addr[i].rcvbuf;
+            ls->sndbuf = addr[i].sndbuf;
+
 #if (NGX_HAVE_INET6 && defined IPV6_V6ONLY)
             ls->ipv6only = addr[i].ipv6only;
 #endif
 
+#if (NGX_HAVE_DEFERRED_ACCEPT && defined TCP_DEFER_ACCEPT)
+            ls->deferred_accept = addr[i].deferred_accept;
+#endif
+
+#if (NGX_HAVE_TCP_FASTOPEN)
+            ls->fastopen = addr[i].fastopen;
+#endif
+
+#if (NGX_HAVE_REUSEPORT)
+
+            /*
+             * each worker gets its own copy of the socket, cloned by
+             * ngx_event_init_conf(), and the kernel spreads the connections
+             * between them
+             */
+
+            ls->reuseport = addr[i].reuseport;
+#endif
+
             tport = ngx_palloc(cf->pool, sizeof(ngx_tcp_port_t));
             if (tport == NULL) {
                 return NGX_CONF_ERROR;
@@ -397,6 +478,10 @@ ngx_tcp_optimize_servers(ngx_conf_t *cf, ngx_array_t *ports)
                 break;
             }
 
+            if (ngx_tcp_index_addrs(cmcf, ls) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
             addr++;
             last--;
         }
@@ -433,6 +518,7 @@ ngx_tcp_add_addrs(ngx_conf_t *cf, ngx_tcp_port_t *tport,
 #if (NGX_TCP_SSL)
         addrs[i].conf.ssl = addr[i].ssl;
 #endif
+        addrs[i].conf.proxy_protocol = addr[i].proxy_protocol;
 
         len = ngx_sock_ntop(addr[i].sockaddr, buf, NGX_SOCKADDR_STRLEN, 1);
 
@@ -447,6 +533,16 @@ ngx_tcp_add_addrs(ngx_conf_t *cf, ngx_tcp_port_t *tport,
         addrs[i].conf.addr_text.data = p;
     }
 
+    /*
+     * the addresses before the "*:port" wildcard are sorted
+     * to be looked up by binary search in ngx_tcp_init_connection()
+     */
+
+    if (tport->naddrs > 2) {
+        ngx_sort(addrs, tport->naddrs - 1, sizeof(ngx_tcp_in_addr_t),
+                 ngx_tcp_cmp_in_addrs);
+    }
+
     return NGX_OK;
 }
 
@@ -480,6 +576,7 @@ ngx_tcp_add_addrs6(ngx_conf_t *cf, ngx_tcp_port_t *tport,
 #if (NGX_TCP_SSL)
         addrs6[i].conf.ssl = addr[i].ssl;
 #endif
+        addrs6[i].conf.proxy_protocol = addr[i].proxy_protocol;
 
         len = ngx_sock_ntop(addr[i].sockaddr, buf, NGX_SOCKADDR_STRLEN, 1);
 
@@ -494,12 +591,60 @@ ngx_tcp_add_addrs6(ngx_conf_t *cf, ngx_tcp_port_t *tport,
         addrs6[i].conf.addr_text.data = p;
     }
 
+    if (tport->naddrs > 2) {
+        ngx_sort(addrs6, tport->naddrs - 1, sizeof(ngx_tcp_in6_addr_t),
+                 ngx_tcp_cmp_in6_addrs);
+    }
+
     return NGX_OK;
 }
 
 #endif
 
 
+static ngx_int_t
+ngx_tcp_index_addrs(ngx_tcp_core_main_conf_t *cmcf, ngx_listening_t *ls)
+{
+    ngx_uint_t             i;
+    ngx_tcp_port_t        *tport;
+    ngx_tcp_in_addr_t     *addrs;
+    ngx_tcp_addr_conf_t   *conf, **confp;
+#if (NGX_HAVE_INET6)
+    ngx_tcp_in6_addr_t    *addrs6;
+#endif
+
+    /* the listen addresses are numbered for the statistics */
+
+    tport = ls->servers;
+
+    for (i = 0; i < tport->naddrs; i++) {
+
+        switch (ls->sockaddr->sa_family) {
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            addrs6 = tport->addrs;
+            conf = &addrs6[i].conf;
+            break;
+#endif
+        default: /* AF_INET */
+            addrs = tport->addrs;
+            conf = &addrs[i].conf;
+            break;
+        }
+
+        confp = ngx_array_push(&cmcf->addrs);
+        if (confp == NULL) {
+            return NGX_ERROR;
+        }
+
+        conf->index = cmcf->addrs.nelts - 1;
+        *confp = conf;
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_tcp_cmp_conf_addrs(const void *one, const void *two)
 {
@@ -527,3 +672,41 @@ ngx_tcp_cmp_conf_addrs(const void *one, const void *two)
 
     return 0;
 }
+
+
+static ngx_int_t
+ngx_tcp_cmp_in_addrs(const void *one, const void *two)
+{
+    ngx_tcp_in_addr_t  *first, *second;
+
+    first = (ngx_tcp_in_addr_t *) one;
+    second = (ngx_tcp_in_addr_t *) two;
+
+    /* the order only has to match the lookup, so network order will do */
+
+    if (first->addr < second->addr) {
+        return -1;
+    }
+
+    if (first->addr > second->addr) {
+        return 1;
+    }
+
+    return 0;
+}
+
+
+#if (NGX_HAVE_INET6)
+
+static ngx_int_t
+ngx_tcp_cmp_in6_addrs(const void *one, const void *two)
+{
+    ngx_tcp_in6_addr_t  *first, *second;
+
+    first = (ngx_tcp_in6_addr_t *) one;
+    second = (ngx_tcp_in6_addr_t *) two;
+
+    return ngx_memcmp(&first->addr6, &second->addr6, 16);
+}
+
+#endif
@@ -13,6 +13,19 @@
 #include <ngx_event.h>
 #include <ngx_event_connect.h>
 
+
+typedef struct ngx_tcp_session_s  ngx_tcp_session_t;
+
+
+#include <ngx_tcp_upstream.h>
+#include <ngx_tcp_frame.h>
+#include <ngx_tcp_proxy_protocol.h>
+#include <ngx_tcp_timer_wheel.h>
+#include <ngx_tcp_stats_module.h>
+#include <ngx_tcp_log_module.h>
+#include <ngx_tcp_ssl_preread_module.h>
+#include <ngx_tcp_limit_module.h>
+
 #if (NGX_TCP_SSL)
 #include <ngx_tcp_ssl_module.h>
 #endif
@@ -31,23 +44,39 @@ typedef struct {
     /* server ctx */
     ngx_tcp_conf_ctx_t     *ctx;
 
+    int                     backlog;
+    int                     rcvbuf;
+    int                     sndbuf;
+#if (NGX_HAVE_TCP_FASTOPEN)
+    int                     fastopen;
+#endif
+
     unsigned                bind:1;
     unsigned                wildcard:1;
 #if (NGX_TCP_SSL)
     unsigned                ssl:1;
 #endif
+    unsigned                proxy_protocol:1;
 #if (NGX_HAVE_INET6 && defined IPV6_V6ONLY)
     unsigned                ipv6only:2;
 #endif
+#if (NGX_HAVE_REUSEPORT)
+    unsigned                reuseport:1;
+#endif
+#if (NGX_HAVE_DEFERRED_ACCEPT && defined TCP_DEFER_ACCEPT)
+    unsigned                deferred_accept:1;
+#endif
 } ngx_tcp_listen_t;
 
 
 typedef struct {
     ngx_tcp_conf_ctx_t     *ctx;
     ngx_str_t               addr_text;
+    ngx_uint_t              index;     /* in ngx_tcp_core_main_conf_t.addrs */
 #if (NGX_TCP_SSL)
     ngx_uint_t              ssl;    /* unsigned   ssl:1; */
 #endif
+    unsigned                proxy_protocol:1;
 } ngx_tcp_addr_conf_t;
 
 
@@ -87,20 +116,50 @@ typedef struct {
 
     ngx_tcp_conf_ctx_t     *ctx;
 
+    int                     backlog;
+    int                     rcvbuf;
+    int                     sndbuf;
+#if (NGX_HAVE_TCP_FASTOPEN)
+    int                     fastopen;
+#endif
+
     unsigned                bind:1;
     unsigned                wildcard:1;
 #if (NGX_TCP_SSL)
     unsigned                ssl:1;
 #endif
+    unsigned                proxy_protocol:1;
 #if (NGX_HAVE_INET6 && defined IPV6_V6ONLY)
     unsigned                ipv6only:2;
 #endif
+#if (NGX_HAVE_REUSEPORT)
+    unsigned                reuseport:1;
+#endif
+#if (NGX_HAVE_DEFERRED_ACCEPT && defined TCP_DEFER_ACCEPT)
+    unsigned                deferred_accept:1;
+#endif
 } ngx_tcp_conf_addr_t;
 
 
 typedef struct {
     ngx_array_t             servers;     /* ngx_tcp_core_srv_conf_t */
     ngx_array_t             listen;      /* ngx_tcp_listen_t */
+    ngx_array_t             addrs;       /* ngx_tcp_addr_conf_t * */
+
+    /* the largest ngx_tcp_session_size() of the servers */
+    size_t                  session_size;
+
+    /* per worker free list of the session blocks */
+    ngx_uint_t              recycled_sessions;
+    void                   *free_sessions;
+    ngx_uint_t              nfree_sessions;
+
+    ngx_uint_t              session_hits;
+    ngx_uint_t              session_misses;
+
+    /* "timer_wheel", the per worker wheel of the idle timeouts */
+    ngx_flag_t              wheel;
+    ngx_tcp_timer_wheel_t  *timer_wheel;
 } ngx_tcp_core_main_conf_t;
 
 
@@ -113,13 +172,49 @@ typedef struct {
     ngx_msec_t              timeout;
     ngx_msec_t              resolver_timeout;
 
+    /* "timeout" unless set: the PROXY protocol header and SSL handshake */
+    ngx_msec_t              handshake_timeout;
+
+    /* waiting for the client to send and to take the output */
+    ngx_msec_t              read_timeout;
+    ngx_msec_t              send_timeout;
+
+    /* connecting to an upstream and idle between proxied data */
+    ngx_msec_t              connect_timeout;
+    ngx_msec_t              proxy_timeout;
+
     ngx_flag_t              so_keepalive;
 
+    size_t                  connection_pool_size;
+
+    /* the session buffers, see ngx_tcp_get_buf() */
+    ngx_bufs_t              bufs;
+
+    /* the requests processed in a row, see ngx_tcp_process_requests() */
+    ngx_uint_t              requests_per_event;
+
+    /* 1 of log_sample connections is logged, log_rate at most per interval */
+    ngx_uint_t              log_sample;
+    ngx_uint_t              log_rate;
+    time_t                  log_interval;
+
+    /* per worker state of the connection log */
+    ngx_uint_t              log_connections;
+    ngx_uint_t              log_logged;
+    ngx_uint_t              log_suppressed;
+    time_t                  log_start;
+
+    /* reports log_suppressed once the interval is over */
+    ngx_event_t             log_event;
+
     ngx_str_t               server_name;
 
     u_char                 *file_name;
     ngx_int_t               line;
 
+    /* in ngx_tcp_core_main_conf_t.servers */
+    ngx_uint_t              index;
+
     ngx_resolver_t         *resolver;
 
     /* server ctx */
@@ -127,13 +222,44 @@ typedef struct {
 } ngx_tcp_core_srv_conf_t;
 
 
+#if (NGX_HAVE_SPLICE)
+
+typedef struct {
+    ngx_fd_t                fd[2];
+    size_t                  size;        /* bytes queued in the pipe */
+    size_t                  capacity;
+} ngx_tcp_proxy_pipe_t;
+
+#endif
+
+
 typedef struct {
     ngx_peer_connection_t   upstream;
     ngx_buf_t              *buffer;
+
+    /* the PROXY protocol header not sent yet, it goes before s->buffer */
+    ngx_buf_t              *header;
+
+    /* the balancer's peer functions wrapped by the upstream ones */
+    ngx_event_get_peer_pt   get_peer;
+    ngx_event_free_peer_pt  free_peer;
+    void                   *peer_data;
+
+#if (NGX_HAVE_SPLICE)
+    /* client -> upstream and upstream -> client, NULL if copying */
+    ngx_tcp_proxy_pipe_t   *downstream_pipe;
+    ngx_tcp_proxy_pipe_t   *upstream_pipe;
+#endif
+
+    /* set by the protocol's close_session to return upstream to the pool */
+    unsigned                keepalive:1;
+
+    /* a peer was got from the balancer and has not been freed yet */
+    unsigned                peer:1;
 } ngx_tcp_proxy_ctx_t;
 
 
-typedef struct {
+struct ngx_tcp_session_s {
     ngx_connection_t       *connection;
 
     ngx_buf_t              *buffer;
@@ -146,6 +272,49 @@ typedef struct {
 
     ngx_tcp_proxy_ctx_t    *proxy;
 
+    /* chosen before the session starts, it overrides "proxy_pass" */
+    ngx_tcp_upstream_srv_conf_t  *upstream;
+
+    /* ngx_tcp_protocol_t.ctx_size bytes allocated with the session */
+    void                   *protocol_ctx;
+
+    /* the worker's counters of the server and of the listen address */
+    ngx_tcp_stats_counters_t  *stats;
+    ngx_tcp_stats_counters_t  *addr_stats;
+
+    /* the worker's latency histograms of the server, in microseconds */
+    ngx_atomic_uint_t      *hists;
+    uint64_t                start_time;
+    uint64_t                phase_time;
+
+    /* the handshake may overlap the upstream connect with early data */
+    uint64_t                handshake_time;
+
+    /* bytes read from the client */
+    off_t                   received;
+
+    /* the input not consumed yet and the output not sent yet */
+    ngx_chain_t            *in;
+    ngx_chain_t            *out;
+
+    /* the session buffers allocated and the ones of them not used */
+    ngx_uint_t              nbufs;
+    ngx_chain_t            *free;
+
+    /* the links not used, see ngx_tcp_get_link() */
+    ngx_chain_t            *free_links;
+
+    /* the idle timeout, see ngx_tcp_add_idle_timer() */
+    ngx_event_t            *idle_event;
+    ngx_queue_t             idle_queue;
+    ngx_uint_t              idle_expire;
+    ngx_uint_t              idle_slot;
+
+    /* for the access log */
+    ngx_msec_t              start_msec;
+    ngx_uint_t              status;
+
+    unsigned                recycled:1;
     unsigned                blocked:1;
     unsigned                quit:1;
     unsigned                quoted:1;
@@ -153,9 +322,29 @@ typedef struct {
     unsigned                no_sync_literal:1;
     unsigned                starttls:1;
 
+    /* accepted on a "listen ... ssl" socket */
+    unsigned                ssl:1;
+
+    /* the kernel encrypts the output, see "ssl_ktls" */
+    unsigned                ktls:1;
+
+    /*
+     * the input starts with TLS 1.3 early data: it is read before
+     * the handshake is finished and may be a replay of another session
+     * within the window of "ssl_early_data_zone"; the flag is cleared
+     * once the handshake is finished, see ngx_tcp_ssl_early_data()
+     */
+    unsigned                early_data:1;
+
+    /* the early data were accepted, for $ssl_early_data */
+    unsigned                early_data_accepted:1;
+
     ngx_str_t              *addr_text;
+
+    /* the server name and the ALPN protocols of the ClientHello */
     ngx_str_t               host;
-} ngx_tcp_session_t;
+    ngx_str_t               alpn;
+};
 
 
 typedef struct {
@@ -167,12 +356,21 @@ typedef struct {
 #define NGX_TCP_PARSE_INVALID_COMMAND  20
 
 
+/* the session status logged, as in the http and stream modules */
+
+#define NGX_TCP_OK                     200
+#define NGX_TCP_BAD_REQUEST            400
+#define NGX_TCP_INTERNAL_SERVER_ERROR  500
+#define NGX_TCP_BAD_GATEWAY            502
+
+
 typedef ngx_int_t (*ngx_tcp_init_session_pt)(ngx_tcp_session_t *s);
 typedef void (*ngx_tcp_close_session_pt)(ngx_tcp_session_t *s);
 typedef void (*ngx_tcp_process_session_pt)(ngx_tcp_session_t *s);
 typedef void (*ngx_tcp_process_proxy_response_pt)(ngx_tcp_session_t *s,
     u_char *buf, size_t size);
 typedef void (*ngx_tcp_internal_server_error_pt)(ngx_tcp_session_t *s);
+typedef ngx_int_t (*ngx_tcp_process_request_pt)(ngx_tcp_session_t *s);
 
 
 struct ngx_tcp_protocol_s {
@@ -182,6 +380,12 @@ struct ngx_tcp_protocol_s {
     ngx_tcp_process_session_pt         process_session;
     ngx_tcp_process_proxy_response_pt  process_proxy_response;
     ngx_tcp_internal_server_error_pt   internal_server_error;
+
+    /* the size of the per session state, see s->protocol_ctx */
+    size_t                             ctx_size;
+
+    /* handles one request, see ngx_tcp_process_requests() */
+    ngx_tcp_process_request_pt         process_request;
 };
 
 
@@ -201,6 +405,7 @@ typedef struct {
 
 #define NGX_TCP_MAIN_CONF       0x02000000
 #define NGX_TCP_SRV_CONF        0x04000000
+#define NGX_TCP_UPS_CONF        0x08000000
 
 
 #define NGX_TCP_MAIN_CONF_OFFSET  offsetof(ngx_tcp_conf_ctx_t, main_conf)
@@ -221,25 +426,40 @@ typedef struct {
 #define ngx_tcp_conf_get_module_srv_conf(cf, module)                         \
     ((ngx_tcp_conf_ctx_t *) cf->ctx)->srv_conf[module.ctx_index]
 
+#define ngx_tcp_cycle_get_module_main_conf(cycle, module)                    \
+    (cycle->conf_ctx[ngx_tcp_module.index] ?                                 \
+        ((ngx_tcp_conf_ctx_t *) cycle->conf_ctx[ngx_tcp_module.index])       \
+            ->main_conf[module.ctx_index]:                                   \
+        NULL)
+
 
 #if (NGX_TCP_SSL)
 void ngx_tcp_starttls_handler(ngx_event_t *rev);
 ngx_int_t ngx_tcp_starttls_only(ngx_tcp_session_t *s, ngx_connection_t *c);
+ngx_uint_t ngx_tcp_ssl_early_data(ngx_tcp_session_t *s);
 #endif
 
 
+size_t ngx_tcp_session_size(ngx_tcp_protocol_t *protocol);
 void ngx_tcp_init_connection(ngx_connection_t *c);
 void ngx_tcp_close_connection(ngx_connection_t *c);
 void ngx_tcp_internal_server_error(ngx_tcp_session_t *s);
+ngx_chain_t *ngx_tcp_get_buf(ngx_tcp_session_t *s);
+ngx_chain_t *ngx_tcp_get_link(ngx_tcp_session_t *s);
+void ngx_tcp_free_buf(ngx_tcp_session_t *s, ngx_chain_t *cl);
+ssize_t ngx_tcp_recv_chain(ngx_tcp_session_t *s);
+void ngx_tcp_free_input(ngx_tcp_session_t *s);
+void ngx_tcp_queue_chain(ngx_tcp_session_t *s, ngx_chain_t *in);
+ngx_int_t ngx_tcp_send_chain(ngx_tcp_session_t *s, ngx_chain_t *in);
+void ngx_tcp_process_requests(ngx_tcp_session_t *s);
 u_char *ngx_tcp_log_error(ngx_log_t *log, u_char *buf, size_t len);
 
 
-/* STUB */
 void ngx_tcp_proxy_init(ngx_tcp_session_t *s, ngx_addr_t *peer);
-/**/
 
 
 extern ngx_uint_t    ngx_tcp_max_module;
+extern ngx_module_t  ngx_tcp_module;
 extern ngx_module_t  ngx_tcp_core_module;
 
 
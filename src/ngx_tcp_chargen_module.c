@@ -0,0 +1,243 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_tcp.h>
+
+
+/*
+ * the chargen protocol sends the lines of RFC 864 until the client closes
+ * the connection: 72 of the 95 printable characters, each line starting
+ * one character further; the pattern repeats after 95 lines
+ */
+
+#define NGX_TCP_CHARGEN_LINE     72
+#define NGX_TCP_CHARGEN_CHARS    95
+#define NGX_TCP_CHARGEN_PERIOD   (NGX_TCP_CHARGEN_CHARS                       \
+                                  * (NGX_TCP_CHARGEN_LINE + 2))
+
+/* the sends and the reads done in a row before other connections get a turn */
+#define NGX_TCP_CHARGEN_SENDS    16
+#define NGX_TCP_CHARGEN_READS    16
+
+
+static ngx_int_t ngx_tcp_chargen_init_module(ngx_cycle_t *cycle);
+static ngx_int_t ngx_tcp_chargen_init_session(ngx_tcp_session_t *s);
+static void ngx_tcp_chargen_process_session(ngx_tcp_session_t *s);
+static void ngx_tcp_chargen_close_session(ngx_tcp_session_t *s);
+static void ngx_tcp_chargen_write_handler(ngx_event_t *wev);
+static void ngx_tcp_chargen_read_handler(ngx_event_t *rev);
+
+
+static ngx_tcp_protocol_t  ngx_tcp_chargen_protocol = {
+    ngx_string("chargen"),
+    ngx_tcp_chargen_init_session,
+    ngx_tcp_chargen_close_session,
+    ngx_tcp_chargen_process_session,
+    NULL,
+    NULL,
+    sizeof(ngx_uint_t)
+};
+
+
+static ngx_tcp_module_t  ngx_tcp_chargen_module_ctx = {
+    &ngx_tcp_chargen_protocol,             /* protocol */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL                                   /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_tcp_chargen_module = {
+    NGX_MODULE_V1,
+    &ngx_tcp_chargen_module_ctx,           /* module context */
+    NULL,                                  /* module directives */
+    NGX_TCP_MODULE,                        /* module type */
+    NULL,                                  /* init master */
+    ngx_tcp_chargen_init_module,           /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * the pattern is stored twice, so a full period starts contiguously
+ * at any offset; the session keeps only its offset
+ */
+
+static u_char  ngx_tcp_chargen_pattern[2 * NGX_TCP_CHARGEN_PERIOD];
+
+/* the input of the client is read and ignored */
+
+static u_char  ngx_tcp_chargen_buffer[1024];
+
+
+static ngx_int_t
+ngx_tcp_chargen_init_module(ngx_cycle_t *cycle)
+{
+    u_char      *p;
+    ngx_uint_t   i, j;
+
+    p = ngx_tcp_chargen_pattern;
+
+    for (i = 0; i < 2 * NGX_TCP_CHARGEN_CHARS; i++) {
+
+        for (j = 0; j < NGX_TCP_CHARGEN_LINE; j++) {
+            *p++ = (u_char) (' ' + (i + j) % NGX_TCP_CHARGEN_CHARS);
+        }
+
+        *p++ = CR;
+        *p++ = LF;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_tcp_chargen_init_session(ngx_tcp_session_t *s)
+{
+    return NGX_OK;
+}
+
+
+static void
+ngx_tcp_chargen_process_session(ngx_tcp_session_t *s)
+{
+    ngx_connection_t  *c;
+
+    c = s->connection;
+
+    c->log->action = "generating characters";
+
+    c->read->handler = ngx_tcp_chargen_read_handler;
+    c->write->handler = ngx_tcp_chargen_write_handler;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    ngx_tcp_chargen_write_handler(c->write);
+}
+
+
+static void
+ngx_tcp_chargen_close_session(ngx_tcp_session_t *s)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, s->connection->log, 0,
+                   "tcp chargen done: %O sent", s->connection->sent);
+}
+
+
+static void
+ngx_tcp_chargen_write_handler(ngx_event_t *wev)
+{
+    ssize_t                   n;
+    ngx_uint_t               *offset, i;
+    ngx_connection_t         *c;
+    ngx_tcp_session_t        *s;
+    ngx_tcp_core_srv_conf_t  *cscf;
+
+    c = wev->data;
+    s = c->data;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out");
+        ngx_tcp_stats_inc(s, send_timeouts);
+        c->timedout = 1;
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    offset = s->protocol_ctx;
+
+    for (i = 0; i < NGX_TCP_CHARGEN_SENDS && wev->ready; i++) {
+
+        n = c->send(c, ngx_tcp_chargen_pattern + *offset,
+                    NGX_TCP_CHARGEN_PERIOD);
+
+        if (n == NGX_ERROR) {
+            ngx_tcp_close_connection(c);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        *offset = (*offset + n) % NGX_TCP_CHARGEN_PERIOD;
+    }
+
+    if (wev->ready) {
+
+        /* a fast client does not hold the worker */
+
+        ngx_tcp_del_idle_timer(s);
+
+        ngx_post_event(wev, &ngx_posted_events);
+        return;
+    }
+
+    if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+
+    ngx_tcp_add_idle_timer(s, wev, cscf->send_timeout);
+}
+
+
+static void
+ngx_tcp_chargen_read_handler(ngx_event_t *rev)
+{
+    ssize_t             n;
+    ngx_uint_t          i;
+    ngx_connection_t   *c;
+    ngx_tcp_session_t  *s;
+
+    c = rev->data;
+    s = c->data;
+
+    for (i = 0; i < NGX_TCP_CHARGEN_READS && rev->ready; i++) {
+
+        n = c->recv(c, ngx_tcp_chargen_buffer, sizeof(ngx_tcp_chargen_buffer));
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_tcp_close_connection(c);
+            return;
+        }
+
+        s->received += n;
+    }
+
+    if (rev->ready) {
+
+        /* the idle timer is on the write side, so the read is just posted */
+
+        ngx_post_event(rev, &ngx_posted_events);
+        return;
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_tcp_close_connection(c);
+    }
+}
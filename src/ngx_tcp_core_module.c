@@ -10,6 +10,7 @@
 
 
 static void *ngx_tcp_core_create_main_conf(ngx_conf_t *cf);
+static char *ngx_tcp_core_init_main_conf(ngx_conf_t *cf, void *conf);
 static void *ngx_tcp_core_create_srv_conf(ngx_conf_t *cf);
 static char *ngx_tcp_core_merge_srv_conf(ngx_conf_t *cf, void *parent,
     void *child);
@@ -22,6 +23,20 @@ static char *ngx_tcp_core_protocol(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_tcp_core_resolver(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_tcp_core_log_sample(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_tcp_core_log_rate_limit(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_tcp_core_pool_size(ngx_conf_t *cf, void *post, void *data);
+static void ngx_tcp_core_exit_process(ngx_cycle_t *cycle);
+
+
+static ngx_conf_post_handler_pt  ngx_tcp_core_pool_size_p =
+    ngx_tcp_core_pool_size;
+
+static ngx_conf_num_bounds_t  ngx_tcp_core_requests_per_event_bounds = {
+    ngx_conf_check_num_bounds, 1, -1
+};
 
 
 static ngx_command_t  ngx_tcp_core_commands[] = {
@@ -33,6 +48,20 @@ static ngx_command_t  ngx_tcp_core_commands[] = {
       0,
       NULL },
 
+    { ngx_string("recycled_sessions"),
+      NGX_TCP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_TCP_MAIN_CONF_OFFSET,
+      offsetof(ngx_tcp_core_main_conf_t, recycled_sessions),
+      NULL },
+
+    { ngx_string("timer_wheel"),
+      NGX_TCP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_TCP_MAIN_CONF_OFFSET,
+      offsetof(ngx_tcp_core_main_conf_t, wheel),
+      NULL },
+
     { ngx_string("listen"),
       NGX_TCP_SRV_CONF|NGX_CONF_TAKE12,
       ngx_tcp_core_listen,
@@ -61,6 +90,76 @@ static ngx_command_t  ngx_tcp_core_commands[] = {
       offsetof(ngx_tcp_core_srv_conf_t, timeout),
       NULL },
 
+    { ngx_string("handshake_timeout"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_core_srv_conf_t, handshake_timeout),
+      NULL },
+
+    { ngx_string("read_timeout"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_core_srv_conf_t, read_timeout),
+      NULL },
+
+    { ngx_string("send_timeout"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_core_srv_conf_t, send_timeout),
+      NULL },
+
+    { ngx_string("connect_timeout"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_core_srv_conf_t, connect_timeout),
+      NULL },
+
+    { ngx_string("proxy_timeout"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_core_srv_conf_t, proxy_timeout),
+      NULL },
+
+    { ngx_string("connection_pool_size"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_core_srv_conf_t, connection_pool_size),
+      &ngx_tcp_core_pool_size_p },
+
+    { ngx_string("tcp_buffers"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE2,
+      ngx_conf_set_bufs_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_core_srv_conf_t, bufs),
+      NULL },
+
+    { ngx_string("requests_per_event"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_core_srv_conf_t, requests_per_event),
+      &ngx_tcp_core_requests_per_event_bounds },
+
+    { ngx_string("connection_log_sample"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_tcp_core_log_sample,
+      NGX_TCP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("log_rate_limit"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_tcp_core_log_rate_limit,
+      NGX_TCP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("server_name"),
       NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_slot,
@@ -90,7 +189,7 @@ static ngx_tcp_module_t  ngx_tcp_core_module_ctx = {
     NULL,                                  /* protocol */
 
     ngx_tcp_core_create_main_conf,         /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_tcp_core_init_main_conf,           /* init main configuration */
 
     ngx_tcp_core_create_srv_conf,          /* create server configuration */
     ngx_tcp_core_merge_srv_conf            /* merge server configuration */
@@ -107,7 +206,7 @@ ngx_module_t  ngx_tcp_core_module = {
     NULL,                                  /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_tcp_core_exit_process,             /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -136,10 +235,50 @@ ngx_tcp_core_create_main_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    if (ngx_array_init(&cmcf->addrs, cf->pool, 4,
+                       sizeof(ngx_tcp_addr_conf_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     cmcf->session_size = 0;
+     *     cmcf->free_sessions = NULL;
+     *     cmcf->nfree_sessions = 0;
+     *     cmcf->session_hits = 0;
+     *     cmcf->session_misses = 0;
+     *     cmcf->timer_wheel = NULL;
+     */
+
+    cmcf->recycled_sessions = NGX_CONF_UNSET_UINT;
+    cmcf->wheel = NGX_CONF_UNSET;
+
     return cmcf;
 }
 
 
+static char *
+ngx_tcp_core_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_tcp_core_main_conf_t *cmcf = conf;
+
+    ngx_conf_init_uint_value(cmcf->recycled_sessions, 0);
+    ngx_conf_init_value(cmcf->wheel, 0);
+
+    if (cmcf->wheel) {
+        cmcf->timer_wheel = ngx_tcp_timer_wheel_create(cf);
+        if (cmcf->timer_wheel == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
 static void *
 ngx_tcp_core_create_srv_conf(ngx_conf_t *cf)
 {
@@ -154,11 +293,26 @@ ngx_tcp_core_create_srv_conf(ngx_conf_t *cf)
      * set by ngx_pcalloc():
      *
      *     cscf->protocol = NULL;
+     *     cscf->bufs.num = 0;
+     *     cscf->log_connections = 0;
+     *     cscf->log_logged = 0;
+     *     cscf->log_suppressed = 0;
+     *     cscf->log_start = 0;
      */
 
     cscf->timeout = NGX_CONF_UNSET_MSEC;
     cscf->resolver_timeout = NGX_CONF_UNSET_MSEC;
+    cscf->handshake_timeout = NGX_CONF_UNSET_MSEC;
+    cscf->read_timeout = NGX_CONF_UNSET_MSEC;
+    cscf->send_timeout = NGX_CONF_UNSET_MSEC;
+    cscf->connect_timeout = NGX_CONF_UNSET_MSEC;
+    cscf->proxy_timeout = NGX_CONF_UNSET_MSEC;
     cscf->so_keepalive = NGX_CONF_UNSET;
+    cscf->connection_pool_size = NGX_CONF_UNSET_SIZE;
+    cscf->requests_per_event = NGX_CONF_UNSET_UINT;
+    cscf->log_sample = NGX_CONF_UNSET_UINT;
+    cscf->log_rate = NGX_CONF_UNSET_UINT;
+    cscf->log_interval = NGX_CONF_UNSET;
 
     cscf->resolver = NGX_CONF_UNSET_PTR;
 
@@ -179,8 +333,37 @@ ngx_tcp_core_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_msec_value(conf->resolver_timeout, prev->resolver_timeout,
                               30000);
 
+    /* each of the timeouts falls back to "timeout" */
+
+    ngx_conf_merge_msec_value(conf->handshake_timeout,
+                              prev->handshake_timeout, conf->timeout);
+    ngx_conf_merge_msec_value(conf->read_timeout, prev->read_timeout,
+                              conf->timeout);
+    ngx_conf_merge_msec_value(conf->send_timeout, prev->send_timeout,
+                              conf->timeout);
+    ngx_conf_merge_msec_value(conf->connect_timeout, prev->connect_timeout,
+                              conf->timeout);
+    ngx_conf_merge_msec_value(conf->proxy_timeout, prev->proxy_timeout,
+                              conf->timeout);
+
     ngx_conf_merge_value(conf->so_keepalive, prev->so_keepalive, 0);
 
+    ngx_conf_merge_size_value(conf->connection_pool_size,
+                              prev->connection_pool_size, 64 * sizeof(void *));
+
+    ngx_conf_merge_bufs_value(conf->bufs, prev->bufs, 8, ngx_pagesize);
+
+    ngx_conf_merge_uint_value(conf->requests_per_event,
+                              prev->requests_per_event, 16);
+
+    ngx_conf_merge_uint_value(conf->log_sample, prev->log_sample, 1);
+
+    if (conf->log_rate == NGX_CONF_UNSET_UINT) {
+        conf->log_rate = (prev->log_rate == NGX_CONF_UNSET_UINT)
+                         ? 0 : prev->log_rate;
+        conf->log_interval = (prev->log_interval == NGX_CONF_UNSET)
+                             ? 1 : prev->log_interval;
+    }
 
     ngx_conf_merge_str_value(conf->server_name, prev->server_name, "");
 
@@ -252,6 +435,8 @@ ngx_tcp_core_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     cmcf = ctx->main_conf[ngx_tcp_core_module.ctx_index];
 
+    cscf->index = cmcf->servers.nelts;
+
     cscfp = ngx_array_push(&cmcf->servers);
     if (cscfp == NULL) {
         return NGX_CONF_ERROR;
@@ -279,7 +464,7 @@ ngx_tcp_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     size_t                     len, off;
     in_port_t                  port;
-    ngx_str_t                 *value;
+    ngx_str_t                 *value, size;
     ngx_url_t                  u;
     ngx_uint_t                 i;
     struct sockaddr           *sa;
@@ -363,6 +548,12 @@ ngx_tcp_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ls->socklen = u.socklen;
     ls->wildcard = u.wildcard;
     ls->ctx = cf->ctx;
+    ls->backlog = NGX_LISTEN_BACKLOG;
+    ls->rcvbuf = -1;
+    ls->sndbuf = -1;
+#if (NGX_HAVE_TCP_FASTOPEN)
+    ls->fastopen = -1;
+#endif
 
     for (i = 2; i < cf->args->nelts; i++) {
 
@@ -424,6 +615,100 @@ ngx_tcp_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 #endif
         }
 
+        if (ngx_strcmp(value[i].data, "proxy_protocol") == 0) {
+            ls->proxy_protocol = 1;
+            continue;
+        }
+
+        /* the socket options below are set on a separate bind()ed socket */
+
+        if (ngx_strncmp(value[i].data, "backlog=", 8) == 0) {
+            ls->backlog = ngx_atoi(value[i].data + 8, value[i].len - 8);
+            ls->bind = 1;
+
+            if (ls->backlog == NGX_ERROR || ls->backlog == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid backlog \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "rcvbuf=", 7) == 0) {
+            size.len = value[i].len - 7;
+            size.data = value[i].data + 7;
+
+            ls->rcvbuf = ngx_parse_size(&size);
+            ls->bind = 1;
+
+            if (ls->rcvbuf == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid rcvbuf \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "sndbuf=", 7) == 0) {
+            size.len = value[i].len - 7;
+            size.data = value[i].data + 7;
+
+            ls->sndbuf = ngx_parse_size(&size);
+            ls->bind = 1;
+
+            if (ls->sndbuf == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid sndbuf \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "deferred") == 0) {
+#if (NGX_HAVE_DEFERRED_ACCEPT && defined TCP_DEFER_ACCEPT)
+            ls->deferred_accept = 1;
+            ls->bind = 1;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "the deferred accept is not supported "
+                               "on this platform, ignored");
+#endif
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fastopen=", 9) == 0) {
+#if (NGX_HAVE_TCP_FASTOPEN)
+            ls->fastopen = ngx_atoi(value[i].data + 9, value[i].len - 9);
+            ls->bind = 1;
+
+            if (ls->fastopen == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid fastopen \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "the \"fastopen\" parameter is not supported "
+                               "on this platform, ignored");
+#endif
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "reuseport") == 0) {
+#if (NGX_HAVE_REUSEPORT)
+            ls->reuseport = 1;
+            ls->bind = 1;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "reuseport is not supported "
+                               "on this platform, ignored");
+#endif
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "the invalid \"%V\" parameter", &value[i]);
         return NGX_CONF_ERROR;
@@ -491,3 +776,133 @@ ngx_tcp_core_resolver(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static char *
+ngx_tcp_core_log_sample(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_tcp_core_srv_conf_t  *cscf = conf;
+
+    ngx_int_t   n;
+    ngx_str_t  *value;
+
+    if (cscf->log_sample != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (value[1].len < 3 || ngx_strncmp(value[1].data, "1/", 2) != 0) {
+        goto invalid;
+    }
+
+    n = ngx_atoi(value[1].data + 2, value[1].len - 2);
+    if (n == NGX_ERROR || n == 0) {
+        goto invalid;
+    }
+
+    cscf->log_sample = n;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid sample rate \"%V\", it must be \"1/N\"",
+                       &value[1]);
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_tcp_core_log_rate_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_tcp_core_srv_conf_t  *cscf = conf;
+
+    u_char     *p;
+    size_t      len;
+    ngx_int_t   n;
+    ngx_str_t  *value;
+
+    if (cscf->log_rate != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        cscf->log_rate = 0;
+        cscf->log_interval = 1;
+        return NGX_CONF_OK;
+    }
+
+    /* "number/s" or "number/m", the number of messages per interval */
+
+    len = value[1].len;
+    p = value[1].data + len - 2;
+
+    if (len > 2 && ngx_strncmp(p, "/s", 2) == 0) {
+        cscf->log_interval = 1;
+
+    } else if (len > 2 && ngx_strncmp(p, "/m", 2) == 0) {
+        cscf->log_interval = 60;
+
+    } else {
+        goto invalid;
+    }
+
+    n = ngx_atoi(value[1].data, len - 2);
+    if (n == NGX_ERROR || n == 0) {
+        goto invalid;
+    }
+
+    cscf->log_rate = n;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid rate \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_tcp_core_pool_size(ngx_conf_t *cf, void *post, void *data)
+{
+    size_t *sp = data;
+
+    if (*sp < NGX_MIN_POOL_SIZE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the pool size must be no less than %uz",
+                           NGX_MIN_POOL_SIZE);
+        return NGX_CONF_ERROR;
+    }
+
+    if (*sp % NGX_POOL_ALIGNMENT) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the pool size must be a multiple of %uz",
+                           NGX_POOL_ALIGNMENT);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static void
+ngx_tcp_core_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_tcp_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_tcp_cycle_get_module_main_conf(cycle, ngx_tcp_core_module);
+
+    if (cmcf == NULL || cmcf->recycled_sessions == 0) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                  "tcp recycled sessions: %ui hits, %ui misses",
+                  cmcf->session_hits, cmcf->session_misses);
+}
@@ -0,0 +1,165 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_tcp.h>
+
+
+/* the bytes read are thrown away, so all sessions of a worker share one */
+
+#define NGX_TCP_DISCARD_BUFFER_SIZE  16384
+
+/* the reads done in a row before other connections get their turn */
+#define NGX_TCP_DISCARD_READS        16
+
+
+static ngx_int_t ngx_tcp_discard_init_session(ngx_tcp_session_t *s);
+static void ngx_tcp_discard_process_session(ngx_tcp_session_t *s);
+static void ngx_tcp_discard_close_session(ngx_tcp_session_t *s);
+static void ngx_tcp_discard_handler(ngx_event_t *rev);
+
+
+static ngx_tcp_protocol_t  ngx_tcp_discard_protocol = {
+    ngx_string("discard"),
+    ngx_tcp_discard_init_session,
+    ngx_tcp_discard_close_session,
+    ngx_tcp_discard_process_session,
+    NULL,
+    NULL,
+    0
+};
+
+
+static ngx_tcp_module_t  ngx_tcp_discard_module_ctx = {
+    &ngx_tcp_discard_protocol,             /* protocol */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL                                   /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_tcp_discard_module = {
+    NGX_MODULE_V1,
+    &ngx_tcp_discard_module_ctx,           /* module context */
+    NULL,                                  /* module directives */
+    NGX_TCP_MODULE,                        /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static u_char  ngx_tcp_discard_buffer[NGX_TCP_DISCARD_BUFFER_SIZE];
+
+
+static ngx_int_t
+ngx_tcp_discard_init_session(ngx_tcp_session_t *s)
+{
+    return NGX_OK;
+}
+
+
+static void
+ngx_tcp_discard_process_session(ngx_tcp_session_t *s)
+{
+    ngx_connection_t  *c;
+
+    c = s->connection;
+
+    c->log->action = "discarding";
+
+    /*
+     * the data read ahead, e.g. after the PROXY protocol header, are
+     * already counted in s->received
+     */
+
+    if (s->buffer) {
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, c->log, 0,
+                       "tcp discard: %uz bytes read ahead",
+                       (size_t) (s->buffer->last - s->buffer->pos));
+
+        s->buffer->pos = s->buffer->last;
+    }
+
+    c->read->handler = ngx_tcp_discard_handler;
+
+    ngx_tcp_discard_handler(c->read);
+}
+
+
+static void
+ngx_tcp_discard_close_session(ngx_tcp_session_t *s)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, s->connection->log, 0,
+                   "tcp discard done: %O received", s->received);
+}
+
+
+static void
+ngx_tcp_discard_handler(ngx_event_t *rev)
+{
+    ssize_t                   n;
+    ngx_uint_t                i;
+    ngx_connection_t         *c;
+    ngx_tcp_session_t        *s;
+    ngx_tcp_core_srv_conf_t  *cscf;
+
+    c = rev->data;
+    s = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out");
+        ngx_tcp_stats_inc(s, read_timeouts);
+        c->timedout = 1;
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    for (i = 0; i < NGX_TCP_DISCARD_READS && rev->ready; i++) {
+
+        n = c->recv(c, ngx_tcp_discard_buffer, NGX_TCP_DISCARD_BUFFER_SIZE);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_tcp_close_connection(c);
+            return;
+        }
+
+        s->received += n;
+    }
+
+    if (rev->ready) {
+
+        /* a fast client does not hold the worker */
+
+        ngx_tcp_del_idle_timer(s);
+
+        ngx_post_event(rev, &ngx_posted_events);
+        return;
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+
+    ngx_tcp_add_idle_timer(s, rev, cscf->read_timeout);
+}
@@ -0,0 +1,300 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_tcp.h>
+
+
+/*
+ * the echo protocol sends back what it reads: the input buffers are queued
+ * for output as they are, so nothing is copied, and the output is sent
+ * with one writev() per event;
+ *
+ * with "echo_frame" each frame is a request answered with the frame itself,
+ * the pipelined frames are answered in a batch straight from the read buffer
+ */
+
+
+typedef struct {
+    ngx_tcp_frame_conf_t    frame;
+} ngx_tcp_echo_conf_t;
+
+
+static ngx_int_t ngx_tcp_echo_init_session(ngx_tcp_session_t *s);
+static void ngx_tcp_echo_process_session(ngx_tcp_session_t *s);
+static void ngx_tcp_echo_close_session(ngx_tcp_session_t *s);
+static ngx_int_t ngx_tcp_echo_process_request(ngx_tcp_session_t *s);
+static void ngx_tcp_echo_handler(ngx_event_t *ev);
+static void *ngx_tcp_echo_create_conf(ngx_conf_t *cf);
+static char *ngx_tcp_echo_merge_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+
+
+static ngx_command_t  ngx_tcp_echo_commands[] = {
+
+    { ngx_string("echo_frame"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_1MORE,
+      ngx_tcp_frame_set_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_echo_conf_t, frame),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_tcp_protocol_t  ngx_tcp_echo_protocol = {
+    ngx_string("echo"),
+    ngx_tcp_echo_init_session,
+    ngx_tcp_echo_close_session,
+    ngx_tcp_echo_process_session,
+    NULL,
+    NULL,
+    sizeof(ngx_tcp_frame_ctx_t),
+    ngx_tcp_echo_process_request
+};
+
+
+static ngx_tcp_module_t  ngx_tcp_echo_module_ctx = {
+    &ngx_tcp_echo_protocol,                /* protocol */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_tcp_echo_create_conf,              /* create server configuration */
+    ngx_tcp_echo_merge_conf                /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_tcp_echo_module = {
+    NGX_MODULE_V1,
+    &ngx_tcp_echo_module_ctx,              /* module context */
+    ngx_tcp_echo_commands,                 /* module directives */
+    NGX_TCP_MODULE,                        /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_tcp_echo_init_session(ngx_tcp_session_t *s)
+{
+    ngx_tcp_echo_conf_t  *ecf;
+
+    ecf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_echo_module);
+
+    if (ecf->frame.type == NGX_TCP_FRAME_NONE) {
+        return NGX_OK;
+    }
+
+    return ngx_tcp_frame_init(s, s->protocol_ctx, &ecf->frame);
+}
+
+
+static void
+ngx_tcp_echo_process_session(ngx_tcp_session_t *s)
+{
+    ngx_chain_t          *cl;
+    ngx_connection_t     *c;
+    ngx_tcp_echo_conf_t  *ecf;
+
+    c = s->connection;
+
+    c->log->action = "echoing";
+
+    ecf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_echo_module);
+
+    if (ecf->frame.type != NGX_TCP_FRAME_NONE) {
+        ngx_tcp_process_requests(s);
+        return;
+    }
+
+    /* the data read ahead, e.g. after the PROXY protocol header */
+
+    if (s->buffer && s->buffer->pos != s->buffer->last) {
+        cl = ngx_tcp_get_link(s);
+        if (cl == NULL) {
+            ngx_tcp_close_connection(c);
+            return;
+        }
+
+        cl->buf->memory = 1;
+        cl->buf->pos = s->buffer->pos;
+        cl->buf->last = s->buffer->last;
+
+        s->buffer->pos = s->buffer->last;
+
+        ngx_tcp_queue_chain(s, cl);
+    }
+
+    c->read->handler = ngx_tcp_echo_handler;
+    c->write->handler = ngx_tcp_echo_handler;
+
+    ngx_tcp_echo_handler(c->read);
+}
+
+
+static void
+ngx_tcp_echo_close_session(ngx_tcp_session_t *s)
+{
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, s->connection->log, 0,
+                   "tcp echo done: %O received, %O sent",
+                   s->received, s->connection->sent);
+}
+
+
+static ngx_int_t
+ngx_tcp_echo_process_request(ngx_tcp_session_t *s)
+{
+    u_char               *last;
+    ngx_int_t             rc;
+    ngx_chain_t          *cl;
+    ngx_tcp_frame_t       frame;
+    ngx_tcp_frame_ctx_t  *ctx;
+
+    ctx = s->protocol_ctx;
+
+    for ( ;; ) {
+        rc = ngx_tcp_frame_next(s, ctx, &frame);
+
+        if (rc == NGX_OK) {
+            break;
+        }
+
+        if (rc == NGX_ERROR) {
+            s->status = NGX_TCP_BAD_REQUEST;
+            return NGX_ERROR;
+        }
+
+        /* the frames queued point into the buffer read into */
+
+        if (s->out) {
+            return NGX_BUSY;
+        }
+
+        rc = ngx_tcp_frame_read(s, ctx);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    last = frame.payload.data + frame.payload.len;
+
+    if (ctx->conf->type == NGX_TCP_FRAME_DELIMITER) {
+        last += ctx->conf->delimiter.len;
+    }
+
+    cl = ngx_tcp_get_link(s);
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cl->buf->memory = 1;
+    cl->buf->pos = frame.header.data;
+    cl->buf->last = last;
+
+    ngx_tcp_queue_chain(s, cl);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_tcp_echo_handler(ngx_event_t *ev)
+{
+    ssize_t                   n;
+    ngx_chain_t              *in;
+    ngx_connection_t         *c;
+    ngx_tcp_session_t        *s;
+    ngx_tcp_core_srv_conf_t  *cscf;
+
+    c = ev->data;
+    s = c->data;
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out");
+
+        if (s->out) {
+            ngx_tcp_stats_inc(s, send_timeouts);
+
+        } else {
+            ngx_tcp_stats_inc(s, read_timeouts);
+        }
+
+        c->timedout = 1;
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    for ( ;; ) {
+
+        in = s->in;
+        s->in = NULL;
+
+        if (ngx_tcp_send_chain(s, in) == NGX_ERROR) {
+            ngx_tcp_close_connection(c);
+            return;
+        }
+
+        /* reading stops when all buffers wait to be sent */
+
+        n = ngx_tcp_recv_chain(s);
+
+        if (n == NGX_AGAIN || n == NGX_BUSY) {
+            break;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_tcp_close_connection(c);
+            return;
+        }
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+
+    ngx_tcp_add_idle_timer(s, c->read, s->out ? cscf->send_timeout
+                                              : cscf->read_timeout);
+}
+
+
+static void *
+ngx_tcp_echo_create_conf(ngx_conf_t *cf)
+{
+    ngx_tcp_echo_conf_t  *ecf;
+
+    ecf = ngx_pcalloc(cf->pool, sizeof(ngx_tcp_echo_conf_t));
+    if (ecf == NULL) {
+        return NULL;
+    }
+
+    ngx_tcp_frame_init_conf(&ecf->frame);
+
+    return ecf;
+}
+
+
+static char *
+ngx_tcp_echo_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_tcp_echo_conf_t *prev = parent;
+    ngx_tcp_echo_conf_t *conf = child;
+
+    return ngx_tcp_frame_merge_conf(cf, &conf->frame, &prev->frame);
+}
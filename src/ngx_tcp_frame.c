@@ -0,0 +1,680 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_tcp.h>
+
+
+static ngx_int_t ngx_tcp_frame_release(ngx_tcp_session_t *s,
+    ngx_tcp_frame_ctx_t *ctx);
+static ngx_int_t ngx_tcp_frame_parse_length(ngx_tcp_session_t *s,
+    ngx_tcp_frame_ctx_t *ctx);
+static ngx_int_t ngx_tcp_frame_parse_varint(ngx_tcp_session_t *s,
+    ngx_tcp_frame_ctx_t *ctx);
+static ngx_int_t ngx_tcp_frame_find_delimiter(ngx_tcp_session_t *s,
+    ngx_tcp_frame_ctx_t *ctx);
+static ngx_int_t ngx_tcp_frame_unescape(ngx_str_t *value);
+
+
+ngx_int_t
+ngx_tcp_frame_init(ngx_tcp_session_t *s, ngx_tcp_frame_ctx_t *ctx,
+    ngx_tcp_frame_conf_t *conf)
+{
+    ngx_memzero(ctx, sizeof(ngx_tcp_frame_ctx_t));
+
+    ctx->conf = conf;
+
+    /* the session buffer is reused, e.g. when a protocol has read ahead */
+
+    if (s->buffer == NULL) {
+        s->buffer = ngx_create_temp_buf(s->connection->pool,
+                                        conf->buffer_size);
+        if (s->buffer == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    ctx->small = s->buffer;
+    ctx->buffer = s->buffer;
+
+    return NGX_OK;
+}
+
+
+/*
+ * reads a chunk into the buffer: NGX_OK if something has been read,
+ * NGX_AGAIN if nothing is available, NGX_DONE on the end of the stream
+ */
+
+ngx_int_t
+ngx_tcp_frame_read(ngx_tcp_session_t *s, ngx_tcp_frame_ctx_t *ctx)
+{
+    size_t             size, pending, need;
+    ssize_t            n;
+    ngx_buf_t         *b, *large;
+    ngx_connection_t  *c;
+
+    c = s->connection;
+
+    if (ngx_tcp_frame_release(s, ctx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    b = ctx->buffer;
+
+    if (b->last == b->end) {
+
+        pending = b->last - b->pos;
+
+        if (ctx->size) {
+            need = ctx->size;
+
+        } else if (ctx->conf->type == NGX_TCP_FRAME_DELIMITER) {
+            need = pending + 1;
+
+        } else {
+            /* the header is incomplete, it always fits */
+            need = pending;
+        }
+
+        if (need <= (size_t) (b->end - b->start)) {
+
+            /* the partial frame is moved to the start */
+
+            ngx_memmove(b->start, b->pos, pending);
+            b->pos = b->start;
+            b->last = b->start + pending;
+
+        } else {
+
+            /*
+             * the frame does not fit, it gets its own buffer: of the frame
+             * size if it is known, otherwise twice as large each time
+             */
+
+            if (ctx->size == 0) {
+                size = 2 * (b->end - b->start);
+                need = ctx->conf->max_size + ctx->conf->delimiter.len;
+
+                if (pending >= need) {
+                    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                                  "client sent too large frame");
+                    return NGX_ERROR;
+                }
+
+                need = ngx_min(size, need);
+            }
+
+            ngx_log_debug2(NGX_LOG_DEBUG_CORE, c->log, 0,
+                           "tcp frame large buffer: %uz of %uz",
+                           pending, need);
+
+            large = ngx_create_temp_buf(c->pool, need);
+            if (large == NULL) {
+                return NGX_ERROR;
+            }
+
+            large->last = ngx_cpymem(large->pos, b->pos, pending);
+
+            if (b != ctx->small) {
+                ngx_pfree(c->pool, b->start);
+
+            } else {
+                b->pos = b->start;
+                b->last = b->start;
+            }
+
+            ctx->buffer = large;
+            b = large;
+        }
+    }
+
+    n = c->recv(c, b->last, b->end - b->last);
+
+    if (n == NGX_AGAIN) {
+        return NGX_AGAIN;
+    }
+
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (n == 0) {
+        return NGX_DONE;
+    }
+
+    s->received += n;
+    b->last += n;
+
+    return NGX_OK;
+}
+
+
+/*
+ * NGX_OK if a complete frame is in the buffer, NGX_AGAIN if more bytes
+ * are needed and NGX_ERROR if the frame is invalid or too large
+ */
+
+ngx_int_t
+ngx_tcp_frame_next(ngx_tcp_session_t *s, ngx_tcp_frame_ctx_t *ctx,
+    ngx_tcp_frame_t *frame)
+{
+    size_t      dlen;
+    ngx_int_t   rc;
+    ngx_buf_t  *b;
+
+    b = ctx->buffer;
+
+    switch (ctx->conf->type) {
+
+    case NGX_TCP_FRAME_LENGTH:
+        rc = ngx_tcp_frame_parse_length(s, ctx);
+        break;
+
+    case NGX_TCP_FRAME_VARINT:
+        rc = ngx_tcp_frame_parse_varint(s, ctx);
+        break;
+
+    default: /* NGX_TCP_FRAME_DELIMITER */
+        rc = ngx_tcp_frame_find_delimiter(s, ctx);
+        break;
+    }
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if ((size_t) (b->last - b->pos) < ctx->size) {
+        return NGX_AGAIN;
+    }
+
+    dlen = (ctx->conf->type == NGX_TCP_FRAME_DELIMITER)
+           ? ctx->conf->delimiter.len : 0;
+
+    frame->header.len = ctx->header;
+    frame->header.data = b->pos;
+    frame->payload.len = ctx->size - ctx->header - dlen;
+    frame->payload.data = b->pos + ctx->header;
+
+    b->pos += ctx->size;
+
+    ctx->header = 0;
+    ctx->size = 0;
+    ctx->scanned = 0;
+
+    return NGX_OK;
+}
+
+
+/*
+ * the frames returned are given back before reading: an empty buffer
+ * starts over, the rest of a large one goes back to the small one
+ */
+
+static ngx_int_t
+ngx_tcp_frame_release(ngx_tcp_session_t *s, ngx_tcp_frame_ctx_t *ctx)
+{
+    size_t      pending, size;
+    ngx_buf_t  *b;
+
+    b = ctx->buffer;
+
+    pending = b->last - b->pos;
+
+    if (b == ctx->small) {
+        if (pending == 0) {
+            b->pos = b->start;
+            b->last = b->start;
+        }
+
+        return NGX_OK;
+    }
+
+    size = ctx->small->end - ctx->small->start;
+
+    /* a partial frame stays if it may still outgrow the small buffer */
+
+    if (pending >= size
+        || (ctx->size ? ctx->size > size : ctx->scanned != 0))
+    {
+        return NGX_OK;
+    }
+
+    ctx->small->pos = ctx->small->start;
+    ctx->small->last = ngx_cpymem(ctx->small->start, b->pos, pending);
+
+    ngx_pfree(s->connection->pool, b->start);
+
+    ctx->buffer = ctx->small;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_tcp_frame_parse_length(ngx_tcp_session_t *s, ngx_tcp_frame_ctx_t *ctx)
+{
+    u_char                *p;
+    off_t                  len;
+    uint64_t               n;
+    ngx_uint_t             i;
+    ngx_buf_t             *b;
+    ngx_tcp_frame_conf_t  *conf;
+
+    if (ctx->size) {
+        return NGX_OK;
+    }
+
+    b = ctx->buffer;
+    conf = ctx->conf;
+
+    if ((size_t) (b->last - b->pos) < conf->header_size) {
+        return NGX_AGAIN;
+    }
+
+    p = b->pos + conf->length_offset;
+    n = 0;
+
+    for (i = 0; i < conf->length_size; i++) {
+        if (conf->little_endian) {
+            n |= (uint64_t) p[i] << (8 * i);
+
+        } else {
+            n = (n << 8) | p[i];
+        }
+    }
+
+    if (n > (uint64_t) conf->max_size + conf->header_size) {
+        goto too_large;
+    }
+
+    /* the length may count the header or a trailer too */
+
+    len = (off_t) n + conf->length_adjust;
+
+    if (len < 0) {
+        ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                      "client sent invalid frame length %uL", n);
+        return NGX_ERROR;
+    }
+
+    if ((size_t) len > conf->max_size) {
+        goto too_large;
+    }
+
+    ctx->header = conf->header_size;
+    ctx->size = conf->header_size + (size_t) len;
+
+    return NGX_OK;
+
+too_large:
+
+    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                  "client sent too large frame: %uL bytes", n);
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_tcp_frame_parse_varint(ngx_tcp_session_t *s, ngx_tcp_frame_ctx_t *ctx)
+{
+    u_char     *p, *last;
+    uint64_t    n;
+    ngx_uint_t  shift;
+    ngx_buf_t  *b;
+
+    if (ctx->size) {
+        return NGX_OK;
+    }
+
+    b = ctx->buffer;
+
+    n = 0;
+    shift = 0;
+
+    /* a 64-bit varint takes at most 10 bytes */
+
+    last = ngx_min(b->last, b->pos + 10);
+
+    for (p = b->pos; p < last; p++) {
+
+        n |= (uint64_t) (*p & 0x7f) << shift;
+
+        if ((*p & 0x80) == 0) {
+
+            if (n > (uint64_t) ctx->conf->max_size) {
+                ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                              "client sent too large frame: %uL bytes", n);
+                return NGX_ERROR;
+            }
+
+            ctx->header = p + 1 - b->pos;
+            ctx->size = ctx->header + (size_t) n;
+
+            return NGX_OK;
+        }
+
+        shift += 7;
+    }
+
+    if (p == b->pos + 10) {
+        ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                      "client sent invalid frame length");
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_tcp_frame_find_delimiter(ngx_tcp_session_t *s, ngx_tcp_frame_ctx_t *ctx)
+{
+    u_char     *p, *last;
+    size_t      dlen;
+    ngx_buf_t  *b;
+    ngx_str_t  *d;
+
+    if (ctx->size) {
+        return NGX_OK;
+    }
+
+    b = ctx->buffer;
+    d = &ctx->conf->delimiter;
+    dlen = d->len;
+
+    /* the search resumes where the previous one stopped */
+
+    p = b->pos + ctx->scanned;
+    last = b->last;
+
+    while ((size_t) (last - p) >= dlen) {
+
+        p = ngx_strlchr(p, last - dlen + 1, d->data[0]);
+        if (p == NULL) {
+            break;
+        }
+
+        if (ngx_memcmp(p, d->data, dlen) == 0) {
+            ctx->size = p + dlen - b->pos;
+            return NGX_OK;
+        }
+
+        p++;
+    }
+
+    /* the tail may hold the start of a delimiter */
+
+    if ((size_t) (b->last - b->pos) >= dlen) {
+        ctx->scanned = (b->last - b->pos) - (dlen - 1);
+    }
+
+    if ((size_t) (b->last - b->pos) > ctx->conf->max_size + dlen) {
+        ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                      "client sent too large frame");
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+void
+ngx_tcp_frame_init_conf(ngx_tcp_frame_conf_t *conf)
+{
+    conf->type = NGX_CONF_UNSET_UINT;
+}
+
+
+char *
+ngx_tcp_frame_merge_conf(ngx_conf_t *cf, ngx_tcp_frame_conf_t *conf,
+    ngx_tcp_frame_conf_t *prev)
+{
+    if (conf->type != NGX_CONF_UNSET_UINT) {
+        return NGX_CONF_OK;
+    }
+
+    if (prev->type != NGX_CONF_UNSET_UINT) {
+        *conf = *prev;
+        return NGX_CONF_OK;
+    }
+
+    ngx_memzero(conf, sizeof(ngx_tcp_frame_conf_t));
+
+    conf->type = NGX_TCP_FRAME_NONE;
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * "directive length [header=4] [offset=0] [size=4] [adjust=0]
+ *                   [little_endian] [buffer=16k] [max=1m]"
+ * "directive varint [buffer=16k] [max=1m]"
+ * "directive delimiter [string=\r\n] [buffer=16k] [max=1m]"
+ */
+
+char *
+ngx_tcp_frame_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    char  *p = conf;
+
+    ssize_t                size;
+    ngx_int_t              n;
+    ngx_str_t             *value, s;
+    ngx_uint_t             i;
+    ngx_tcp_frame_conf_t  *fcf;
+
+    fcf = (ngx_tcp_frame_conf_t *) (p + cmd->offset);
+
+    if (fcf->type != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    ngx_memzero(fcf, sizeof(ngx_tcp_frame_conf_t));
+
+    fcf->buffer_size = 16384;
+    fcf->max_size = 1024 * 1024;
+
+    if (ngx_strcmp(value[1].data, "length") == 0) {
+        fcf->type = NGX_TCP_FRAME_LENGTH;
+        fcf->header_size = 4;
+        fcf->length_size = 4;
+
+    } else if (ngx_strcmp(value[1].data, "varint") == 0) {
+        fcf->type = NGX_TCP_FRAME_VARINT;
+
+    } else if (ngx_strcmp(value[1].data, "delimiter") == 0) {
+        fcf->type = NGX_TCP_FRAME_DELIMITER;
+        ngx_str_set(&fcf->delimiter, "\r\n");
+
+    } else if (ngx_strcmp(value[1].data, "off") == 0) {
+        fcf->type = NGX_TCP_FRAME_NONE;
+        return NGX_CONF_OK;
+
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid frame type \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "buffer=", 7) == 0
+            || ngx_strncmp(value[i].data, "max=", 4) == 0)
+        {
+            s.data = (u_char *) ngx_strchr(value[i].data, '=') + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR || size == 0) {
+                goto invalid;
+            }
+
+            if (value[i].data[0] == 'b') {
+                fcf->buffer_size = size;
+
+            } else {
+                fcf->max_size = size;
+            }
+
+            continue;
+        }
+
+        if (fcf->type == NGX_TCP_FRAME_LENGTH) {
+
+            if (ngx_strcmp(value[i].data, "little_endian") == 0) {
+                fcf->little_endian = 1;
+                continue;
+            }
+
+            if (ngx_strncmp(value[i].data, "adjust=", 7) == 0) {
+                s.data = value[i].data + 7;
+                s.len = value[i].len - 7;
+
+                if (s.len && s.data[0] == '-') {
+                    n = ngx_atoi(s.data + 1, s.len - 1);
+                    fcf->length_adjust = -n;
+
+                } else {
+                    n = ngx_atoi(s.data, s.len);
+                    fcf->length_adjust = n;
+                }
+
+                if (n == NGX_ERROR) {
+                    goto invalid;
+                }
+
+                continue;
+            }
+
+            if (ngx_strncmp(value[i].data, "header=", 7) == 0) {
+                n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+                if (n == NGX_ERROR || n == 0) {
+                    goto invalid;
+                }
+
+                fcf->header_size = n;
+                continue;
+            }
+
+            if (ngx_strncmp(value[i].data, "offset=", 7) == 0) {
+                n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+                if (n == NGX_ERROR) {
+                    goto invalid;
+                }
+
+                fcf->length_offset = n;
+                continue;
+            }
+
+            if (ngx_strncmp(value[i].data, "size=", 5) == 0) {
+                n = ngx_atoi(value[i].data + 5, value[i].len - 5);
+                if (n == NGX_ERROR || n == 0 || n > 8) {
+                    goto invalid;
+                }
+
+                fcf->length_size = n;
+                continue;
+            }
+        }
+
+        if (fcf->type == NGX_TCP_FRAME_DELIMITER
+            && ngx_strncmp(value[i].data, "string=", 7) == 0)
+        {
+            fcf->delimiter.data = value[i].data + 7;
+            fcf->delimiter.len = value[i].len - 7;
+
+            if (ngx_tcp_frame_unescape(&fcf->delimiter) != NGX_OK) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (fcf->type == NGX_TCP_FRAME_LENGTH
+        && fcf->length_offset + fcf->length_size > fcf->header_size)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the length field does not fit in the header");
+        return NGX_CONF_ERROR;
+    }
+
+    /* a frame of the buffer size is read without a large buffer */
+
+    if (fcf->buffer_size < fcf->header_size + 10 + fcf->delimiter.len) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the frame buffer is too small");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+
+/* "\r", "\n", "\t", "\0" and "\\" are unescaped in place */
+
+static ngx_int_t
+ngx_tcp_frame_unescape(ngx_str_t *value)
+{
+    u_char  *p, *d, *last;
+
+    if (value->len == 0) {
+        return NGX_ERROR;
+    }
+
+    p = value->data;
+    d = value->data;
+    last = value->data + value->len;
+
+    while (p < last) {
+
+        if (*p != '\\') {
+            *d++ = *p++;
+            continue;
+        }
+
+        if (++p == last) {
+            return NGX_ERROR;
+        }
+
+        switch (*p++) {
+        case 'r':
+            *d++ = CR;
+            break;
+        case 'n':
+            *d++ = LF;
+            break;
+        case 't':
+            *d++ = '\t';
+            break;
+        case '0':
+            *d++ = '\0';
+            break;
+        case '\\':
+            *d++ = '\\';
+            break;
+        default:
+            return NGX_ERROR;
+        }
+    }
+
+    value->len = d - value->data;
+
+    return NGX_OK;
+}
@@ -0,0 +1,79 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#ifndef _NGX_TCP_FRAME_H_INCLUDED_
+#define _NGX_TCP_FRAME_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#define NGX_TCP_FRAME_NONE       0
+#define NGX_TCP_FRAME_LENGTH     1   /* a fixed header with a length field */
+#define NGX_TCP_FRAME_VARINT     2   /* a LEB128 length before the payload */
+#define NGX_TCP_FRAME_DELIMITER  3   /* the payload ends with a delimiter */
+
+
+typedef struct {
+    ngx_uint_t              type;
+
+    /* NGX_TCP_FRAME_LENGTH */
+    size_t                  header_size;
+    size_t                  length_offset;
+    size_t                  length_size;
+    ngx_int_t               length_adjust;
+    ngx_flag_t              little_endian;
+
+    /* NGX_TCP_FRAME_DELIMITER */
+    ngx_str_t               delimiter;
+
+    size_t                  buffer_size;
+    size_t                  max_size;
+} ngx_tcp_frame_conf_t;
+
+
+/*
+ * a frame is a slice of the read buffer, it is valid until the next call
+ * of ngx_tcp_frame_read(): the frames already read are returned one after
+ * another and may all be sent without copying
+ */
+
+typedef struct {
+    ngx_str_t               header;
+    ngx_str_t               payload;
+} ngx_tcp_frame_t;
+
+
+typedef struct {
+    ngx_tcp_frame_conf_t   *conf;
+
+    /* the buffer read into, either small or a larger one for a frame */
+    ngx_buf_t              *buffer;
+    ngx_buf_t              *small;
+
+    /* the header and the whole size of the frame, 0 if not parsed yet */
+    size_t                  header;
+    size_t                  size;
+
+    /* the bytes already searched for the delimiter */
+    size_t                  scanned;
+} ngx_tcp_frame_ctx_t;
+
+
+ngx_int_t ngx_tcp_frame_init(ngx_tcp_session_t *s, ngx_tcp_frame_ctx_t *ctx,
+    ngx_tcp_frame_conf_t *conf);
+ngx_int_t ngx_tcp_frame_read(ngx_tcp_session_t *s, ngx_tcp_frame_ctx_t *ctx);
+ngx_int_t ngx_tcp_frame_next(ngx_tcp_session_t *s, ngx_tcp_frame_ctx_t *ctx,
+    ngx_tcp_frame_t *frame);
+
+void ngx_tcp_frame_init_conf(ngx_tcp_frame_conf_t *conf);
+char *ngx_tcp_frame_merge_conf(ngx_conf_t *cf, ngx_tcp_frame_conf_t *conf,
+    ngx_tcp_frame_conf_t *prev);
+char *ngx_tcp_frame_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+
+#endif /* _NGX_TCP_FRAME_H_INCLUDED_ */
@@ -12,25 +12,60 @@
 #if (NGX_TCP_SSL)
 static void ngx_tcp_ssl_init_connection(ngx_ssl_t *ssl, ngx_connection_t *c);
 static void ngx_tcp_ssl_handshake_handler(ngx_connection_t *c);
+static void ngx_tcp_ssl_handshaked(ngx_tcp_session_t *s);
+#if (NGX_TCP_SSL_EARLY_DATA)
+static ssize_t ngx_tcp_ssl_recv_early(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ssize_t ngx_tcp_ssl_recv_chain_early(ngx_connection_t *c,
+    ngx_chain_t *cl, off_t limit);
 #endif
+#endif
+static u_char *ngx_tcp_alloc_session(ngx_connection_t *c,
+    ngx_tcp_addr_conf_t *addr_conf);
+static void ngx_tcp_free_session(ngx_tcp_session_t *s);
+static void ngx_tcp_log_connected(ngx_connection_t *c,
+    ngx_tcp_session_t *s, ngx_tcp_core_srv_conf_t *cscf);
+static ngx_uint_t ngx_tcp_log_sampled(ngx_connection_t *c,
+    ngx_tcp_core_srv_conf_t *cscf);
+static void ngx_tcp_log_suppressed_handler(ngx_event_t *ev);
+static void ngx_tcp_start_session(ngx_connection_t *c);
+static void ngx_tcp_proxy_protocol_handler(ngx_event_t *rev);
+static void ngx_tcp_ssl_preread_handler(ngx_event_t *rev);
 static void ngx_tcp_init_session(ngx_connection_t *c);
 static void ngx_tcp_dummy_handler(ngx_event_t *ev);
+static void ngx_tcp_request_handler(ngx_event_t *ev);
+
+
+size_t
+ngx_tcp_session_size(ngx_tcp_protocol_t *protocol)
+{
+    return ngx_align(sizeof(ngx_tcp_session_t), NGX_ALIGNMENT)
+           + ngx_align(sizeof(ngx_tcp_log_ctx_t), NGX_ALIGNMENT)
+           + ngx_align(sizeof(void *) * ngx_tcp_max_module, NGX_ALIGNMENT)
+           + protocol->ctx_size;
+}
 
 
 void
 ngx_tcp_init_connection(ngx_connection_t *c)
 {
-    ngx_uint_t            i;
-    ngx_tcp_port_t       *port;
-    struct sockaddr      *sa;
-    ngx_tcp_log_ctx_t    *ctx;
-    ngx_tcp_session_t    *s;
-    ngx_tcp_in_addr_t    *addr;
-    struct sockaddr_in   *sin;
-    ngx_tcp_addr_conf_t  *addr_conf;
+    u_char                      *p;
+    size_t                       size;
+    ngx_uint_t                   i, j, k, n;
+    ngx_tcp_port_t              *port;
+    struct sockaddr             *sa;
+    ngx_tcp_log_ctx_t           *ctx;
+    ngx_tcp_session_t           *s;
+    ngx_tcp_in_addr_t           *addr;
+    struct sockaddr_in          *sin;
+    ngx_tcp_addr_conf_t         *addr_conf;
+    ngx_tcp_core_srv_conf_t     *cscf;
+    ngx_tcp_core_main_conf_t    *cmcf;
+    ngx_tcp_ssl_preread_conf_t  *spcf;
 #if (NGX_HAVE_INET6)
-    ngx_tcp_in6_addr_t   *addr6;
-    struct sockaddr_in6  *sin6;
+    ngx_int_t                    rc;
+    ngx_tcp_in6_addr_t          *addr6;
+    struct sockaddr_in6         *sin6;
 #endif
 
 
@@ -47,7 +82,12 @@ ngx_tcp_init_connection(ngx_connection_t *c)
          * is the "*:port" wildcard so getsockname() is needed to determine
          * the server address.
          *
-         * AcceptEx() already gave this address.
+         * AcceptEx() already gave this address, and
+         * ngx_connection_local_sockaddr() does not ask the kernel again
+         * when c->local_sockaddr is not a wildcard.
+         *
+         * The addresses before the wildcard are sorted by
+         * ngx_tcp_optimize_servers(), so a binary search finds the match.
          */
 
         if (ngx_connection_local_sockaddr(c, NULL, 0) != NGX_OK) {
@@ -65,15 +105,31 @@ ngx_tcp_init_connection(ngx_connection_t *c)
 
             addr6 = port->addrs;
 
-            /* the last address is "*" */
+            /* the last address is "*", it is used if nothing matches */
+
+            i = 0;
+            j = port->naddrs - 1;
+            n = j;
+
+            while (i < j) {
+                k = (i + j) / 2;
 
-            for (i = 0; i < port->naddrs - 1; i++) {
-                if (ngx_memcmp(&addr6[i].addr6, &sin6->sin6_addr, 16) == 0) {
+                rc = ngx_memcmp(&addr6[k].addr6, &sin6->sin6_addr, 16);
+
+                if (rc == 0) {
+                    n = k;
                     break;
                 }
+
+                if (rc < 0) {
+                    i = k + 1;
+
+                } else {
+                    j = k;
+                }
             }
 
-            addr_conf = &addr6[i].conf;
+            addr_conf = &addr6[n].conf;
 
             break;
 #endif
@@ -83,15 +139,29 @@ ngx_tcp_init_connection(ngx_connection_t *c)
 
             addr = port->addrs;
 
-            /* the last address is "*" */
+            /* the last address is "*", it is used if nothing matches */
 
-            for (i = 0; i < port->naddrs - 1; i++) {
-                if (addr[i].addr == sin->sin_addr.s_addr) {
+            i = 0;
+            j = port->naddrs - 1;
+            n = j;
+
+            while (i < j) {
+                k = (i + j) / 2;
+
+                if (addr[k].addr == sin->sin_addr.s_addr) {
+                    n = k;
                     break;
                 }
+
+                if (addr[k].addr < sin->sin_addr.s_addr) {
+                    i = k + 1;
+
+                } else {
+                    j = k;
+                }
             }
 
-            addr_conf = &addr[i].conf;
+            addr_conf = &addr[n].conf;
 
             break;
         }
@@ -113,12 +183,49 @@ ngx_tcp_init_connection(ngx_connection_t *c)
         }
     }
 
-    s = ngx_pcalloc(c->pool, sizeof(ngx_tcp_session_t));
-    if (s == NULL) {
+    /*
+     * a client over its limits is closed before the session is allocated;
+     * behind a "proxy_protocol" listen the peer is the balancer, so the
+     * limits are checked once the header has given the client address
+     */
+
+    if (!addr_conf->proxy_protocol
+        && ngx_tcp_limit_connection(c, addr_conf->ctx->srv_conf) != NGX_OK)
+    {
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    /*
+     * the session, the log ctx, the modules ctx array and the protocol
+     * state are carved out of one block
+     */
+
+    p = ngx_tcp_alloc_session(c, addr_conf);
+    if (p == NULL) {
         ngx_tcp_close_connection(c);
         return;
     }
 
+    s = (ngx_tcp_session_t *) p;
+    p += ngx_align(sizeof(ngx_tcp_session_t), NGX_ALIGNMENT);
+
+    cmcf = addr_conf->ctx->main_conf[ngx_tcp_core_module.ctx_index];
+
+    s->recycled = cmcf->recycled_sessions ? 1 : 0;
+
+    ctx = (ngx_tcp_log_ctx_t *) p;
+    p += ngx_align(sizeof(ngx_tcp_log_ctx_t), NGX_ALIGNMENT);
+
+    s->ctx = (void **) p;
+    p += ngx_align(sizeof(void *) * ngx_tcp_max_module, NGX_ALIGNMENT);
+
+    cscf = addr_conf->ctx->srv_conf[ngx_tcp_core_module.ctx_index];
+
+    if (cscf->protocol->ctx_size) {
+        s->protocol_ctx = p;
+    }
+
     s->main_conf = addr_conf->ctx->main_conf;
     s->srv_conf = addr_conf->ctx->srv_conf;
 
@@ -127,13 +234,18 @@ ngx_tcp_init_connection(ngx_connection_t *c)
     c->data = s;
     s->connection = c;
 
-    ngx_log_error(NGX_LOG_INFO, c->log, 0, "*%ui client %V connected to %V",
-                  c->number, &c->addr_text, s->addr_text);
+    ngx_tcp_stats_init_session(s, addr_conf->index);
 
-    ctx = ngx_palloc(c->pool, sizeof(ngx_tcp_log_ctx_t));
-    if (ctx == NULL) {
-        ngx_tcp_close_connection(c);
-        return;
+    ngx_tcp_stats_inc(s, accepted);
+    ngx_tcp_stats_inc(s, active);
+    ngx_tcp_stats_start(s, start_time);
+
+    s->start_msec = ngx_current_msec;
+
+    /* behind a "proxy_protocol" listen the client is known from the header */
+
+    if (!addr_conf->proxy_protocol) {
+        ngx_tcp_log_connected(c, s, cscf);
     }
 
     ctx->client = &c->addr_text;
@@ -147,8 +259,47 @@ ngx_tcp_init_connection(ngx_connection_t *c)
     c->log_error = NGX_ERROR_INFO;
 
 #if (NGX_TCP_SSL)
-    {
-    ngx_tcp_ssl_conf_t  *sslcf;
+    s->ssl = addr_conf->ssl;
+#endif
+
+    if (addr_conf->proxy_protocol) {
+        c->log->action = "reading PROXY protocol";
+
+        /* the protocol gets the data read after the header */
+
+        spcf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_ssl_preread_module);
+
+        size = spcf->enable ? ngx_max(cscf->bufs.size, spcf->buffer_size)
+                            : cscf->bufs.size;
+
+        s->buffer = ngx_create_temp_buf(c->pool, size);
+        if (s->buffer == NULL) {
+            ngx_tcp_close_connection(c);
+            return;
+        }
+
+        c->read->handler = ngx_tcp_proxy_protocol_handler;
+
+        ngx_tcp_proxy_protocol_handler(c->read);
+        return;
+    }
+
+    ngx_tcp_start_session(c);
+}
+
+
+static void
+ngx_tcp_start_session(ngx_connection_t *c)
+{
+    ngx_tcp_session_t           *s;
+    ngx_tcp_ssl_preread_conf_t  *spcf;
+#if (NGX_TCP_SSL)
+    ngx_tcp_ssl_conf_t          *sslcf;
+#endif
+
+    s = c->data;
+
+#if (NGX_TCP_SSL)
 
     sslcf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_ssl_module);
 
@@ -159,7 +310,7 @@ ngx_tcp_init_connection(ngx_connection_t *c)
         return;
     }
 
-    if (addr_conf->ssl) {
+    if (s->ssl) {
 
         c->log->action = "SSL handshaking";
 
@@ -175,13 +326,195 @@ ngx_tcp_init_connection(ngx_connection_t *c)
         return;
     }
 
-    }
 #endif
 
+    spcf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_ssl_preread_module);
+
+    if (spcf->enable) {
+        c->log->action = "prereading ClientHello";
+
+        if (s->buffer == NULL) {
+            s->buffer = ngx_create_temp_buf(c->pool, spcf->buffer_size);
+            if (s->buffer == NULL) {
+                ngx_tcp_close_connection(c);
+                return;
+            }
+        }
+
+        c->read->handler = ngx_tcp_ssl_preread_handler;
+
+        ngx_tcp_ssl_preread_handler(c->read);
+        return;
+    }
+
     ngx_tcp_init_session(c);
 }
 
 
+/*
+ * the header is parsed from the first read: without SSL the data read
+ * after it stay in the session buffer for the protocol, while OpenSSL
+ * reads the socket itself, so there the header is peeked at and then
+ * exactly its length is read
+ */
+
+static void
+ngx_tcp_proxy_protocol_handler(ngx_event_t *rev)
+{
+    ssize_t                   n, size;
+    ngx_err_t                 err;
+    ngx_buf_t                *b;
+    ngx_uint_t                peek;
+    ngx_connection_t         *c;
+    ngx_tcp_session_t        *s;
+    ngx_tcp_core_srv_conf_t  *cscf;
+#if (NGX_TCP_SSL)
+    ngx_tcp_ssl_conf_t       *sslcf;
+#endif
+
+    c = rev->data;
+    s = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out");
+        ngx_tcp_stats_inc(s, handshake_timeouts);
+        c->timedout = 1;
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    b = s->buffer;
+    peek = 0;
+
+#if (NGX_TCP_SSL)
+    sslcf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_ssl_module);
+
+    peek = (sslcf->enable || s->ssl);
+#endif
+
+    if (!rev->ready) {
+        goto again;
+    }
+
+    if (peek) {
+        n = recv(c->fd, (char *) b->start, b->end - b->start, MSG_PEEK);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EAGAIN) {
+                rev->ready = 0;
+                goto again;
+            }
+
+            ngx_connection_error(c, err, "recv() failed");
+            ngx_tcp_close_connection(c);
+            return;
+        }
+
+        b->last = b->start + n;
+
+    } else {
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            goto again;
+        }
+
+        if (n > 0) {
+            s->received += n;
+            b->last += n;
+        }
+    }
+
+    if (n == 0 || n == NGX_ERROR) {
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    size = ngx_tcp_proxy_protocol_read(c, b->pos, b->last);
+
+    if (size == NGX_AGAIN) {
+
+        if (b->last == b->end) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "too large PROXY protocol header");
+            s->status = NGX_TCP_BAD_REQUEST;
+            ngx_tcp_close_connection(c);
+            return;
+        }
+
+        if (peek) {
+            rev->ready = 0;
+        }
+
+        goto again;
+    }
+
+    if (size == NGX_ERROR) {
+        s->status = NGX_TCP_BAD_REQUEST;
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    if (ngx_tcp_limit_connection(c, s->srv_conf) != NGX_OK) {
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+
+    ngx_tcp_log_connected(c, s, cscf);
+
+    if (peek) {
+
+        /* the header has been peeked at, so it is read at once */
+
+        n = c->recv(c, b->start, size);
+
+        if (n != size) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "PROXY protocol header is not read at once");
+            ngx_tcp_close_connection(c);
+            return;
+        }
+
+        s->received += n;
+
+        b->pos = b->start;
+        b->last = b->start;
+
+    } else {
+        b->pos += size;
+
+        if (b->pos == b->last) {
+            b->pos = b->start;
+            b->last = b->start;
+        }
+    }
+
+    if (rev->timer_set) {
+        ngx_del_timer(rev);
+    }
+
+    c->read->handler = ngx_tcp_dummy_handler;
+
+    ngx_tcp_start_session(c);
+    return;
+
+again:
+
+    if (!rev->timer_set) {
+        cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+        ngx_add_timer(rev, cscf->handshake_timeout);
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_tcp_close_connection(c);
+    }
+}
+
+
 #if (NGX_TCP_SSL)
 
 void
@@ -209,6 +542,10 @@ ngx_tcp_ssl_init_connection(ngx_ssl_t *ssl, ngx_connection_t *c)
     ngx_tcp_session_t        *s;
     ngx_tcp_core_srv_conf_t  *cscf;
 
+    s = c->data;
+
+    ngx_tcp_stats_start(s, handshake_time);
+
     if (ngx_ssl_create_connection(ssl, c, 0) == NGX_ERROR) {
         ngx_tcp_close_connection(c);
         return;
@@ -216,11 +553,9 @@ ngx_tcp_ssl_init_connection(ngx_ssl_t *ssl, ngx_connection_t *c)
 
     if (ngx_ssl_handshake(c) == NGX_AGAIN) {
 
-        s = c->data;
-
         cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
 
-        ngx_add_timer(c->read, cscf->timeout);
+        ngx_add_timer(c->read, cscf->handshake_timeout);
 
         c->ssl->handler = ngx_tcp_ssl_handshake_handler;
 
@@ -237,133 +572,928 @@ ngx_tcp_ssl_handshake_handler(ngx_connection_t *c)
     ngx_tcp_session_t        *s;
     ngx_tcp_core_srv_conf_t  *cscf;
 
+    s = c->data;
+
     if (c->ssl->handshaked) {
 
-        s = c->data;
+        /* the idle timeouts of the session are armed by the protocol */
+
+        if (c->read->timer_set) {
+            ngx_del_timer(c->read);
+        }
+
+#if (NGX_TCP_SSL_EARLY_DATA)
+
+        /*
+         * the early data are read by the protocol while the handshake
+         * is still in progress, so the read event is left ready; the
+         * handshake is finished by the reads, which are watched for it
+         */
+
+        if (c->ssl->in_early) {
+            ngx_log_debug0(NGX_LOG_DEBUG_CORE, c->log, 0,
+                           "tcp ssl early data");
+
+            s->early_data = 1;
+            s->early_data_accepted = 1;
+
+            c->recv = ngx_tcp_ssl_recv_early;
+            c->recv_chain = ngx_tcp_ssl_recv_chain_early;
+
+        } else {
+            ngx_tcp_ssl_handshaked(s);
+        }
+
+#else
+        ngx_tcp_ssl_handshaked(s);
+#endif
 
         if (s->starttls) {
+
+            /* the protocol goes on over the secured connection */
+
             cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
 
-            c->read->handler = cscf->protocol->init_protocol;
-            c->write->handler = ngx_tcp_send;
+            c->read->ready = s->early_data;
+            c->log->action = "processing session";
 
-            cscf->protocol->init_protocol(c->read);
+            cscf->protocol->process_session(s);
 
             return;
         }
 
-        c->read->ready = 0;
+        c->read->ready = s->early_data;
 
         ngx_tcp_init_session(c);
         return;
     }
 
+    ngx_tcp_stats_inc(s, failed);
+
+    if (c->read->timedout) {
+        ngx_tcp_stats_inc(s, handshake_timeouts);
+    }
+
+    s->status = NGX_TCP_BAD_REQUEST;
+
     ngx_tcp_close_connection(c);
 }
 
-#endif
 
+/* accounts the handshake once it is finished, after the early data too */
 
 static void
-ngx_tcp_init_session(ngx_connection_t *c)
+ngx_tcp_ssl_handshaked(ngx_tcp_session_t *s)
 {
-    ngx_tcp_session_t        *s;
-    ngx_tcp_core_srv_conf_t  *cscf;
-
-    c->read->handler = ngx_tcp_dummy_handler;
-    c->write->handler = ngx_tcp_dummy_handler;
+    ngx_connection_t  *c;
 
-    c->log->action = "initializing session";
+    c = s->connection;
 
-    s = c->data;
+    ngx_tcp_stats_inc(s, ssl_handshakes);
+    ngx_tcp_stats_record(s, NGX_TCP_STATS_HANDSHAKE, handshake_time);
 
-    s->ctx = ngx_pcalloc(c->pool, sizeof(void *) * ngx_tcp_max_module);
-    if (s->ctx == NULL) {
-        ngx_tcp_close_connection(c);
-        return;
+    if (SSL_session_reused(c->ssl->connection)) {
+        ngx_tcp_stats_inc(s, ssl_session_reuses);
     }
 
-    cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+#if (NGX_TCP_SSL_KTLS)
 
-    if (cscf->protocol->init_session(s) != NGX_OK) {
-        ngx_tcp_close_connection(c);
-        return;
+    if (BIO_get_ktls_send(SSL_get_wbio(c->ssl->connection))) {
+        s->ktls = 1;
+        ngx_tcp_stats_inc(s, ssl_ktls);
     }
 
-    c->log->action = "processing session";
-
-    cscf->protocol->process_session(s);
-}
-
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, c->log, 0,
+                   "tcp ssl ktls send:%d recv:%d",
+                   BIO_get_ktls_send(SSL_get_wbio(c->ssl->connection)),
+                   BIO_get_ktls_recv(SSL_get_rbio(c->ssl->connection)));
 
-static void
-ngx_tcp_dummy_handler(ngx_event_t *ev)
-{
-    ngx_log_debug0(NGX_LOG_DEBUG_CORE, ev->log, 0, "tcp dummy handler");
+#endif
 }
 
 
-#if (NGX_TCP_SSL)
+/*
+ * returns 1 while the input read may still be early data, that is,
+ * the handshake is not finished yet
+ */
 
-ngx_int_t
-ngx_tcp_starttls_only(ngx_tcp_session_t *s, ngx_connection_t *c)
+ngx_uint_t
+ngx_tcp_ssl_early_data(ngx_tcp_session_t *s)
 {
-    ngx_tcp_ssl_conf_t  *sslcf;
+#if (NGX_TCP_SSL_EARLY_DATA)
 
-    if (c->ssl) {
+    ngx_connection_t  *c;
+
+    if (!s->early_data) {
         return 0;
     }
 
-    sslcf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_ssl_module);
+    c = s->connection;
 
-    if (sslcf->starttls == NGX_TCP_STARTTLS_ONLY) {
+    if (SSL_in_init(c->ssl->connection)) {
         return 1;
     }
 
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, c->log, 0,
+                   "tcp ssl handshake after early data");
+
+    s->early_data = 0;
+
+    c->recv = ngx_ssl_recv;
+    c->recv_chain = ngx_ssl_recv_chain;
+
+    ngx_tcp_ssl_handshaked(s);
+
+#endif
+
     return 0;
 }
 
-#endif
 
+#if (NGX_TCP_SSL_EARLY_DATA)
 
-void
-ngx_tcp_internal_server_error(ngx_tcp_session_t *s)
+static ssize_t
+ngx_tcp_ssl_recv_early(ngx_connection_t *c, u_char *buf, size_t size)
 {
-    ngx_tcp_core_srv_conf_t  *cscf;
+    ssize_t  n;
 
-    cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+    n = ngx_ssl_recv(c, buf, size);
 
-    if (cscf->protocol->internal_server_error) {
-        cscf->protocol->internal_server_error(s);
-    }
+    (void) ngx_tcp_ssl_early_data(c->data);
 
-    ngx_tcp_close_connection(s->connection);
+    return n;
 }
 
 
-void
-ngx_tcp_close_connection(ngx_connection_t *c)
+static ssize_t
+ngx_tcp_ssl_recv_chain_early(ngx_connection_t *c, ngx_chain_t *cl,
+    off_t limit)
 {
-    ngx_pool_t               *pool;
-    ngx_tcp_session_t        *s;
-    ngx_tcp_core_srv_conf_t  *cscf;
+    ssize_t  n;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_CORE, c->log, 0,
-                   "close tcp connection: %d", c->fd);
+    n = ngx_ssl_recv_chain(c, cl, limit);
 
-#if (NGX_TCP_SSL)
+    (void) ngx_tcp_ssl_early_data(c->data);
 
-    if (c->ssl) {
-        if (ngx_ssl_shutdown(c) == NGX_AGAIN) {
-            c->ssl->handler = ngx_tcp_close_connection;
+    return n;
+}
+
+#endif
+
+#endif
+
+
+/*
+ * the ClientHello is read into the session buffer, where it stays for
+ * the protocol; the timeout bounds the whole preread
+ */
+
+static void
+ngx_tcp_ssl_preread_handler(ngx_event_t *rev)
+{
+    ssize_t                      n;
+    ngx_buf_t                   *b;
+    ngx_connection_t            *c;
+    ngx_tcp_session_t           *s;
+    ngx_tcp_ssl_preread_conf_t  *spcf;
+
+    c = rev->data;
+    s = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out");
+        ngx_tcp_stats_inc(s, handshake_timeouts);
+        c->timedout = 1;
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    b = s->buffer;
+
+    /* the data read with the PROXY protocol header are parsed first */
+
+    while (ngx_tcp_ssl_preread(s, b->pos, b->last) == NGX_AGAIN) {
+
+        if (b->last == b->end) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "ClientHello does not fit in "
+                          "ssl_preread_buffer_size");
+
+            /* the buffer is passed through with the default route */
+
+            ngx_tcp_ssl_preread_route(s);
+            break;
+        }
+
+        if (!rev->ready) {
+            goto again;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            goto again;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_tcp_close_connection(c);
             return;
         }
+
+        s->received += n;
+        b->last += n;
+    }
+
+    if (rev->timer_set) {
+        ngx_del_timer(rev);
+    }
+
+    ngx_tcp_init_session(c);
+    return;
+
+again:
+
+    if (!rev->timer_set) {
+        spcf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_ssl_preread_module);
+        ngx_add_timer(rev, spcf->timeout);
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_tcp_close_connection(c);
+    }
+}
+
+
+static u_char *
+ngx_tcp_alloc_session(ngx_connection_t *c, ngx_tcp_addr_conf_t *addr_conf)
+{
+    void                      *block;
+    ngx_tcp_core_srv_conf_t   *cscf;
+    ngx_tcp_core_main_conf_t  *cmcf;
+
+    cmcf = addr_conf->ctx->main_conf[ngx_tcp_core_module.ctx_index];
+
+    if (cmcf->recycled_sessions == 0) {
+        cscf = addr_conf->ctx->srv_conf[ngx_tcp_core_module.ctx_index];
+
+        /* it fits in the pool sized by ngx_tcp_optimize_servers() */
+
+        return ngx_pcalloc(c->pool, ngx_tcp_session_size(cscf->protocol));
+    }
+
+    block = cmcf->free_sessions;
+
+    if (block) {
+        cmcf->free_sessions = *(void **) block;
+        cmcf->nfree_sessions--;
+        cmcf->session_hits++;
+
+        if (ngx_tcp_stats_worker) {
+            ngx_tcp_stats_worker->session_hits++;
+        }
+
+    } else {
+        block = ngx_alloc(cmcf->session_size, c->log);
+        if (block == NULL) {
+            return NULL;
+        }
+
+        cmcf->session_misses++;
+
+        if (ngx_tcp_stats_worker) {
+            ngx_tcp_stats_worker->session_misses++;
+        }
+    }
+
+    ngx_memzero(block, cmcf->session_size);
+
+    return block;
+}
+
+
+static void
+ngx_tcp_free_session(ngx_tcp_session_t *s)
+{
+    ngx_tcp_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_tcp_get_module_main_conf(s, ngx_tcp_core_module);
+
+    if (cmcf->nfree_sessions >= cmcf->recycled_sessions) {
+        ngx_free(s);
+        return;
     }
 
+    *(void **) s = cmcf->free_sessions;
+    cmcf->free_sessions = s;
+    cmcf->nfree_sessions++;
+}
+
+
+/* only the connect message is sampled, it is checked before formatting */
+
+static void
+ngx_tcp_log_connected(ngx_connection_t *c, ngx_tcp_session_t *s,
+    ngx_tcp_core_srv_conf_t *cscf)
+{
+    ngx_log_handler_pt  handler;
+
+    if (!ngx_tcp_log_sampled(c, cscf)) {
+        return;
+    }
+
+    /* the message is the same with the log handler set */
+
+    handler = c->log->handler;
+    c->log->handler = NULL;
+
+    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                  "*%ui client %V connected to %V",
+                  c->number, &c->addr_text, s->addr_text);
+
+    c->log->handler = handler;
+}
+
+
+/*
+ * 1 of cscf->log_sample connections is logged, and of those at most
+ * cscf->log_rate per cscf->log_interval seconds; the messages dropped
+ * by the rate limit are counted and reported by a timer at the end of
+ * the interval, even if no connection comes after it
+ */
+
+static ngx_uint_t
+ngx_tcp_log_sampled(ngx_connection_t *c, ngx_tcp_core_srv_conf_t *cscf)
+{
+    time_t        now;
+    ngx_event_t  *ev;
+
+    if (c->log->log_level < NGX_LOG_INFO) {
+        return 0;
+    }
+
+    if (cscf->log_sample > 1 && cscf->log_connections++ % cscf->log_sample) {
+        return 0;
+    }
+
+    if (cscf->log_rate == 0) {
+        return 1;
+    }
+
+    now = ngx_time();
+
+    if (now - cscf->log_start >= cscf->log_interval) {
+        cscf->log_start = now;
+        cscf->log_logged = 0;
+    }
+
+    if (cscf->log_logged < cscf->log_rate) {
+        cscf->log_logged++;
+        return 1;
+    }
+
+    if (cscf->log_suppressed++ == 0) {
+        ev = &cscf->log_event;
+
+        ev->handler = ngx_tcp_log_suppressed_handler;
+        ev->data = cscf;
+        ev->log = ngx_cycle->log;
+        ev->cancelable = 1;
+
+        ngx_add_timer(ev, (ngx_msec_t) (cscf->log_start + cscf->log_interval
+                                        - now) * 1000);
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_tcp_log_suppressed_handler(ngx_event_t *ev)
+{
+    ngx_tcp_core_srv_conf_t *cscf = ev->data;
+
+    ngx_log_error(NGX_LOG_NOTICE, ev->log, 0,
+                  "tcp server \"%V\" in %s:%ui: "
+                  "suppressed %ui connection log messages",
+                  &cscf->server_name, cscf->file_name, cscf->line,
+                  cscf->log_suppressed);
+
+    cscf->log_suppressed = 0;
+}
+
+
+static void
+ngx_tcp_init_session(ngx_connection_t *c)
+{
+    ngx_tcp_session_t        *s;
+    ngx_tcp_core_srv_conf_t  *cscf;
+
+    c->read->handler = ngx_tcp_dummy_handler;
+    c->write->handler = ngx_tcp_dummy_handler;
+
+    c->log->action = "initializing session";
+
+    s = c->data;
+
+    cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+
+    if (cscf->protocol->init_session(s) != NGX_OK) {
+        ngx_tcp_stats_inc(s, failed);
+
+        if (s->status == 0) {
+            s->status = NGX_TCP_BAD_REQUEST;
+        }
+
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    ngx_tcp_stats_inc(s, handled);
+    ngx_tcp_stats_record(s, NGX_TCP_STATS_ACCEPT, start_time);
+
+    c->log->action = "processing session";
+
+    cscf->protocol->process_session(s);
+}
+
+
+static void
+ngx_tcp_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, ev->log, 0, "tcp dummy handler");
+}
+
+
+#if (NGX_TCP_SSL)
+
+ngx_int_t
+ngx_tcp_starttls_only(ngx_tcp_session_t *s, ngx_connection_t *c)
+{
+    ngx_tcp_ssl_conf_t  *sslcf;
+
+    if (c->ssl) {
+        return 0;
+    }
+
+    sslcf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_ssl_module);
+
+    if (sslcf->starttls == NGX_TCP_STARTTLS_ONLY) {
+        return 1;
+    }
+
+    return 0;
+}
+
 #endif
 
+
+void
+ngx_tcp_internal_server_error(ngx_tcp_session_t *s)
+{
+    ngx_tcp_core_srv_conf_t  *cscf;
+
+    cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+
+    ngx_tcp_stats_inc(s, failed);
+
+    if (s->status == 0) {
+        s->status = NGX_TCP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (cscf->protocol->internal_server_error) {
+        cscf->protocol->internal_server_error(s);
+    }
+
+    ngx_tcp_close_connection(s->connection);
+}
+
+
+/*
+ * the session buffers: up to tcp_buffers number are allocated from
+ * the connection pool on demand, the ones not used any more are kept
+ * in s->free and reused; a buffer of the session is tagged with the core
+ * module, a link of ngx_tcp_get_link() with the tcp module, any other
+ * buffer of the output is owned by its protocol
+ */
+
+ngx_chain_t *
+ngx_tcp_get_buf(ngx_tcp_session_t *s)
+{
+    ngx_buf_t                *b;
+    ngx_chain_t              *cl;
+    ngx_tcp_core_srv_conf_t  *cscf;
+
+    if (s->free) {
+        cl = s->free;
+        s->free = cl->next;
+        cl->next = NULL;
+
+        return cl;
+    }
+
+    cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+
+    if (s->nbufs == (ngx_uint_t) cscf->bufs.num) {
+        return NULL;
+    }
+
+    b = ngx_create_temp_buf(s->connection->pool, cscf->bufs.size);
+    if (b == NULL) {
+        return NGX_CHAIN_ERROR;
+    }
+
+    b->tag = (ngx_buf_tag_t) &ngx_tcp_core_module;
+
+    cl = ngx_alloc_chain_link(s->connection->pool);
+    if (cl == NULL) {
+        return NGX_CHAIN_ERROR;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    s->nbufs++;
+
+    return cl;
+}
+
+
+/*
+ * a link with a buffer without memory, to send the data owned by
+ * the protocol, e.g. a part of its read buffer
+ */
+
+ngx_chain_t *
+ngx_tcp_get_link(ngx_tcp_session_t *s)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    if (s->free_links) {
+        cl = s->free_links;
+        s->free_links = cl->next;
+        cl->next = NULL;
+
+        return cl;
+    }
+
+    b = ngx_calloc_buf(s->connection->pool);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->tag = (ngx_buf_tag_t) &ngx_tcp_module;
+
+    cl = ngx_alloc_chain_link(s->connection->pool);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    return cl;
+}
+
+
+void
+ngx_tcp_free_buf(ngx_tcp_session_t *s, ngx_chain_t *cl)
+{
+    if (cl->buf->tag == (ngx_buf_tag_t) &ngx_tcp_module) {
+        ngx_memzero(cl->buf, sizeof(ngx_buf_t));
+        cl->buf->tag = (ngx_buf_tag_t) &ngx_tcp_module;
+
+        cl->next = s->free_links;
+        s->free_links = cl;
+        return;
+    }
+
+    if (cl->buf->tag != (ngx_buf_tag_t) &ngx_tcp_core_module) {
+        ngx_free_chain(s->connection->pool, cl);
+        return;
+    }
+
+    cl->buf->pos = cl->buf->start;
+    cl->buf->last = cl->buf->start;
+
+    cl->next = s->free;
+    s->free = cl;
+}
+
+
+/*
+ * reads into the tail of the last input buffer and into all free buffers
+ * with one readv(), a new buffer is allocated only if there is no room
+ * at all; returns the bytes read, 0 on eof, NGX_AGAIN, NGX_ERROR, or
+ * NGX_BUSY if all buffers hold the input not consumed yet
+ */
+
+ssize_t
+ngx_tcp_recv_chain(ngx_tcp_session_t *s)
+{
+    size_t             size;
+    ssize_t            n, rest;
+    ngx_chain_t       *cl, *last, *chain, **ll;
+    ngx_connection_t  *c;
+
+    c = s->connection;
+
+    if (!c->read->ready) {
+        return NGX_AGAIN;
+    }
+
+    last = NULL;
+
+    for (ll = &s->in; *ll; ll = &(*ll)->next) {
+        last = *ll;
+    }
+
+    *ll = s->free;
+    s->free = NULL;
+
+    if (last && last->buf->last < last->buf->end) {
+        chain = last;
+
+    } else {
+        if (*ll == NULL) {
+            cl = ngx_tcp_get_buf(s);
+
+            if (cl == NULL) {
+                return NGX_BUSY;
+            }
+
+            if (cl == NGX_CHAIN_ERROR) {
+                return NGX_ERROR;
+            }
+
+            *ll = cl;
+        }
+
+        chain = *ll;
+    }
+
+    n = c->recv_chain(c, chain, 0);
+
+    if (n > 0) {
+        s->received += n;
+
+        rest = n;
+
+        for (cl = chain; rest; cl = cl->next) {
+            size = cl->buf->end - cl->buf->last;
+
+            if ((size_t) rest < size) {
+                size = rest;
+            }
+
+            cl->buf->last += size;
+            rest -= size;
+        }
+    }
+
+    /* the buffers not read into are returned to the free list */
+
+    while (*ll && (*ll)->buf->last != (*ll)->buf->pos) {
+        ll = &(*ll)->next;
+    }
+
+    s->free = *ll;
+    *ll = NULL;
+
+    return n;
+}
+
+
+void
+ngx_tcp_free_input(ngx_tcp_session_t *s)
+{
+    ngx_chain_t  *cl;
+
+    while (s->in && s->in->buf->pos == s->in->buf->last) {
+        cl = s->in;
+        s->in = cl->next;
+
+        ngx_tcp_free_buf(s, cl);
+    }
+}
+
+
+/* the links queued are owned by the session, the ones sent are freed */
+
+void
+ngx_tcp_queue_chain(ngx_tcp_session_t *s, ngx_chain_t *in)
+{
+    ngx_chain_t  **ll;
+
+    for (ll = &s->out; *ll; ll = &(*ll)->next) { /* void */ }
+
+    *ll = in;
+}
+
+
+/*
+ * queues the chain and sends all the output queued with one
+ * c->send_chain() call, that is one writev() as long as the output
+ * fits in NGX_IOVS_PREALLOCATE buffers; returns NGX_OK if everything
+ * is sent, NGX_AGAIN, or NGX_ERROR
+ */
+
+ngx_int_t
+ngx_tcp_send_chain(ngx_tcp_session_t *s, ngx_chain_t *in)
+{
+    ngx_chain_t       *cl;
+    ngx_connection_t  *c;
+
+    c = s->connection;
+
+    ngx_tcp_queue_chain(s, in);
+
+    if (s->out == NULL) {
+        return NGX_OK;
+    }
+
+    if (c->write->ready) {
+
+        cl = c->send_chain(c, s->out, 0);
+
+        if (cl == NGX_CHAIN_ERROR) {
+            c->error = 1;
+            return NGX_ERROR;
+        }
+
+        while (s->out && ngx_buf_size(s->out->buf) == 0) {
+            cl = s->out;
+            s->out = cl->next;
+
+            ngx_tcp_free_buf(s, cl);
+        }
+
+        if (s->out == NULL) {
+            return NGX_OK;
+        }
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+/*
+ * drives a protocol with process_request() through the requests already
+ * buffered: up to requests_per_event of them are processed in a row and
+ * their responses are sent with one ngx_tcp_send_chain(), then the rest
+ * is posted to wait until the other connections have got their turn;
+ * process_request() returns
+ *
+ *     NGX_OK     a request is processed, the next one may be buffered,
+ *     NGX_AGAIN  more input is needed and nothing is left to be read,
+ *     NGX_BUSY   the output must be sent before reading further,
+ *     NGX_DONE   the session is over, it is closed once the output is sent,
+ *     NGX_ERROR  the session is closed at once
+ */
+
+void
+ngx_tcp_process_requests(ngx_tcp_session_t *s)
+{
+    ngx_connection_t  *c;
+
+    c = s->connection;
+
+    c->read->handler = ngx_tcp_request_handler;
+    c->write->handler = ngx_tcp_request_handler;
+
+    ngx_tcp_request_handler(c->read);
+}
+
+
+static void
+ngx_tcp_request_handler(ngx_event_t *ev)
+{
+    ngx_int_t                 rc, sent;
+    ngx_uint_t                n;
+    ngx_connection_t         *c;
+    ngx_tcp_session_t        *s;
+    ngx_tcp_core_srv_conf_t  *cscf;
+
+    c = ev->data;
+    s = c->data;
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out");
+
+        if (s->out) {
+            ngx_tcp_stats_inc(s, send_timeouts);
+
+        } else {
+            ngx_tcp_stats_inc(s, read_timeouts);
+        }
+
+        c->timedout = 1;
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+
+    n = 0;
+
+    for ( ;; ) {
+        rc = s->quit ? NGX_DONE : cscf->protocol->process_request(s);
+
+        if (rc == NGX_OK && ++n < cscf->requests_per_event) {
+            continue;
+        }
+
+        if (rc == NGX_ERROR) {
+            ngx_tcp_close_connection(c);
+            return;
+        }
+
+        sent = ngx_tcp_send_chain(s, NULL);
+
+        if (sent == NGX_ERROR) {
+            ngx_tcp_close_connection(c);
+            return;
+        }
+
+        /* the output is sent, the buffers may be read into again */
+
+        if (rc == NGX_BUSY && sent == NGX_OK
+            && ++n < cscf->requests_per_event)
+        {
+            continue;
+        }
+
+        break;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, c->log, 0,
+                   "tcp requests: %ui, rc: %i", n, rc);
+
+    if (rc == NGX_DONE) {
+
+        if (sent == NGX_OK) {
+            ngx_tcp_close_connection(c);
+            return;
+        }
+
+        s->quit = 1;
+
+    } else if ((rc == NGX_OK || rc == NGX_BUSY) && sent == NGX_OK) {
+
+        /*
+         * the budget is spent or the output is sent, the rest is posted;
+         * with the output not sent the write event resumes the session
+         */
+
+        ngx_tcp_del_idle_timer(s);
+
+        ngx_post_event(c->read, &ngx_posted_events);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    /* the output not sent yet is waited for with the send timeout */
+
+    ngx_tcp_add_idle_timer(s, c->read, s->out ? cscf->send_timeout
+                                              : cscf->read_timeout);
+}
+
+
+void
+ngx_tcp_close_connection(ngx_connection_t *c)
+{
+    ngx_pool_t               *pool;
+    ngx_tcp_session_t        *s;
+    ngx_tcp_core_srv_conf_t  *cscf;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, c->log, 0,
+                   "close tcp connection: %d", c->fd);
+
     s = c->data;
 
+    if (s != NULL) {
+        ngx_tcp_del_idle_timer(s);
+    }
+
+#if (NGX_TCP_SSL)
+
+    if (c->ssl) {
+        if (ngx_ssl_shutdown(c) == NGX_AGAIN) {
+            c->ssl->handler = ngx_tcp_close_connection;
+            return;
+        }
+    }
+
+#endif
+
     if (s != NULL) {
         c->log->action = "closing session";
 
@@ -372,6 +1502,13 @@ ngx_tcp_close_connection(ngx_connection_t *c)
         if (cscf->protocol->close_session) {
             cscf->protocol->close_session(s);
         }
+
+        ngx_tcp_stats_dec(s, active);
+        ngx_tcp_stats_add(s, bytes_in, s->received);
+        ngx_tcp_stats_add(s, bytes_out, c->sent);
+        ngx_tcp_stats_record(s, NGX_TCP_STATS_SESSION, start_time);
+
+        ngx_tcp_log_session(s);
     }
 
 #if (NGX_STAT_STUB)
@@ -385,6 +1522,12 @@ ngx_tcp_close_connection(ngx_connection_t *c)
     ngx_close_connection(c);
 
     ngx_destroy_pool(pool);
+
+    /* the pool cleanups and the log still use the session */
+
+    if (s && s->recycled) {
+        ngx_tcp_free_session(s);
+    }
 }
 
 
@@ -419,7 +1562,7 @@ ngx_tcp_log_error(ngx_log_t *log, u_char *buf, size_t len)
     len -= p - buf;
     buf = p;
 
-    if (s->proxy == NULL) {
+    if (s->proxy == NULL || s->proxy->upstream.name == NULL) {
         return p;
     }
 
@@ -0,0 +1,901 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_tcp.h>
+
+
+/*
+ * the connections and the accept rate of a client address are limited
+ * before anything is allocated for the session, so a client rejected
+ * costs only a lookup in the zone, and a message only if "limit_log_level"
+ * is enabled in the error log
+ *
+ * a zone is a fixed table of buckets in shared memory: the address hash
+ * selects a bucket, and each pair of buckets has its own spinlock over
+ * a few nodes, so the workers contend only when they hit the same pair;
+ * the spinlock holds the pid of its owner, so the lock of a worker that
+ * has died is taken over rather than blocking the pair in all workers
+ *
+ * in a connection zone an address whose bucket is full is stored in the
+ * other bucket of the pair, and a client is rejected as "zone is full"
+ * only if both are; a rate zone reuses the node refilled the longest ago
+ */
+
+
+#define NGX_TCP_LIMIT_BUCKET_NODES  6
+
+
+#define ngx_tcp_limit_pair_lock(ctx, bucket)                                 \
+    (&(ctx)->buckets[((bucket) - (ctx)->buckets) & ~1].lock)
+
+#define ngx_tcp_limit_in_bucket(bucket, node)                                \
+    ((node) >= (bucket)->nodes                                               \
+     && (node) < (bucket)->nodes + NGX_TCP_LIMIT_BUCKET_NODES)
+
+
+typedef struct {
+    uint32_t                 hash;       /* 0 if the node is free */
+    u_short                  len;
+    u_short                  conns;
+
+    /* the token bucket, in 1/1000 of a connection */
+    ngx_uint_t               tokens;
+    ngx_msec_t               last;
+
+    u_char                   addr[16];
+} ngx_tcp_limit_node_t;
+
+
+typedef struct {
+    /* used in the even bucket of a pair */
+    ngx_atomic_t             lock;
+
+    /* the nodes of the addresses of this bucket stored in the other one */
+    ngx_uint_t               spilled;
+
+    ngx_tcp_limit_node_t     nodes[NGX_TCP_LIMIT_BUCKET_NODES];
+} ngx_tcp_limit_bucket_t;
+
+
+/* the table as the processes attaching to an existing zone find it */
+
+typedef struct {
+    ngx_tcp_limit_bucket_t  *buckets;
+    ngx_uint_t               nbuckets;
+} ngx_tcp_limit_shctx_t;
+
+
+typedef struct {
+    ngx_tcp_limit_bucket_t  *buckets;
+    ngx_uint_t               nbuckets;
+
+    /* connections per 1000 seconds, 0 in a "limit_conn_zone" */
+    ngx_uint_t               rate;
+
+    /* the size of the token bucket, in 1/1000 of a connection */
+    ngx_uint_t               burst;
+} ngx_tcp_limit_ctx_t;
+
+
+typedef struct {
+    ngx_shm_zone_t          *shm_zone;
+    ngx_uint_t               conn;
+} ngx_tcp_limit_t;
+
+
+typedef struct {
+    /* of ngx_tcp_limit_t, the "limit_conn" and "limit_rate" zones */
+    ngx_array_t             *limits;
+    ngx_uint_t               log_level;
+} ngx_tcp_limit_conf_t;
+
+
+typedef struct {
+    ngx_tcp_limit_ctx_t     *ctx;
+    ngx_tcp_limit_bucket_t  *bucket;
+    uint32_t                 hash;
+    u_short                  len;
+    u_char                   addr[16];
+} ngx_tcp_limit_cleanup_t;
+
+
+static ngx_int_t ngx_tcp_limit_check(ngx_connection_t *c,
+    ngx_tcp_limit_t *limit, ngx_uint_t log_level, uint32_t hash,
+    u_char *addr, size_t len);
+static ngx_tcp_limit_node_t *ngx_tcp_limit_lookup(ngx_tcp_limit_ctx_t *ctx,
+    ngx_tcp_limit_bucket_t *bucket, uint32_t hash, u_char *addr,
+    size_t len);
+static ngx_tcp_limit_node_t *ngx_tcp_limit_lookup_bucket(
+    ngx_tcp_limit_ctx_t *ctx, ngx_tcp_limit_bucket_t *bucket, uint32_t hash,
+    u_char *addr, size_t len);
+static void ngx_tcp_limit_lock(ngx_atomic_t *lock);
+static void ngx_tcp_limit_cleanup(void *data);
+static void *ngx_tcp_limit_create_conf(ngx_conf_t *cf);
+static char *ngx_tcp_limit_merge_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static char *ngx_tcp_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_tcp_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_tcp_limit_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
+
+static ngx_conf_enum_t  ngx_tcp_limit_log_levels[] = {
+    { ngx_string("info"), NGX_LOG_INFO },
+    { ngx_string("notice"), NGX_LOG_NOTICE },
+    { ngx_string("warn"), NGX_LOG_WARN },
+    { ngx_string("error"), NGX_LOG_ERR },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_command_t  ngx_tcp_limit_commands[] = {
+
+    { ngx_string("limit_conn_zone"),
+      NGX_TCP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_tcp_limit_zone,
+      NGX_TCP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("limit_rate_zone"),
+      NGX_TCP_MAIN_CONF|NGX_CONF_TAKE23,
+      ngx_tcp_limit_zone,
+      NGX_TCP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("limit_conn"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE2,
+      ngx_tcp_limit,
+      NGX_TCP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("limit_rate"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_tcp_limit,
+      NGX_TCP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("limit_log_level"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_limit_conf_t, log_level),
+      &ngx_tcp_limit_log_levels },
+
+      ngx_null_command
+};
+
+
+static ngx_tcp_module_t  ngx_tcp_limit_module_ctx = {
+    NULL,                                  /* protocol */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_tcp_limit_create_conf,             /* create server configuration */
+    ngx_tcp_limit_merge_conf               /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_tcp_limit_module = {
+    NGX_MODULE_V1,
+    &ngx_tcp_limit_module_ctx,             /* module context */
+    ngx_tcp_limit_commands,                /* module directives */
+    NGX_TCP_MODULE,                        /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * the address is the one of the peer accepted, or behind a "proxy_protocol"
+ * listen the client address of the header, see ngx_tcp_init_connection()
+ */
+
+ngx_int_t
+ngx_tcp_limit_connection(ngx_connection_t *c, void **srv_conf)
+{
+    u_char                *addr;
+    size_t                 len;
+    uint32_t               hash;
+    ngx_int_t              rc;
+    ngx_uint_t             i;
+    ngx_tcp_limit_t       *limits;
+    struct sockaddr_in    *sin;
+    ngx_tcp_limit_conf_t  *lcf;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6   *sin6;
+#endif
+
+    lcf = srv_conf[ngx_tcp_limit_module.ctx_index];
+
+    if (lcf->limits == NULL) {
+        return NGX_OK;
+    }
+
+    switch (c->sockaddr->sa_family) {
+
+    case AF_INET:
+        sin = (struct sockaddr_in *) c->sockaddr;
+        addr = (u_char *) &sin->sin_addr;
+        len = sizeof(struct in_addr);
+        break;
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) c->sockaddr;
+        addr = sin6->sin6_addr.s6_addr;
+        len = 16;
+        break;
+#endif
+
+    default:
+        return NGX_OK;
+    }
+
+    hash = ngx_crc32_short(addr, len);
+
+    if (hash == 0) {
+        hash = 1;
+    }
+
+    limits = lcf->limits->elts;
+
+    for (i = 0; i < lcf->limits->nelts; i++) {
+
+        rc = ngx_tcp_limit_check(c, &limits[i], lcf->log_level, hash, addr,
+                                 len);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_tcp_limit_check(ngx_connection_t *c, ngx_tcp_limit_t *limit,
+    ngx_uint_t log_level, uint32_t hash, u_char *addr, size_t len)
+{
+    ngx_uint_t                tokens;
+    ngx_atomic_t             *lock;
+    ngx_msec_int_t            elapsed;
+    ngx_pool_cleanup_t       *cln;
+    ngx_tcp_limit_ctx_t      *ctx;
+    ngx_tcp_limit_node_t     *node;
+    ngx_tcp_limit_bucket_t   *bucket;
+    ngx_tcp_limit_cleanup_t  *lc;
+
+    ctx = limit->shm_zone->data;
+    bucket = &ctx->buckets[hash % ctx->nbuckets];
+    lock = ngx_tcp_limit_pair_lock(ctx, bucket);
+
+    cln = NULL;
+
+    if (ctx->rate == 0) {
+
+        /* added first, so that a connection counted is always released */
+
+        cln = ngx_pool_cleanup_add(c->pool, sizeof(ngx_tcp_limit_cleanup_t));
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_tcp_limit_lock(lock);
+
+    node = ngx_tcp_limit_lookup(ctx, bucket, hash, addr, len);
+
+    if (node == NULL) {
+        ngx_unlock(lock);
+
+        ngx_log_error(log_level, c->log, 0,
+                      "limiting connections, zone \"%V\" is full",
+                      &limit->shm_zone->shm.name);
+        return NGX_DECLINED;
+    }
+
+    if (ctx->rate) {
+
+        if (node->hash == 0) {
+            node->hash = hash;
+            node->len = (u_short) len;
+            ngx_memcpy(node->addr, addr, len);
+
+            tokens = ctx->burst;
+
+        } else {
+            elapsed = (ngx_msec_int_t) (ngx_current_msec - node->last);
+
+            if (elapsed < 0) {
+                elapsed = 0;
+            }
+
+            tokens = ngx_min(node->tokens, ctx->burst);
+
+            if ((uint64_t) elapsed * ctx->rate
+                >= (uint64_t) (ctx->burst - tokens) * 1000)
+            {
+                tokens = ctx->burst;
+
+            } else {
+                tokens += (ngx_uint_t)
+                              ((uint64_t) elapsed * ctx->rate / 1000);
+            }
+        }
+
+        node->last = ngx_current_msec;
+
+        if (tokens < 1000) {
+            node->tokens = tokens;
+            ngx_unlock(lock);
+
+            ngx_log_error(log_level, c->log, 0,
+                          "limiting connections from %V by zone \"%V\"",
+                          &c->addr_text, &limit->shm_zone->shm.name);
+            return NGX_DECLINED;
+        }
+
+        node->tokens = tokens - 1000;
+        ngx_unlock(lock);
+
+        return NGX_OK;
+    }
+
+    if (node->hash == 0) {
+        node->hash = hash;
+        node->len = (u_short) len;
+        node->conns = 0;
+        ngx_memcpy(node->addr, addr, len);
+
+        if (!ngx_tcp_limit_in_bucket(bucket, node)) {
+            bucket->spilled++;
+        }
+
+    } else if (node->conns >= limit->conn) {
+        ngx_unlock(lock);
+
+        ngx_log_error(log_level, c->log, 0,
+                      "limiting connections from %V by zone \"%V\"",
+                      &c->addr_text, &limit->shm_zone->shm.name);
+        return NGX_DECLINED;
+    }
+
+    node->conns++;
+
+    ngx_unlock(lock);
+
+    lc = cln->data;
+
+    lc->ctx = ctx;
+    lc->bucket = bucket;
+    lc->hash = hash;
+    lc->len = (u_short) len;
+    ngx_memcpy(lc->addr, addr, len);
+
+    cln->handler = ngx_tcp_limit_cleanup;
+
+    return NGX_OK;
+}
+
+
+/*
+ * returns the node of the address, or a free one with a zero hash; the
+ * free node of a connection zone is taken from the other bucket of the
+ * pair if the bucket is full; the pair is locked
+ */
+
+static ngx_tcp_limit_node_t *
+ngx_tcp_limit_lookup(ngx_tcp_limit_ctx_t *ctx, ngx_tcp_limit_bucket_t *bucket,
+    uint32_t hash, u_char *addr, size_t len)
+{
+    ngx_tcp_limit_node_t    *node, *spill;
+    ngx_tcp_limit_bucket_t  *other;
+
+    node = ngx_tcp_limit_lookup_bucket(ctx, bucket, hash, addr, len);
+
+    if (ctx->rate || (node && node->hash)) {
+        return node;
+    }
+
+    if (node && bucket->spilled == 0) {
+        return node;
+    }
+
+    other = &ctx->buckets[(bucket - ctx->buckets) ^ 1];
+
+    spill = ngx_tcp_limit_lookup_bucket(ctx, other, hash, addr, len);
+
+    if (spill && (spill->hash || node == NULL)) {
+        return spill;
+    }
+
+    return node;
+}
+
+
+/*
+ * returns the node of the address in the bucket, or a free one with
+ * a zero hash; in a rate zone the node refilled the longest ago is reused
+ * if the bucket is full, as it has the most tokens back
+ */
+
+static ngx_tcp_limit_node_t *
+ngx_tcp_limit_lookup_bucket(ngx_tcp_limit_ctx_t *ctx,
+    ngx_tcp_limit_bucket_t *bucket, uint32_t hash, u_char *addr, size_t len)
+{
+    ngx_uint_t             i;
+    ngx_tcp_limit_node_t  *node, *free;
+
+    free = NULL;
+
+    for (i = 0; i < NGX_TCP_LIMIT_BUCKET_NODES; i++) {
+        node = &bucket->nodes[i];
+
+        if (node->hash == hash
+            && node->len == len
+            && ngx_memcmp(node->addr, addr, len) == 0)
+        {
+            return node;
+        }
+
+        if (node->hash == 0) {
+            if (free == NULL || free->hash) {
+                free = node;
+            }
+
+            continue;
+        }
+
+        if (ctx->rate
+            && (free == NULL
+                || (free->hash
+                    && (ngx_msec_int_t) (node->last - free->last) < 0)))
+        {
+            free = node;
+        }
+    }
+
+    if (free) {
+        free->hash = 0;
+    }
+
+    return free;
+}
+
+
+/*
+ * ngx_spinlock() that checks the owner with kill() once it has spun: the
+ * counters of a pair taken over may be off by the connections the dead
+ * worker was updating
+ */
+
+static void
+ngx_tcp_limit_lock(ngx_atomic_t *lock)
+{
+    ngx_pid_t   pid;
+    ngx_uint_t  i, n;
+
+    for ( ;; ) {
+
+        if (*lock == 0 && ngx_atomic_cmp_set(lock, 0, ngx_pid)) {
+            return;
+        }
+
+        if (ngx_ncpu > 1) {
+
+            for (n = 1; n < 1024; n <<= 1) {
+
+                for (i = 0; i < n; i++) {
+                    ngx_cpu_pause();
+                }
+
+                if (*lock == 0 && ngx_atomic_cmp_set(lock, 0, ngx_pid)) {
+                    return;
+                }
+            }
+        }
+
+        pid = (ngx_pid_t) *lock;
+
+        /* a worker never waits for itself, so its pid is a reused one */
+
+        if (pid
+            && (pid == ngx_pid
+                || (kill(pid, 0) == -1 && ngx_errno == NGX_ESRCH))
+            && ngx_atomic_cmp_set(lock, pid, ngx_pid))
+        {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "tcp limit zone lock held by exited process %P "
+                          "is taken over", pid);
+            return;
+        }
+
+        ngx_sched_yield();
+    }
+}
+
+
+static void
+ngx_tcp_limit_cleanup(void *data)
+{
+    ngx_tcp_limit_cleanup_t  *lc = data;
+
+    ngx_atomic_t          *lock;
+    ngx_tcp_limit_node_t  *node;
+
+    lock = ngx_tcp_limit_pair_lock(lc->ctx, lc->bucket);
+
+    ngx_tcp_limit_lock(lock);
+
+    node = ngx_tcp_limit_lookup(lc->ctx, lc->bucket, lc->hash, lc->addr,
+                                lc->len);
+
+    if (node && node->hash && --node->conns == 0) {
+        node->hash = 0;
+
+        if (!ngx_tcp_limit_in_bucket(lc->bucket, node)) {
+            lc->bucket->spilled--;
+        }
+    }
+
+    ngx_unlock(lock);
+}
+
+
+static void *
+ngx_tcp_limit_create_conf(ngx_conf_t *cf)
+{
+    ngx_tcp_limit_conf_t  *lcf;
+
+    lcf = ngx_pcalloc(cf->pool, sizeof(ngx_tcp_limit_conf_t));
+    if (lcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     lcf->limits = NULL;
+     */
+
+    lcf->log_level = NGX_CONF_UNSET_UINT;
+
+    return lcf;
+}
+
+
+static char *
+ngx_tcp_limit_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_tcp_limit_conf_t *prev = parent;
+    ngx_tcp_limit_conf_t *conf = child;
+
+    ngx_uint_t            i;
+    ngx_tcp_limit_t      *limits;
+    ngx_tcp_limit_ctx_t  *ctx;
+
+    if (conf->limits == NULL) {
+        conf->limits = prev->limits;
+    }
+
+    ngx_conf_merge_uint_value(conf->log_level, prev->log_level,
+                              NGX_LOG_INFO);
+
+    if (conf->limits == NULL) {
+        return NGX_CONF_OK;
+    }
+
+    /* the zones may be defined after the servers that use them */
+
+    limits = conf->limits->elts;
+
+    for (i = 0; i < conf->limits->nelts; i++) {
+        ctx = limits[i].shm_zone->data;
+
+        if (ctx == NULL) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "unknown limit zone \"%V\"",
+                               &limits[i].shm_zone->shm.name);
+            return NGX_CONF_ERROR;
+        }
+
+        if ((ctx->rate == 0) != (limits[i].conn != 0)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "zone \"%V\" is not a \"%s\" zone",
+                               &limits[i].shm_zone->shm.name,
+                               limits[i].conn ? "limit_conn_zone"
+                                              : "limit_rate_zone");
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * "limit_conn_zone name:size" and
+ * "limit_rate_zone name:size rate=Nr/s|Nr/m [burst=N]", the burst is
+ * a second of the rate by default
+ */
+
+static char *
+ngx_tcp_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char               *p;
+    size_t                len;
+    ssize_t               n;
+    ngx_int_t             rate, scale, burst;
+    ngx_str_t            *value, name, size;
+    ngx_uint_t            i;
+    ngx_shm_zone_t       *shm_zone;
+    ngx_tcp_limit_ctx_t  *ctx;
+
+    value = cf->args->elts;
+
+    p = ngx_strlchr(value[1].data, value[1].data + value[1].len, ':');
+
+    if (p == NULL || p == value[1].data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    name.len = p - value[1].data;
+    name.data = value[1].data;
+
+    size.len = value[1].data + value[1].len - p - 1;
+    size.data = p + 1;
+
+    n = ngx_parse_size(&size);
+
+    if (n == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (n < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    rate = 0;
+    scale = 1;
+    burst = NGX_ERROR;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "rate=", 5) == 0) {
+
+            len = value[i].len;
+            p = value[i].data + len - 3;
+
+            if (len > 8 && ngx_strncmp(p, "r/s", 3) == 0) {
+                scale = 1;
+                len -= 3;
+
+            } else if (len > 8 && ngx_strncmp(p, "r/m", 3) == 0) {
+                scale = 60;
+                len -= 3;
+            }
+
+            rate = ngx_atoi(value[i].data + 5, len - 5);
+            if (rate <= 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "burst=", 6) == 0) {
+
+            burst = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (burst <= 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    /* "limit_conn_zone" takes no parameters, "limit_rate_zone" needs one */
+
+    if (cf->args->nelts > 2 && rate == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"rate\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_tcp_limit_ctx_t));
+    if (ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ctx->rate = rate * 1000 / scale;
+
+    if (rate) {
+        ctx->burst = (burst == NGX_ERROR) ? ngx_max(ctx->rate, 1000)
+                                          : (ngx_uint_t) burst * 1000;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, n, &ngx_tcp_limit_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_tcp_limit_init_zone;
+    shm_zone->data = ctx;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+/* "limit_conn zone number" and "limit_rate zone" */
+
+static char *
+ngx_tcp_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_tcp_limit_conf_t  *lcf = conf;
+
+    ngx_int_t         n;
+    ngx_str_t        *value;
+    ngx_uint_t        i;
+    ngx_shm_zone_t   *shm_zone;
+    ngx_tcp_limit_t  *limit, *limits;
+
+    value = cf->args->elts;
+
+    shm_zone = ngx_shared_memory_add(cf, &value[1], 0, &ngx_tcp_limit_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    n = 0;
+
+    if (cf->args->nelts == 3) {
+        n = ngx_atoi(value[2].data, value[2].len);
+        if (n <= 0 || n > 65535) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid number of connections \"%V\"",
+                               &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (lcf->limits == NULL) {
+        lcf->limits = ngx_array_create(cf->pool, 1, sizeof(ngx_tcp_limit_t));
+        if (lcf->limits == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    limits = lcf->limits->elts;
+
+    for (i = 0; i < lcf->limits->nelts; i++) {
+        if (shm_zone == limits[i].shm_zone) {
+            return "is duplicate";
+        }
+    }
+
+    limit = ngx_array_push(lcf->limits);
+    if (limit == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    limit->shm_zone = shm_zone;
+    limit->conn = n;
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * the whole zone is one table of buckets, so nothing is allocated from
+ * the slab pool after it is initialized
+ */
+
+static ngx_int_t
+ngx_tcp_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_tcp_limit_ctx_t  *octx = data;
+
+    ngx_slab_pool_t        *shpool;
+    ngx_tcp_limit_ctx_t    *ctx;
+    ngx_tcp_limit_shctx_t  *sh;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        if ((ctx->rate == 0) != (octx->rate == 0)) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "zone \"%V\" changed from \"limit_%s_zone\"",
+                          &shm_zone->shm.name,
+                          octx->rate ? "rate" : "conn");
+            return NGX_ERROR;
+        }
+
+        ctx->buckets = octx->buckets;
+        ctx->nbuckets = octx->nbuckets;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        sh = shpool->data;
+
+        ctx->buckets = sh->buckets;
+        ctx->nbuckets = sh->nbuckets;
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_alloc(shpool, sizeof(ngx_tcp_limit_shctx_t));
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * the table takes the pages left free, end - start would also count
+     * the page descriptors of the slab pool
+     */
+
+    ctx->nbuckets = (shpool->pfree * ngx_pagesize)
+                    / sizeof(ngx_tcp_limit_bucket_t);
+
+    /* the buckets are in pairs */
+
+    ctx->nbuckets &= ~(ngx_uint_t) 1;
+
+    ctx->buckets = ngx_slab_alloc(shpool,
+                           ctx->nbuckets * sizeof(ngx_tcp_limit_bucket_t));
+    if (ctx->buckets == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(ctx->buckets,
+                ctx->nbuckets * sizeof(ngx_tcp_limit_bucket_t));
+
+    sh->buckets = ctx->buckets;
+    sh->nbuckets = ctx->nbuckets;
+
+    shpool->data = sh;
+
+    return NGX_OK;
+}
@@ -0,0 +1,27 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#ifndef _NGX_TCP_LIMIT_MODULE_H_INCLUDED_
+#define _NGX_TCP_LIMIT_MODULE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/*
+ * checks the client address of a connection just accepted against
+ * the "limit_conn" and "limit_rate" zones of the server: NGX_OK if it is
+ * admitted, NGX_DECLINED if it is to be closed, NGX_ERROR on a failure
+ */
+
+ngx_int_t ngx_tcp_limit_connection(ngx_connection_t *c, void **srv_conf);
+
+
+extern ngx_module_t  ngx_tcp_limit_module;
+
+
+#endif /* _NGX_TCP_LIMIT_MODULE_H_INCLUDED_ */
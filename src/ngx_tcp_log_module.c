@@ -0,0 +1,1022 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_tcp.h>
+
+
+typedef struct ngx_tcp_log_op_s  ngx_tcp_log_op_t;
+
+typedef u_char *(*ngx_tcp_log_op_run_pt) (ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op);
+
+typedef size_t (*ngx_tcp_log_op_getlen_pt) (ngx_tcp_session_t *s);
+
+
+/* the length is 0 if it is known only by getlen() */
+
+struct ngx_tcp_log_op_s {
+    size_t                      len;
+    ngx_tcp_log_op_getlen_pt    getlen;
+    ngx_tcp_log_op_run_pt       run;
+    uintptr_t                   data;
+};
+
+
+typedef struct {
+    ngx_str_t                   name;
+    ngx_array_t                *ops;        /* array of ngx_tcp_log_op_t */
+} ngx_tcp_log_fmt_t;
+
+
+typedef struct {
+    ngx_array_t                 formats;    /* array of ngx_tcp_log_fmt_t */
+} ngx_tcp_log_main_conf_t;
+
+
+/*
+ * the buffer of a log file is shared by all access_log directives
+ * writing to the file, it is private to a worker after fork()
+ */
+
+typedef struct {
+    u_char                     *start;
+    u_char                     *pos;
+    u_char                     *last;
+
+    ngx_event_t                *event;
+    ngx_msec_t                  flush;
+} ngx_tcp_log_buf_t;
+
+
+typedef struct {
+    ngx_open_file_t            *file;
+    ngx_array_t                *ops;        /* array of ngx_tcp_log_op_t */
+} ngx_tcp_log_t;
+
+
+typedef struct {
+    ngx_array_t                *logs;       /* array of ngx_tcp_log_t */
+    ngx_uint_t                  off;        /* unsigned  off:1 */
+} ngx_tcp_log_srv_conf_t;
+
+
+typedef struct {
+    ngx_str_t                   name;
+    size_t                      len;
+    ngx_tcp_log_op_getlen_pt    getlen;
+    ngx_tcp_log_op_run_pt       run;
+} ngx_tcp_log_var_t;
+
+
+static void ngx_tcp_log_write(ngx_open_file_t *file, ngx_log_t *log,
+    u_char *buf, size_t len);
+static void ngx_tcp_log_flush(ngx_open_file_t *file, ngx_log_t *log);
+static void ngx_tcp_log_flush_handler(ngx_event_t *ev);
+
+static u_char *ngx_tcp_log_copy(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op);
+static size_t ngx_tcp_log_remote_addr_len(ngx_tcp_session_t *s);
+static u_char *ngx_tcp_log_remote_addr(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op);
+static size_t ngx_tcp_log_server_addr_len(ngx_tcp_session_t *s);
+static u_char *ngx_tcp_log_server_addr(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op);
+static size_t ngx_tcp_log_server_name_len(ngx_tcp_session_t *s);
+static u_char *ngx_tcp_log_server_name(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op);
+static size_t ngx_tcp_log_ssl_preread_server_name_len(ngx_tcp_session_t *s);
+static u_char *ngx_tcp_log_ssl_preread_server_name(ngx_tcp_session_t *s,
+    u_char *buf, ngx_tcp_log_op_t *op);
+static size_t ngx_tcp_log_ssl_preread_alpn_protocols_len(
+    ngx_tcp_session_t *s);
+static u_char *ngx_tcp_log_ssl_preread_alpn_protocols(ngx_tcp_session_t *s,
+    u_char *buf, ngx_tcp_log_op_t *op);
+static size_t ngx_tcp_log_upstream_addr_len(ngx_tcp_session_t *s);
+static u_char *ngx_tcp_log_upstream_addr(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op);
+static u_char *ngx_tcp_log_status(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op);
+static u_char *ngx_tcp_log_ssl_early_data(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op);
+static u_char *ngx_tcp_log_bytes_sent(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op);
+static u_char *ngx_tcp_log_bytes_received(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op);
+static u_char *ngx_tcp_log_session_time(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op);
+static u_char *ngx_tcp_log_connection(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op);
+static u_char *ngx_tcp_log_pid(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op);
+static u_char *ngx_tcp_log_msec(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op);
+static u_char *ngx_tcp_log_time_local(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op);
+static u_char *ngx_tcp_log_time_iso8601(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op);
+
+static void ngx_tcp_log_exit_process(ngx_cycle_t *cycle);
+static void *ngx_tcp_log_create_main_conf(ngx_conf_t *cf);
+static void *ngx_tcp_log_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_tcp_log_merge_srv_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static char *ngx_tcp_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_tcp_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_tcp_log_compile_format(ngx_conf_t *cf, ngx_array_t *ops,
+    ngx_array_t *args, ngx_uint_t s);
+
+
+static ngx_command_t  ngx_tcp_log_commands[] = {
+
+    { ngx_string("log_format"),
+      NGX_TCP_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_tcp_log_set_format,
+      NGX_TCP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("access_log"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_1MORE,
+      ngx_tcp_log_set_log,
+      NGX_TCP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_tcp_module_t  ngx_tcp_log_module_ctx = {
+    NULL,                                  /* protocol */
+
+    ngx_tcp_log_create_main_conf,          /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_tcp_log_create_srv_conf,           /* create server configuration */
+    ngx_tcp_log_merge_srv_conf             /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_tcp_log_module = {
+    NGX_MODULE_V1,
+    &ngx_tcp_log_module_ctx,               /* module context */
+    ngx_tcp_log_commands,                  /* module directives */
+    NGX_TCP_MODULE,                        /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    ngx_tcp_log_exit_process,              /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_str_t  ngx_tcp_log_combined_fmt =
+    ngx_string("$remote_addr [$time_local] $server_addr \"$upstream_addr\" "
+               "$status $bytes_sent $bytes_received $session_time");
+
+
+static ngx_tcp_log_var_t  ngx_tcp_log_vars[] = {
+    { ngx_string("remote_addr"), 0, ngx_tcp_log_remote_addr_len,
+                          ngx_tcp_log_remote_addr },
+    { ngx_string("server_addr"), 0, ngx_tcp_log_server_addr_len,
+                          ngx_tcp_log_server_addr },
+    { ngx_string("server_name"), 0, ngx_tcp_log_server_name_len,
+                          ngx_tcp_log_server_name },
+    { ngx_string("ssl_preread_server_name"), 0,
+                          ngx_tcp_log_ssl_preread_server_name_len,
+                          ngx_tcp_log_ssl_preread_server_name },
+    { ngx_string("ssl_preread_alpn_protocols"), 0,
+                          ngx_tcp_log_ssl_preread_alpn_protocols_len,
+                          ngx_tcp_log_ssl_preread_alpn_protocols },
+    { ngx_string("upstream_addr"), 0, ngx_tcp_log_upstream_addr_len,
+                          ngx_tcp_log_upstream_addr },
+    { ngx_string("status"), 3, NULL, ngx_tcp_log_status },
+    { ngx_string("ssl_early_data"), 1, NULL, ngx_tcp_log_ssl_early_data },
+    { ngx_string("bytes_sent"), NGX_OFF_T_LEN, NULL, ngx_tcp_log_bytes_sent },
+    { ngx_string("bytes_received"), NGX_OFF_T_LEN, NULL,
+                          ngx_tcp_log_bytes_received },
+    { ngx_string("session_time"), NGX_TIME_T_LEN + 4, NULL,
+                          ngx_tcp_log_session_time },
+    { ngx_string("connection"), NGX_ATOMIC_T_LEN, NULL,
+                          ngx_tcp_log_connection },
+    { ngx_string("pid"), NGX_INT64_LEN, NULL, ngx_tcp_log_pid },
+    { ngx_string("msec"), NGX_TIME_T_LEN + 4, NULL, ngx_tcp_log_msec },
+    { ngx_string("time_local"), sizeof("28/Sep/1970:12:00:00 +0600") - 1,
+                          NULL, ngx_tcp_log_time_local },
+    { ngx_string("time_iso8601"), sizeof("1970-09-28T12:00:00+06:00") - 1,
+                          NULL, ngx_tcp_log_time_iso8601 },
+
+    { ngx_null_string, 0, NULL, NULL }
+};
+
+
+void
+ngx_tcp_log_session(ngx_tcp_session_t *s)
+{
+    u_char                  *line, *p;
+    size_t                   len;
+    ngx_uint_t               i, l;
+    ngx_tcp_log_t           *log;
+    ngx_tcp_log_op_t        *op;
+    ngx_tcp_log_buf_t       *buffer;
+    ngx_tcp_log_srv_conf_t  *lscf;
+
+    lscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_log_module);
+
+    if (lscf->off) {
+        return;
+    }
+
+    log = lscf->logs->elts;
+
+    for (l = 0; l < lscf->logs->nelts; l++) {
+
+        len = 0;
+        op = log[l].ops->elts;
+
+        for (i = 0; i < log[l].ops->nelts; i++) {
+            if (op[i].len == 0) {
+                len += op[i].getlen(s);
+
+            } else {
+                len += op[i].len;
+            }
+        }
+
+        len += NGX_LINEFEED_SIZE;
+
+        buffer = log[l].file->data;
+
+        if (len > (size_t) (buffer->last - buffer->pos)) {
+            ngx_tcp_log_flush(log[l].file, ngx_cycle->log);
+        }
+
+        if (len <= (size_t) (buffer->last - buffer->pos)) {
+
+            p = buffer->pos;
+
+            if (p == buffer->start && !buffer->event->timer_set) {
+                ngx_add_timer(buffer->event, buffer->flush);
+            }
+
+            for (i = 0; i < log[l].ops->nelts; i++) {
+                p = op[i].run(s, p, &op[i]);
+            }
+
+            ngx_linefeed(p);
+
+            buffer->pos = p;
+
+            continue;
+        }
+
+        /* the line does not fit in the buffer, it is written as is */
+
+        line = ngx_pnalloc(s->connection->pool, len);
+        if (line == NULL) {
+            return;
+        }
+
+        p = line;
+
+        for (i = 0; i < log[l].ops->nelts; i++) {
+            p = op[i].run(s, p, &op[i]);
+        }
+
+        ngx_linefeed(p);
+
+        ngx_tcp_log_write(log[l].file, ngx_cycle->log, line, p - line);
+    }
+}
+
+
+static void
+ngx_tcp_log_write(ngx_open_file_t *file, ngx_log_t *log, u_char *buf,
+    size_t len)
+{
+    ssize_t  n;
+
+    n = ngx_write_fd(file->fd, buf, len);
+
+    if (n == (ssize_t) len) {
+        return;
+    }
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_write_fd_n " to \"%s\" failed", file->name.data);
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_ALERT, log, 0,
+                  ngx_write_fd_n " to \"%s\" was incomplete: %z of %uz",
+                  file->name.data, n, len);
+}
+
+
+static void
+ngx_tcp_log_flush(ngx_open_file_t *file, ngx_log_t *log)
+{
+    ngx_tcp_log_buf_t  *buffer;
+
+    buffer = file->data;
+
+    if (buffer->pos != buffer->start) {
+        ngx_tcp_log_write(file, log, buffer->start,
+                          buffer->pos - buffer->start);
+        buffer->pos = buffer->start;
+    }
+
+    if (buffer->event->timer_set) {
+        ngx_del_timer(buffer->event);
+    }
+}
+
+
+static void
+ngx_tcp_log_flush_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, ev->log, 0, "tcp log buffer flush");
+
+    ngx_tcp_log_flush(ev->data, ev->log);
+}
+
+
+static u_char *
+ngx_tcp_log_copy(ngx_tcp_session_t *s, u_char *buf, ngx_tcp_log_op_t *op)
+{
+    return ngx_cpymem(buf, (u_char *) op->data, op->len);
+}
+
+
+static size_t
+ngx_tcp_log_remote_addr_len(ngx_tcp_session_t *s)
+{
+    return s->connection->addr_text.len;
+}
+
+
+static u_char *
+ngx_tcp_log_remote_addr(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op)
+{
+    return ngx_cpymem(buf, s->connection->addr_text.data,
+                      s->connection->addr_text.len);
+}
+
+
+static size_t
+ngx_tcp_log_server_addr_len(ngx_tcp_session_t *s)
+{
+    return s->addr_text->len;
+}
+
+
+static u_char *
+ngx_tcp_log_server_addr(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op)
+{
+    return ngx_cpymem(buf, s->addr_text->data, s->addr_text->len);
+}
+
+
+static size_t
+ngx_tcp_log_server_name_len(ngx_tcp_session_t *s)
+{
+    ngx_tcp_core_srv_conf_t  *cscf;
+
+    cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+
+    return cscf->server_name.len;
+}
+
+
+static u_char *
+ngx_tcp_log_server_name(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op)
+{
+    ngx_tcp_core_srv_conf_t  *cscf;
+
+    cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+
+    return ngx_cpymem(buf, cscf->server_name.data, cscf->server_name.len);
+}
+
+
+static size_t
+ngx_tcp_log_ssl_preread_server_name_len(ngx_tcp_session_t *s)
+{
+    return s->host.len;
+}
+
+
+static u_char *
+ngx_tcp_log_ssl_preread_server_name(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op)
+{
+    return ngx_cpymem(buf, s->host.data, s->host.len);
+}
+
+
+static size_t
+ngx_tcp_log_ssl_preread_alpn_protocols_len(ngx_tcp_session_t *s)
+{
+    return s->alpn.len;
+}
+
+
+static u_char *
+ngx_tcp_log_ssl_preread_alpn_protocols(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op)
+{
+    return ngx_cpymem(buf, s->alpn.data, s->alpn.len);
+}
+
+
+static size_t
+ngx_tcp_log_upstream_addr_len(ngx_tcp_session_t *s)
+{
+    if (s->proxy == NULL || s->proxy->upstream.name == NULL) {
+        return 1;
+    }
+
+    return s->proxy->upstream.name->len;
+}
+
+
+static u_char *
+ngx_tcp_log_upstream_addr(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op)
+{
+    if (s->proxy == NULL || s->proxy->upstream.name == NULL) {
+        *buf = '-';
+        return buf + 1;
+    }
+
+    return ngx_cpymem(buf, s->proxy->upstream.name->data,
+                      s->proxy->upstream.name->len);
+}
+
+
+static u_char *
+ngx_tcp_log_status(ngx_tcp_session_t *s, u_char *buf, ngx_tcp_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%03ui", s->status ? s->status : NGX_TCP_OK);
+}
+
+
+static u_char *
+ngx_tcp_log_ssl_early_data(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op)
+{
+    *buf = s->early_data_accepted ? '1' : '-';
+    return buf + 1;
+}
+
+
+static u_char *
+ngx_tcp_log_bytes_sent(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%O", s->connection->sent);
+}
+
+
+static u_char *
+ngx_tcp_log_bytes_received(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%O", s->received);
+}
+
+
+static u_char *
+ngx_tcp_log_session_time(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op)
+{
+    ngx_msec_int_t  ms;
+
+    ms = (ngx_msec_int_t) (ngx_current_msec - s->start_msec);
+    ms = ngx_max(ms, 0);
+
+    return ngx_sprintf(buf, "%T.%03M", (time_t) ms / 1000,
+                       (ngx_msec_t) (ms % 1000));
+}
+
+
+static u_char *
+ngx_tcp_log_connection(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%uA", s->connection->number);
+}
+
+
+static u_char *
+ngx_tcp_log_pid(ngx_tcp_session_t *s, u_char *buf, ngx_tcp_log_op_t *op)
+{
+    return ngx_sprintf(buf, "%P", ngx_pid);
+}
+
+
+static u_char *
+ngx_tcp_log_msec(ngx_tcp_session_t *s, u_char *buf, ngx_tcp_log_op_t *op)
+{
+    ngx_time_t  *tp;
+
+    tp = ngx_timeofday();
+
+    return ngx_sprintf(buf, "%T.%03M", tp->sec, tp->msec);
+}
+
+
+static u_char *
+ngx_tcp_log_time_local(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op)
+{
+    return ngx_cpymem(buf, ngx_cached_http_log_time.data,
+                      ngx_cached_http_log_time.len);
+}
+
+
+static u_char *
+ngx_tcp_log_time_iso8601(ngx_tcp_session_t *s, u_char *buf,
+    ngx_tcp_log_op_t *op)
+{
+    return ngx_cpymem(buf, ngx_cached_http_log_iso8601.data,
+                      ngx_cached_http_log_iso8601.len);
+}
+
+
+static void
+ngx_tcp_log_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_open_file_t  *file;
+
+    part = &cycle->open_files.part;
+    file = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            file = part->elts;
+            i = 0;
+        }
+
+        if (file[i].flush == ngx_tcp_log_flush) {
+            ngx_tcp_log_flush(&file[i], cycle->log);
+        }
+    }
+}
+
+
+static void *
+ngx_tcp_log_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_str_t                *value;
+    ngx_array_t               a;
+    ngx_tcp_log_fmt_t        *fmt;
+    ngx_tcp_log_main_conf_t  *lmcf;
+
+    lmcf = ngx_pcalloc(cf->pool, sizeof(ngx_tcp_log_main_conf_t));
+    if (lmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&lmcf->formats, cf->pool, 4, sizeof(ngx_tcp_log_fmt_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    fmt = ngx_array_push(&lmcf->formats);
+    if (fmt == NULL) {
+        return NULL;
+    }
+
+    ngx_str_set(&fmt->name, "combined");
+
+    fmt->ops = ngx_array_create(cf->pool, 16, sizeof(ngx_tcp_log_op_t));
+    if (fmt->ops == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&a, cf->pool, 1, sizeof(ngx_str_t)) != NGX_OK) {
+        return NULL;
+    }
+
+    value = ngx_array_push(&a);
+    if (value == NULL) {
+        return NULL;
+    }
+
+    *value = ngx_tcp_log_combined_fmt;
+
+    if (ngx_tcp_log_compile_format(cf, fmt->ops, &a, 0) != NGX_CONF_OK) {
+        return NULL;
+    }
+
+    return lmcf;
+}
+
+
+static void *
+ngx_tcp_log_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_tcp_log_srv_conf_t  *lscf;
+
+    lscf = ngx_pcalloc(cf->pool, sizeof(ngx_tcp_log_srv_conf_t));
+    if (lscf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     lscf->logs = NULL;
+     *     lscf->off = 0;
+     */
+
+    return lscf;
+}
+
+
+static char *
+ngx_tcp_log_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_tcp_log_srv_conf_t *prev = parent;
+    ngx_tcp_log_srv_conf_t *conf = child;
+
+    if (conf->logs || conf->off) {
+        return NGX_CONF_OK;
+    }
+
+    conf->logs = prev->logs;
+    conf->off = prev->off;
+
+    /* there is no access log by default */
+
+    if (conf->logs == NULL) {
+        conf->off = 1;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_tcp_log_set_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_tcp_log_srv_conf_t *lscf = conf;
+
+    ssize_t                   size;
+    ngx_msec_t                flush;
+    ngx_str_t                *value, name, s;
+    ngx_uint_t                i, n;
+    ngx_tcp_log_t            *log;
+    ngx_tcp_log_fmt_t        *fmt;
+    ngx_tcp_log_buf_t        *buffer;
+    ngx_tcp_log_main_conf_t  *lmcf;
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        lscf->off = 1;
+        if (cf->args->nelts == 2) {
+            return NGX_CONF_OK;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lscf->logs == NULL) {
+        lscf->logs = ngx_array_create(cf->pool, 2, sizeof(ngx_tcp_log_t));
+        if (lscf->logs == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    log = ngx_array_push(lscf->logs);
+    if (log == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    log->file = ngx_conf_open_file(cf->cycle, &value[1]);
+    if (log->file == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts >= 3 && ngx_strchr(value[2].data, '=') == NULL) {
+        name = value[2];
+        i = 3;
+
+    } else {
+        ngx_str_set(&name, "combined");
+        i = 2;
+    }
+
+    lmcf = ngx_tcp_conf_get_module_main_conf(cf, ngx_tcp_log_module);
+
+    fmt = lmcf->formats.elts;
+    log->ops = NULL;
+
+    for (n = 0; n < lmcf->formats.nelts; n++) {
+        if (fmt[n].name.len == name.len
+            && ngx_strcasecmp(fmt[n].name.data, name.data) == 0)
+        {
+            log->ops = fmt[n].ops;
+            break;
+        }
+    }
+
+    if (log->ops == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown log format \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    /* the lines are always buffered, one write(2) per chunk */
+
+    size = 64 * 1024;
+    flush = 1000;
+
+    for (/* void */; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "buffer=", 7) == 0) {
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR || size == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid buffer size \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "flush=", 6) == 0) {
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            flush = ngx_parse_time(&s, 0);
+
+            if (flush == (ngx_msec_t) NGX_ERROR || flush == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid flush time \"%V\"", &s);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (log->file->data) {
+        buffer = log->file->data;
+
+        if (log->file->flush != ngx_tcp_log_flush
+            || buffer->last - buffer->start != size
+            || buffer->flush != flush)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "access_log \"%V\" already defined "
+                               "with conflicting parameters",
+                               &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    buffer = ngx_pcalloc(cf->pool, sizeof(ngx_tcp_log_buf_t));
+    if (buffer == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    buffer->start = ngx_pnalloc(cf->pool, size);
+    if (buffer->start == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    buffer->pos = buffer->start;
+    buffer->last = buffer->start + size;
+
+    buffer->event = ngx_pcalloc(cf->pool, sizeof(ngx_event_t));
+    if (buffer->event == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    buffer->event->data = log->file;
+    buffer->event->handler = ngx_tcp_log_flush_handler;
+    buffer->event->log = &cf->cycle->new_log;
+    buffer->event->cancelable = 1;
+
+    buffer->flush = flush;
+
+    log->file->flush = ngx_tcp_log_flush;
+    log->file->data = buffer;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_tcp_log_set_format(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_tcp_log_main_conf_t *lmcf = conf;
+
+    ngx_str_t          *value;
+    ngx_uint_t          i;
+    ngx_tcp_log_fmt_t  *fmt;
+
+    value = cf->args->elts;
+
+    fmt = lmcf->formats.elts;
+    for (i = 0; i < lmcf->formats.nelts; i++) {
+        if (fmt[i].name.len == value[1].len
+            && ngx_strcmp(fmt[i].name.data, value[1].data) == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate \"log_format\" name \"%V\"",
+                               &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    fmt = ngx_array_push(&lmcf->formats);
+    if (fmt == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    fmt->name = value[1];
+
+    fmt->ops = ngx_array_create(cf->pool, 16, sizeof(ngx_tcp_log_op_t));
+    if (fmt->ops == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return ngx_tcp_log_compile_format(cf, fmt->ops, cf->args, 2);
+}
+
+
+/* the format is compiled once into the ops run for every session */
+
+static char *
+ngx_tcp_log_compile_format(ngx_conf_t *cf, ngx_array_t *ops,
+    ngx_array_t *args, ngx_uint_t s)
+{
+    u_char              *data, *p, ch;
+    size_t               i, len;
+    ngx_str_t           *value, var;
+    ngx_uint_t           bracket;
+    ngx_tcp_log_op_t    *op;
+    ngx_tcp_log_var_t   *v;
+
+    value = args->elts;
+
+    for ( /* void */ ; s < args->nelts; s++) {
+
+        i = 0;
+
+        while (i < value[s].len) {
+
+            op = ngx_array_push(ops);
+            if (op == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            data = &value[s].data[i];
+
+            if (value[s].data[i] == '$') {
+
+                if (++i == value[s].len) {
+                    goto invalid;
+                }
+
+                if (value[s].data[i] == '{') {
+                    bracket = 1;
+
+                    if (++i == value[s].len) {
+                        goto invalid;
+                    }
+
+                    var.data = &value[s].data[i];
+
+                } else {
+                    bracket = 0;
+                    var.data = &value[s].data[i];
+                }
+
+                for (var.len = 0; i < value[s].len; i++, var.len++) {
+                    ch = value[s].data[i];
+
+                    if (ch == '}' && bracket) {
+                        i++;
+                        bracket = 0;
+                        break;
+                    }
+
+                    if ((ch >= 'A' && ch <= 'Z')
+                        || (ch >= 'a' && ch <= 'z')
+                        || (ch >= '0' && ch <= '9')
+                        || ch == '_')
+                    {
+                        continue;
+                    }
+
+                    break;
+                }
+
+                if (bracket) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "the closing bracket in \"%V\" "
+                                       "variable is missing", &var);
+                    return NGX_CONF_ERROR;
+                }
+
+                if (var.len == 0) {
+                    goto invalid;
+                }
+
+                for (v = ngx_tcp_log_vars; v->name.len; v++) {
+
+                    if (v->name.len == var.len
+                        && ngx_strncmp(v->name.data, var.data, var.len) == 0)
+                    {
+                        op->len = v->len;
+                        op->getlen = v->getlen;
+                        op->run = v->run;
+                        op->data = 0;
+
+                        goto found;
+                    }
+                }
+
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "unknown variable \"%V\"", &var);
+                return NGX_CONF_ERROR;
+
+            found:
+
+                continue;
+            }
+
+            i++;
+
+            while (i < value[s].len && value[s].data[i] != '$') {
+                i++;
+            }
+
+            len = &value[s].data[i] - data;
+
+            if (len) {
+
+                op->len = len;
+                op->getlen = NULL;
+                op->run = ngx_tcp_log_copy;
+
+                p = ngx_pnalloc(cf->pool, len);
+                if (p == NULL) {
+                    return NGX_CONF_ERROR;
+                }
+
+                ngx_memcpy(p, data, len);
+                op->data = (uintptr_t) p;
+            }
+        }
+
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%s\"", data);
+
+    return NGX_CONF_ERROR;
+}
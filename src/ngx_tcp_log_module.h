@@ -0,0 +1,21 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#ifndef _NGX_TCP_LOG_MODULE_H_INCLUDED_
+#define _NGX_TCP_LOG_MODULE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+void ngx_tcp_log_session(ngx_tcp_session_t *s);
+
+
+extern ngx_module_t  ngx_tcp_log_module;
+
+
+#endif /* _NGX_TCP_LOG_MODULE_H_INCLUDED_ */
@@ -0,0 +1,1388 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_connect.h>
+#include <ngx_tcp.h>
+
+
+typedef struct {
+    ngx_tcp_upstream_srv_conf_t  *upstream;
+
+    size_t                        buffer_size;
+    ngx_flag_t                    splice;
+    ngx_flag_t                    proxy_protocol;
+
+    ngx_uint_t                    keepalive;
+    ngx_msec_t                    keepalive_timeout;
+    ngx_uint_t                    keepalive_requests;
+
+    /* per worker queues of ngx_tcp_proxy_cache_t */
+    ngx_queue_t                   cache;
+    ngx_queue_t                   free;
+} ngx_tcp_proxy_conf_t;
+
+
+typedef struct {
+    ngx_tcp_proxy_conf_t   *conf;
+
+    ngx_queue_t             queue;
+    ngx_connection_t       *connection;
+
+    socklen_t               socklen;
+    u_char                  sockaddr[NGX_SOCKADDRLEN];
+} ngx_tcp_proxy_cache_t;
+
+
+static void ngx_tcp_proxy_connect(ngx_tcp_session_t *s);
+static void ngx_tcp_proxy_next_upstream(ngx_tcp_session_t *s);
+static ngx_int_t ngx_tcp_proxy_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_tcp_proxy_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state);
+static void ngx_tcp_proxy_connect_handler(ngx_event_t *ev);
+static ngx_int_t ngx_tcp_proxy_test_connect(ngx_connection_t *c);
+static void ngx_tcp_proxy_start(ngx_tcp_session_t *s);
+static ngx_int_t ngx_tcp_proxy_queue_proxy_protocol(ngx_tcp_session_t *s);
+static void ngx_tcp_proxy_handler(ngx_event_t *ev);
+#if (NGX_HAVE_SPLICE)
+static ngx_tcp_proxy_pipe_t *ngx_tcp_proxy_create_pipe(ngx_tcp_session_t *s);
+static ngx_int_t ngx_tcp_proxy_splice(ngx_tcp_session_t *s,
+    ngx_connection_t *src, ngx_connection_t *dst, ngx_tcp_proxy_pipe_t *p,
+    ngx_uint_t do_write);
+#endif
+static ngx_int_t ngx_tcp_proxy_get_cached_peer(ngx_tcp_session_t *s);
+static ngx_int_t ngx_tcp_proxy_cache_peer(ngx_tcp_session_t *s);
+static void ngx_tcp_proxy_keepalive_close_handler(ngx_event_t *ev);
+static void ngx_tcp_proxy_dummy_handler(ngx_event_t *ev);
+static void ngx_tcp_proxy_cleanup(void *data);
+static void ngx_tcp_proxy_internal_server_error(ngx_tcp_session_t *s);
+static void ngx_tcp_proxy_close_session(ngx_tcp_session_t *s);
+static ngx_int_t ngx_tcp_proxy_protocol_init_session(ngx_tcp_session_t *s);
+static void ngx_tcp_proxy_protocol_process_session(ngx_tcp_session_t *s);
+static void *ngx_tcp_proxy_create_conf(ngx_conf_t *cf);
+static char *ngx_tcp_proxy_merge_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static char *ngx_tcp_proxy_pass(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_tcp_proxy_commands[] = {
+
+    { ngx_string("proxy_pass"),
+      NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_tcp_proxy_pass,
+      NGX_TCP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("proxy_buffer"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_proxy_conf_t, buffer_size),
+      NULL },
+
+    { ngx_string("proxy_splice"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_proxy_conf_t, splice),
+      NULL },
+
+    { ngx_string("proxy_protocol"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_proxy_conf_t, proxy_protocol),
+      NULL },
+
+    { ngx_string("proxy_keepalive"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_proxy_conf_t, keepalive),
+      NULL },
+
+    { ngx_string("proxy_keepalive_timeout"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_proxy_conf_t, keepalive_timeout),
+      NULL },
+
+    { ngx_string("proxy_keepalive_requests"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_proxy_conf_t, keepalive_requests),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_tcp_protocol_t  ngx_tcp_proxy_protocol = {
+    ngx_string("proxy"),
+    ngx_tcp_proxy_protocol_init_session,
+    NULL,
+    ngx_tcp_proxy_protocol_process_session,
+    NULL,
+    NULL,
+    0
+};
+
+
+static ngx_tcp_module_t  ngx_tcp_proxy_module_ctx = {
+    &ngx_tcp_proxy_protocol,               /* protocol */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_tcp_proxy_create_conf,             /* create server configuration */
+    ngx_tcp_proxy_merge_conf               /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_tcp_proxy_module = {
+    NGX_MODULE_V1,
+    &ngx_tcp_proxy_module_ctx,             /* module context */
+    ngx_tcp_proxy_commands,                /* module directives */
+    NGX_TCP_MODULE,                        /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+void
+ngx_tcp_proxy_init(ngx_tcp_session_t *s, ngx_addr_t *peer)
+{
+    ngx_connection_t             *c;
+    ngx_pool_cleanup_t           *cln;
+    ngx_tcp_proxy_ctx_t          *p;
+    ngx_tcp_proxy_conf_t         *pcf;
+    ngx_tcp_upstream_srv_conf_t  *uscf;
+
+    c = s->connection;
+
+    c->log->action = "connecting to upstream";
+
+    p = ngx_pcalloc(c->pool, sizeof(ngx_tcp_proxy_ctx_t));
+    if (p == NULL) {
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+    if (cln == NULL) {
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    cln->handler = ngx_tcp_proxy_cleanup;
+    cln->data = s;
+
+    s->proxy = p;
+
+    pcf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_proxy_module);
+
+    /* an empty buffer of the PROXY protocol header is replaced if small */
+
+    if (s->buffer == NULL
+        || (s->buffer->pos == s->buffer->last
+            && (size_t) (s->buffer->end - s->buffer->start)
+               < pcf->buffer_size))
+    {
+        s->buffer = ngx_create_temp_buf(c->pool, pcf->buffer_size);
+        if (s->buffer == NULL) {
+            ngx_tcp_close_connection(c);
+            return;
+        }
+    }
+
+    p->buffer = ngx_create_temp_buf(c->pool, pcf->buffer_size);
+    if (p->buffer == NULL) {
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    p->upstream.log = c->log;
+    p->upstream.log_error = NGX_ERROR_ERR;
+
+    if (peer) {
+
+        /* the protocol has chosen the peer itself */
+
+        p->upstream.sockaddr = peer->sockaddr;
+        p->upstream.socklen = peer->socklen;
+        p->upstream.name = &peer->name;
+        p->upstream.get = ngx_event_get_peer;
+        p->upstream.tries = 1;
+
+    } else {
+        uscf = s->upstream ? s->upstream : pcf->upstream;
+
+        if (uscf == NULL) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "no \"proxy_pass\" is defined for the server");
+            ngx_tcp_proxy_internal_server_error(s);
+            return;
+        }
+
+        if (uscf->peer.init(s, uscf) != NGX_OK) {
+            ngx_tcp_proxy_internal_server_error(s);
+            return;
+        }
+    }
+
+    /* the balancer is wrapped to look up the keepalive cache */
+
+    p->get_peer = p->upstream.get;
+    p->free_peer = p->upstream.free;
+    p->peer_data = p->upstream.data;
+
+    p->upstream.get = ngx_tcp_proxy_get_peer;
+    p->upstream.free = ngx_tcp_proxy_free_peer;
+    p->upstream.data = s;
+
+    ngx_tcp_proxy_connect(s);
+}
+
+
+static void
+ngx_tcp_proxy_connect(ngx_tcp_session_t *s)
+{
+    ngx_int_t                 rc;
+    ngx_connection_t         *c;
+    ngx_tcp_proxy_ctx_t      *p;
+    ngx_tcp_core_srv_conf_t  *cscf;
+
+    c = s->connection;
+    p = s->proxy;
+
+    c->log->action = "connecting to upstream";
+
+    ngx_tcp_stats_start(s, phase_time);
+
+    rc = ngx_event_connect_peer(&p->upstream);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, c->log, 0,
+                   "tcp proxy connect: %i", rc);
+
+    if (rc == NGX_ERROR) {
+        ngx_tcp_proxy_internal_server_error(s);
+        return;
+    }
+
+    if (rc == NGX_BUSY) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0, "no live upstreams");
+        s->status = NGX_TCP_BAD_GATEWAY;
+        ngx_tcp_proxy_internal_server_error(s);
+        return;
+    }
+
+    if (rc == NGX_DECLINED) {
+        ngx_tcp_proxy_next_upstream(s);
+        return;
+    }
+
+    if (rc == NGX_DONE) {
+
+        /* a cached keepalive connection */
+
+        ngx_tcp_proxy_start(s);
+        return;
+    }
+
+    p->upstream.connection->data = s;
+    p->upstream.connection->pool = c->pool;
+
+    c->read->handler = ngx_tcp_proxy_dummy_handler;
+    c->write->handler = ngx_tcp_proxy_dummy_handler;
+
+    p->upstream.connection->read->handler = ngx_tcp_proxy_connect_handler;
+    p->upstream.connection->write->handler = ngx_tcp_proxy_connect_handler;
+
+    if (rc == NGX_AGAIN) {
+        cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+        ngx_add_timer(p->upstream.connection->write, cscf->connect_timeout);
+        return;
+    }
+
+    /* rc == NGX_OK */
+
+    ngx_tcp_proxy_start(s);
+}
+
+
+static void
+ngx_tcp_proxy_next_upstream(ngx_tcp_session_t *s)
+{
+    ngx_tcp_proxy_ctx_t  *p;
+
+    p = s->proxy;
+
+    if (p->upstream.connection) {
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, s->connection->log, 0,
+                       "close tcp proxy connection: %d",
+                       p->upstream.connection->fd);
+
+        ngx_close_connection(p->upstream.connection);
+        p->upstream.connection = NULL;
+    }
+
+    p->upstream.free(&p->upstream, p->upstream.data, NGX_PEER_FAILED);
+
+    ngx_tcp_stats_inc(s, upstream_failures);
+
+    if (p->upstream.tries == 0) {
+        s->status = NGX_TCP_BAD_GATEWAY;
+        ngx_tcp_proxy_internal_server_error(s);
+        return;
+    }
+
+    ngx_tcp_proxy_connect(s);
+}
+
+
+static ngx_int_t
+ngx_tcp_proxy_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_tcp_session_t  *s = data;
+
+    ngx_int_t             rc;
+    ngx_tcp_proxy_ctx_t  *p;
+
+    p = s->proxy;
+
+    rc = p->get_peer(pc, p->peer_data);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    p->peer = 1;
+
+    if (ngx_tcp_proxy_get_cached_peer(s) == NGX_OK) {
+        return NGX_DONE;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_tcp_proxy_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_tcp_session_t  *s = data;
+
+    ngx_tcp_proxy_ctx_t  *p;
+
+    p = s->proxy;
+
+    if (!p->peer) {
+        return;
+    }
+
+    p->peer = 0;
+
+    if (p->free_peer) {
+        p->free_peer(pc, p->peer_data, state);
+        return;
+    }
+
+    if (pc->tries) {
+        pc->tries--;
+    }
+}
+
+
+static void
+ngx_tcp_proxy_connect_handler(ngx_event_t *ev)
+{
+    ngx_connection_t   *c;
+    ngx_tcp_session_t  *s;
+
+    c = ev->data;
+    s = c->data;
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream timed out");
+        ngx_tcp_stats_inc(s, connect_timeouts);
+        ngx_tcp_proxy_next_upstream(s);
+        return;
+    }
+
+    if (ngx_tcp_proxy_test_connect(c) != NGX_OK) {
+        ngx_tcp_proxy_next_upstream(s);
+        return;
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    ngx_tcp_proxy_start(s);
+}
+
+
+static ngx_int_t
+ngx_tcp_proxy_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+    err = 0;
+    len = sizeof(int);
+
+    /*
+     * BSDs and Linux return 0 and set a pending error in err,
+     * Solaris returns -1 and sets errno
+     */
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        (void) ngx_connection_error(c, err, "connect() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_tcp_proxy_start(ngx_tcp_session_t *s)
+{
+    ngx_connection_t         *c, *pc;
+    ngx_tcp_proxy_conf_t     *pcf;
+    ngx_tcp_core_srv_conf_t  *cscf;
+#if (NGX_HAVE_SPLICE)
+    ngx_uint_t                from_client, to_client;
+#endif
+
+    c = s->connection;
+    pc = s->proxy->upstream.connection;
+
+    c->log->action = "proxying";
+
+    ngx_tcp_stats_record(s, NGX_TCP_STATS_CONNECT, phase_time);
+
+    pc->requests++;
+
+    cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+    pcf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_proxy_module);
+
+    if (pcf->proxy_protocol
+        && ngx_tcp_proxy_queue_proxy_protocol(s) != NGX_OK)
+    {
+        ngx_tcp_proxy_close_session(s);
+        return;
+    }
+
+#if (NGX_HAVE_SPLICE)
+
+    /*
+     * the payload is moved through a pipe pair entirely in the kernel
+     * unless it has to be seen in the user space: decrypted by SSL or
+     * inspected by the protocol; with kTLS the kernel encrypts what is
+     * spliced to the client, the input is still read through OpenSSL
+     * as it may carry TLS records other than data
+     */
+
+    if (pcf->splice) {
+        from_client = 1;
+        to_client = (cscf->protocol->process_proxy_response == NULL);
+
+#if (NGX_TCP_SSL)
+        if (c->ssl) {
+            from_client = 0;
+            to_client = to_client && s->ktls;
+        }
+#endif
+
+        if (from_client) {
+            s->proxy->downstream_pipe = ngx_tcp_proxy_create_pipe(s);
+        }
+
+        if (to_client) {
+            s->proxy->upstream_pipe = ngx_tcp_proxy_create_pipe(s);
+        }
+    }
+
+#endif
+
+    c->read->handler = ngx_tcp_proxy_handler;
+    c->write->handler = ngx_tcp_proxy_handler;
+    pc->read->handler = ngx_tcp_proxy_handler;
+    pc->write->handler = ngx_tcp_proxy_handler;
+
+    ngx_tcp_add_idle_timer(s, c->read, cscf->proxy_timeout);
+
+    /* the client data read by the protocol are sent first */
+
+    pc->write->ready = 1;
+
+    ngx_tcp_proxy_handler(pc->write);
+}
+
+
+/*
+ * the v2 header is put before the client data buffered, so both are sent
+ * with the first send() to the upstream; if the buffer is full, the header
+ * waits in a buffer of its own, which ngx_tcp_proxy_handler() sends first
+ */
+
+static ngx_int_t
+ngx_tcp_proxy_queue_proxy_protocol(ngx_tcp_session_t *s)
+{
+    u_char     *p;
+    size_t      len, size;
+    ngx_buf_t  *b;
+    u_char      header[NGX_TCP_PROXY_PROTOCOL_V2_MAX_HEADER];
+
+    p = ngx_tcp_proxy_protocol_write(s->connection, header);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    len = p - header;
+
+    b = s->buffer;
+    size = b->last - b->pos;
+
+    if ((size_t) (b->end - b->start) >= len + size) {
+        ngx_memmove(b->start + len, b->pos, size);
+        ngx_memcpy(b->start, header, len);
+
+        b->pos = b->start;
+        b->last = b->start + len + size;
+
+        return NGX_OK;
+    }
+
+    b = ngx_create_temp_buf(s->connection->pool, len);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->last = ngx_cpymem(b->pos, header, len);
+
+    s->proxy->header = b;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_tcp_proxy_handler(ngx_event_t *ev)
+{
+    char                     *action, *recv_action, *send_action;
+    size_t                    size;
+    ssize_t                   n;
+    ngx_buf_t                *b, *header;
+    ngx_uint_t                do_write, inspect, moved;
+    ngx_connection_t         *c, *src, *dst;
+    ngx_tcp_session_t        *s;
+    ngx_tcp_proxy_ctx_t      *p;
+    ngx_tcp_core_srv_conf_t  *cscf;
+#if (NGX_HAVE_SPLICE)
+    off_t                     sent;
+    ngx_tcp_proxy_pipe_t     *pp;
+#endif
+
+    c = ev->data;
+    s = c->data;
+    p = s->proxy;
+
+    if (ev->timedout) {
+        c->log->action = "proxying";
+
+        ngx_tcp_stats_inc(s, proxy_timeouts);
+
+        if (c == s->connection) {
+            ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                          "client timed out");
+            c->timedout = 1;
+
+        } else {
+            ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                          "upstream timed out");
+        }
+
+        ngx_tcp_proxy_close_session(s);
+        return;
+    }
+
+    if (c == s->connection) {
+        if (ev->write) {
+            recv_action = "proxying and reading from upstream";
+            send_action = "proxying and sending to client";
+            src = p->upstream.connection;
+            dst = c;
+            b = p->buffer;
+
+        } else {
+            recv_action = "proxying and reading from client";
+            send_action = "proxying and sending to upstream";
+            src = c;
+            dst = p->upstream.connection;
+            b = s->buffer;
+        }
+
+    } else {
+        if (ev->write) {
+            recv_action = "proxying and reading from client";
+            send_action = "proxying and sending to upstream";
+            src = s->connection;
+            dst = c;
+            b = s->buffer;
+
+        } else {
+            recv_action = "proxying and reading from upstream";
+            send_action = "proxying and sending to client";
+            src = c;
+            dst = s->connection;
+            b = p->buffer;
+        }
+    }
+
+#if (NGX_HAVE_SPLICE)
+    pp = (b == s->buffer) ? p->downstream_pipe : p->upstream_pipe;
+#endif
+
+    cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+
+    inspect = (b == p->buffer && cscf->protocol->process_proxy_response);
+
+    header = (b == s->buffer) ? p->header : NULL;
+
+    do_write = ev->write ? 1 : 0;
+    moved = 0;
+
+    for ( ;; ) {
+
+        if (do_write) {
+
+            /* the PROXY protocol header goes before the client data */
+
+            if (header && dst->write->ready) {
+                c->log->action = send_action;
+
+                n = dst->send(dst, header->pos, header->last - header->pos);
+
+                if (n == NGX_ERROR) {
+                    ngx_tcp_proxy_close_session(s);
+                    return;
+                }
+
+                if (n > 0) {
+                    moved = 1;
+                    header->pos += n;
+
+                    if (header->pos == header->last) {
+                        header = NULL;
+                        p->header = NULL;
+                    }
+                }
+            }
+
+            size = b->last - b->pos;
+
+            if (header == NULL && size && dst->write->ready) {
+                c->log->action = send_action;
+
+                n = dst->send(dst, b->pos, size);
+
+                if (n == NGX_ERROR) {
+                    ngx_tcp_proxy_close_session(s);
+                    return;
+                }
+
+                if (n > 0) {
+                    moved = 1;
+                    b->pos += n;
+
+                    if (b->pos == b->last) {
+                        b->pos = b->start;
+                        b->last = b->start;
+                    }
+                }
+            }
+        }
+
+#if (NGX_HAVE_SPLICE)
+
+        if (pp) {
+
+            /*
+             * the bytes already buffered, e.g. read ahead by the protocol,
+             * are flushed before the pipe takes over
+             */
+
+            if (header == NULL && b->pos == b->last) {
+                c->log->action = recv_action;
+
+                size = pp->size;
+                sent = dst->sent;
+
+                if (ngx_tcp_proxy_splice(s, src, dst, pp, 1) != NGX_OK) {
+                    ngx_tcp_proxy_close_session(s);
+                    return;
+                }
+
+                if (pp->size != size || dst->sent != sent) {
+                    moved = 1;
+                }
+            }
+
+            break;
+        }
+
+#endif
+
+        size = b->end - b->last;
+
+        if (size && src->read->ready) {
+            c->log->action = recv_action;
+
+            n = src->recv(src, b->last, size);
+
+            if (n == NGX_AGAIN || n == 0) {
+                break;
+            }
+
+            if (n > 0) {
+                if (src == s->connection) {
+                    s->received += n;
+                }
+
+                if (inspect) {
+                    cscf->protocol->process_proxy_response(s, b->last, n);
+                }
+
+                do_write = 1;
+                moved = 1;
+                b->last += n;
+
+                continue;
+            }
+
+            if (n == NGX_ERROR) {
+                src->read->eof = 1;
+            }
+        }
+
+        break;
+    }
+
+    c->log->action = "proxying";
+
+    if ((s->connection->read->eof && s->buffer->pos == s->buffer->last
+         && p->header == NULL
+#if (NGX_HAVE_SPLICE)
+         && (p->downstream_pipe == NULL || p->downstream_pipe->size == 0)
+#endif
+        )
+        || (p->upstream.connection->read->eof
+            && p->buffer->pos == p->buffer->last
+#if (NGX_HAVE_SPLICE)
+            && (p->upstream_pipe == NULL || p->upstream_pipe->size == 0)
+#endif
+           )
+        || (s->connection->read->eof
+            && p->upstream.connection->read->eof))
+    {
+        action = c->log->action;
+        c->log->action = NULL;
+        ngx_log_error(NGX_LOG_INFO, c->log, 0, "proxied session done");
+        c->log->action = action;
+
+        ngx_tcp_proxy_close_session(s);
+        return;
+    }
+
+    if (ngx_handle_write_event(dst->write, 0) != NGX_OK) {
+        ngx_tcp_proxy_close_session(s);
+        return;
+    }
+
+    if (ngx_handle_read_event(dst->read, 0) != NGX_OK) {
+        ngx_tcp_proxy_close_session(s);
+        return;
+    }
+
+    if (ngx_handle_write_event(src->write, 0) != NGX_OK) {
+        ngx_tcp_proxy_close_session(s);
+        return;
+    }
+
+    if (ngx_handle_read_event(src->read, 0) != NGX_OK) {
+        ngx_tcp_proxy_close_session(s);
+        return;
+    }
+
+    /*
+     * the session is idle only if no bytes move in either direction,
+     * so the timer is re-armed by the upstream events as well
+     */
+
+    if (moved) {
+        ngx_tcp_add_idle_timer(s, s->connection->read, cscf->proxy_timeout);
+    }
+}
+
+
+#if (NGX_HAVE_SPLICE)
+
+static ngx_tcp_proxy_pipe_t *
+ngx_tcp_proxy_create_pipe(ngx_tcp_session_t *s)
+{
+    int                    size;
+    ngx_tcp_proxy_pipe_t  *p;
+
+    p = ngx_palloc(s->connection->pool, sizeof(ngx_tcp_proxy_pipe_t));
+    if (p == NULL) {
+        return NULL;
+    }
+
+    if (pipe(p->fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, s->connection->log, ngx_errno,
+                      "pipe() failed, proxying without splice()");
+        return NULL;
+    }
+
+    p->size = 0;
+
+#if (defined F_GETPIPE_SZ)
+    size = fcntl(p->fd[1], F_GETPIPE_SZ);
+
+    if (size == -1) {
+        size = 65536;
+    }
+#else
+    size = 65536;
+#endif
+
+    p->capacity = size;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_CORE, s->connection->log, 0,
+                   "tcp proxy pipe %d:%d, size: %d",
+                   p->fd[0], p->fd[1], size);
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_tcp_proxy_splice(ngx_tcp_session_t *s, ngx_connection_t *src,
+    ngx_connection_t *dst, ngx_tcp_proxy_pipe_t *p, ngx_uint_t do_write)
+{
+    size_t     size;
+    ssize_t    n;
+    ngx_err_t  err;
+
+    for ( ;; ) {
+
+        if (do_write && p->size && dst->write->ready) {
+
+            n = splice(p->fd[0], NULL, dst->fd, NULL, p->size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_CORE, dst->log, 0,
+                           "splice() to %d: %z", dst->fd, n);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err != NGX_EAGAIN) {
+                    dst->error = 1;
+                    (void) ngx_connection_error(dst, err,
+                                                "splice() to socket failed");
+                    return NGX_ERROR;
+                }
+
+                dst->write->ready = 0;
+
+            } else {
+                p->size -= n;
+                dst->sent += n;
+            }
+        }
+
+        size = p->capacity - p->size;
+
+        if (size && src->read->ready && !src->read->eof) {
+
+            n = splice(src->fd, NULL, p->fd[1], NULL, size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_CORE, src->log, 0,
+                           "splice() from %d: %z", src->fd, n);
+
+            if (n > 0) {
+                p->size += n;
+                do_write = 1;
+
+                if (src == s->connection) {
+                    s->received += n;
+                }
+
+                continue;
+            }
+
+            src->read->ready = 0;
+
+            if (n == 0) {
+                src->read->eof = 1;
+                break;
+            }
+
+            err = ngx_errno;
+
+            if (err != NGX_EAGAIN) {
+                src->read->eof = 1;
+                src->read->error = 1;
+                (void) ngx_connection_error(src, err,
+                                            "splice() from socket failed");
+            }
+        }
+
+        break;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_tcp_proxy_get_cached_peer(ngx_tcp_session_t *s)
+{
+    ngx_queue_t            *q, *cache;
+    ngx_connection_t       *c;
+    ngx_tcp_proxy_ctx_t    *p;
+    ngx_tcp_proxy_conf_t   *pcf;
+    ngx_tcp_proxy_cache_t  *item;
+
+    pcf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_proxy_module);
+
+    if (pcf->keepalive == 0) {
+        return NGX_DECLINED;
+    }
+
+    p = s->proxy;
+
+    /* search cache for suitable connection */
+
+    cache = &pcf->cache;
+
+    for (q = ngx_queue_head(cache);
+         q != ngx_queue_sentinel(cache);
+         q = ngx_queue_next(q))
+    {
+        item = ngx_queue_data(q, ngx_tcp_proxy_cache_t, queue);
+
+        if (item->socklen != p->upstream.socklen
+            || ngx_memcmp(item->sockaddr, p->upstream.sockaddr,
+                          item->socklen)
+               != 0)
+        {
+            continue;
+        }
+
+        ngx_queue_remove(q);
+        ngx_queue_insert_head(&pcf->free, q);
+
+        c = item->connection;
+        item->connection = NULL;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, s->connection->log, 0,
+                       "tcp proxy get keepalive peer: using connection %p",
+                       c);
+
+        c->idle = 0;
+        c->data = s;
+        c->pool = s->connection->pool;
+        c->log = s->connection->log;
+        c->read->log = c->log;
+        c->write->log = c->log;
+
+        if (c->read->timer_set) {
+            ngx_del_timer(c->read);
+        }
+
+        p->upstream.connection = c;
+        p->upstream.cached = 1;
+
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_tcp_proxy_cache_peer(ngx_tcp_session_t *s)
+{
+    ngx_queue_t            *q;
+    ngx_connection_t       *c;
+    ngx_tcp_proxy_ctx_t    *p;
+    ngx_tcp_proxy_conf_t   *pcf;
+    ngx_tcp_proxy_cache_t  *item;
+
+    p = s->proxy;
+    c = p->upstream.connection;
+
+    pcf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_proxy_module);
+
+    if (!p->keepalive
+        || pcf->keepalive == 0
+        || c->requests == 0
+        || c->requests >= pcf->keepalive_requests
+        || c->read->eof
+        || c->read->error
+        || c->read->timedout
+        || c->write->error
+        || c->write->timedout
+        || p->buffer->pos != p->buffer->last
+        || s->buffer->pos != s->buffer->last)
+    {
+        return NGX_DECLINED;
+    }
+
+#if (NGX_HAVE_SPLICE)
+
+    if ((p->downstream_pipe && p->downstream_pipe->size)
+        || (p->upstream_pipe && p->upstream_pipe->size))
+    {
+        return NGX_DECLINED;
+    }
+
+#endif
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, s->connection->log, 0,
+                   "tcp proxy free keepalive peer: saving connection %p", c);
+
+    if (ngx_queue_empty(&pcf->free)) {
+
+        /* the least recently used connection gives place to this one */
+
+        q = ngx_queue_last(&pcf->cache);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_tcp_proxy_cache_t, queue);
+
+        ngx_close_connection(item->connection);
+
+    } else {
+        q = ngx_queue_head(&pcf->free);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_tcp_proxy_cache_t, queue);
+    }
+
+    ngx_queue_insert_head(&pcf->cache, q);
+
+    item->connection = c;
+    item->socklen = p->upstream.socklen;
+    ngx_memcpy(item->sockaddr, p->upstream.sockaddr, p->upstream.socklen);
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    c->read->handler = ngx_tcp_proxy_keepalive_close_handler;
+    c->write->handler = ngx_tcp_proxy_dummy_handler;
+
+    c->data = item;
+    c->idle = 1;
+    c->pool = NULL;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+
+    ngx_add_timer(c->read, pcf->keepalive_timeout);
+
+    p->upstream.connection = NULL;
+
+    if (c->read->ready) {
+        ngx_tcp_proxy_keepalive_close_handler(c->read);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_tcp_proxy_keepalive_close_handler(ngx_event_t *ev)
+{
+    char                    buf[1];
+    ssize_t                 n;
+    ngx_connection_t       *c;
+    ngx_tcp_proxy_conf_t   *pcf;
+    ngx_tcp_proxy_cache_t  *item;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                   "tcp proxy keepalive close handler");
+
+    c = ev->data;
+
+    if (c->close || ev->timedout) {
+        goto close;
+    }
+
+    /* an idle upstream may only close the connection */
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        ev->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+close:
+
+    item = c->data;
+    pcf = item->conf;
+
+    ngx_close_connection(c);
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&pcf->free, &item->queue);
+}
+
+
+static void
+ngx_tcp_proxy_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, ev->log, 0, "tcp proxy dummy handler");
+}
+
+
+static void
+ngx_tcp_proxy_cleanup(void *data)
+{
+    ngx_tcp_session_t  *s = data;
+
+    ngx_uint_t            state;
+    ngx_connection_t     *pc;
+    ngx_tcp_proxy_ctx_t  *p;
+
+    p = s->proxy;
+    pc = p->upstream.connection;
+
+    state = 0;
+
+    if (pc
+        && (pc->read->error || pc->read->timedout
+            || pc->write->error || pc->write->timedout))
+    {
+        state = NGX_PEER_FAILED;
+    }
+
+    if (pc && ngx_tcp_proxy_cache_peer(s) != NGX_OK) {
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, s->connection->log, 0,
+                       "close tcp proxy connection: %d",
+                       p->upstream.connection->fd);
+
+        ngx_close_connection(p->upstream.connection);
+        p->upstream.connection = NULL;
+    }
+
+    if (p->upstream.free) {
+        p->upstream.free(&p->upstream, p->upstream.data, state);
+    }
+
+#if (NGX_HAVE_SPLICE)
+
+    if (p->downstream_pipe) {
+        (void) close(p->downstream_pipe->fd[0]);
+        (void) close(p->downstream_pipe->fd[1]);
+    }
+
+    if (p->upstream_pipe) {
+        (void) close(p->upstream_pipe->fd[0]);
+        (void) close(p->upstream_pipe->fd[1]);
+    }
+
+#endif
+}
+
+
+static void
+ngx_tcp_proxy_internal_server_error(ngx_tcp_session_t *s)
+{
+    ngx_tcp_internal_server_error(s);
+}
+
+
+static void
+ngx_tcp_proxy_close_session(ngx_tcp_session_t *s)
+{
+    ngx_tcp_close_connection(s->connection);
+}
+
+
+static ngx_int_t
+ngx_tcp_proxy_protocol_init_session(ngx_tcp_session_t *s)
+{
+    return NGX_OK;
+}
+
+
+static void
+ngx_tcp_proxy_protocol_process_session(ngx_tcp_session_t *s)
+{
+    ngx_tcp_proxy_init(s, NULL);
+}
+
+
+static void *
+ngx_tcp_proxy_create_conf(ngx_conf_t *cf)
+{
+    ngx_tcp_proxy_conf_t  *pcf;
+
+    pcf = ngx_pcalloc(cf->pool, sizeof(ngx_tcp_proxy_conf_t));
+    if (pcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     pcf->upstream = NULL;
+     *     pcf->cache = { NULL, NULL };
+     *     pcf->free = { NULL, NULL };
+     */
+
+    pcf->buffer_size = NGX_CONF_UNSET_SIZE;
+    pcf->splice = NGX_CONF_UNSET;
+    pcf->proxy_protocol = NGX_CONF_UNSET;
+    pcf->keepalive = NGX_CONF_UNSET_UINT;
+    pcf->keepalive_timeout = NGX_CONF_UNSET_MSEC;
+    pcf->keepalive_requests = NGX_CONF_UNSET_UINT;
+
+    return pcf;
+}
+
+
+static char *
+ngx_tcp_proxy_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_tcp_proxy_conf_t *prev = parent;
+    ngx_tcp_proxy_conf_t *conf = child;
+
+    ngx_uint_t              i;
+    ngx_tcp_proxy_cache_t  *cached;
+
+    if (conf->upstream == NULL) {
+        conf->upstream = prev->upstream;
+    }
+
+    ngx_conf_merge_size_value(conf->buffer_size, prev->buffer_size,
+                              (size_t) ngx_pagesize);
+    ngx_conf_merge_value(conf->splice, prev->splice, 0);
+    ngx_conf_merge_value(conf->proxy_protocol, prev->proxy_protocol, 0);
+
+    ngx_conf_merge_uint_value(conf->keepalive, prev->keepalive, 0);
+    ngx_conf_merge_msec_value(conf->keepalive_timeout,
+                              prev->keepalive_timeout, 60000);
+    ngx_conf_merge_uint_value(conf->keepalive_requests,
+                              prev->keepalive_requests, 100);
+
+    /* the header describes one client, so the connection is not reused */
+
+    if (conf->proxy_protocol && conf->keepalive) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "\"proxy_keepalive\" is ignored "
+                           "with \"proxy_protocol\"");
+        conf->keepalive = 0;
+    }
+
+    ngx_queue_init(&conf->cache);
+    ngx_queue_init(&conf->free);
+
+    if (conf->keepalive) {
+        cached = ngx_pcalloc(cf->pool,
+                             sizeof(ngx_tcp_proxy_cache_t) * conf->keepalive);
+        if (cached == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        for (i = 0; i < conf->keepalive; i++) {
+            ngx_queue_insert_head(&conf->free, &cached[i].queue);
+            cached[i].conf = conf;
+        }
+    }
+
+#if !(NGX_HAVE_SPLICE)
+
+    if (conf->splice) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "\"proxy_splice\" is not supported "
+                           "on this platform, ignored");
+        conf->splice = 0;
+    }
+
+#endif
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_tcp_proxy_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_tcp_proxy_conf_t *pcf = conf;
+
+    ngx_str_t  *value;
+    ngx_url_t   u;
+
+    if (pcf->upstream) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+    u.no_resolve = 1;
+
+    pcf->upstream = ngx_tcp_upstream_add(cf, &u, 0);
+    if (pcf->upstream == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
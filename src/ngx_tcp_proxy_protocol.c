@@ -0,0 +1,464 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_tcp.h>
+
+
+#define NGX_TCP_PROXY_PROTOCOL_V2_SIG_LEN  12
+
+#define NGX_TCP_PROXY_PROTOCOL_AF_INET     1
+#define NGX_TCP_PROXY_PROTOCOL_AF_INET6    2
+
+
+typedef struct {
+    u_char                  signature[NGX_TCP_PROXY_PROTOCOL_V2_SIG_LEN];
+    u_char                  version_command;
+    u_char                  family_transport;
+    u_char                  len[2];
+} ngx_tcp_proxy_protocol_header_t;
+
+
+typedef struct {
+    u_char                  src_addr[4];
+    u_char                  dst_addr[4];
+    u_char                  src_port[2];
+    u_char                  dst_port[2];
+} ngx_tcp_proxy_protocol_inet_addrs_t;
+
+
+typedef struct {
+    u_char                  src_addr[16];
+    u_char                  dst_addr[16];
+    u_char                  src_port[2];
+    u_char                  dst_port[2];
+} ngx_tcp_proxy_protocol_inet6_addrs_t;
+
+
+static ssize_t ngx_tcp_proxy_protocol_v1_read(ngx_connection_t *c,
+    u_char *buf, u_char *last);
+static ssize_t ngx_tcp_proxy_protocol_v2_read(ngx_connection_t *c,
+    u_char *buf, u_char *last);
+static ngx_int_t ngx_tcp_proxy_protocol_set_addr(ngx_connection_t *c,
+    struct sockaddr *sa, socklen_t socklen);
+static in_port_t ngx_tcp_proxy_protocol_port(struct sockaddr *sa);
+#if (NGX_HAVE_INET6)
+static u_char *ngx_tcp_proxy_protocol_write_addr6(struct sockaddr *sa,
+    u_char *p);
+#endif
+
+
+static u_char  ngx_tcp_proxy_protocol_v2_sig[] = "\r\n\r\n\0\r\nQUIT\n";
+
+
+ssize_t
+ngx_tcp_proxy_protocol_read(ngx_connection_t *c, u_char *buf, u_char *last)
+{
+    if (buf == last) {
+        return NGX_AGAIN;
+    }
+
+    if (*buf == 'P') {
+        return ngx_tcp_proxy_protocol_v1_read(c, buf, last);
+    }
+
+    if (*buf == CR) {
+        return ngx_tcp_proxy_protocol_v2_read(c, buf, last);
+    }
+
+    ngx_log_error(NGX_LOG_ERR, c->log, 0, "no PROXY protocol header");
+
+    return NGX_ERROR;
+}
+
+
+/* "PROXY TCP4|TCP6 src dst sport dport" CRLF or "PROXY UNKNOWN ..." CRLF */
+
+static ssize_t
+ngx_tcp_proxy_protocol_v1_read(ngx_connection_t *c, u_char *buf,
+    u_char *last)
+{
+    u_char      *p, *end, *addr, *port;
+    size_t       len;
+    ssize_t      hlen;
+    ngx_int_t    n;
+    ngx_uint_t   family;
+    ngx_addr_t   src;
+
+    len = ngx_min((size_t) (last - buf), sizeof("PROXY ") - 1);
+
+    if (ngx_strncmp(buf, "PROXY ", len) != 0) {
+        goto invalid;
+    }
+
+    len = ngx_min((size_t) (last - buf), NGX_TCP_PROXY_PROTOCOL_V1_MAX_HEADER);
+
+    end = ngx_strlchr(buf, buf + len, LF);
+
+    if (end == NULL) {
+        if (len < NGX_TCP_PROXY_PROTOCOL_V1_MAX_HEADER) {
+            return NGX_AGAIN;
+        }
+
+        goto invalid;
+    }
+
+    if (*(end - 1) != CR) {
+        goto invalid;
+    }
+
+    hlen = end + 1 - buf;
+
+    p = buf + sizeof("PROXY ") - 1;
+    end--;
+
+    if (end - p >= 7 && ngx_strncmp(p, "UNKNOWN", 7) == 0) {
+        return hlen;
+    }
+
+    if (end - p < 5
+        || (ngx_strncmp(p, "TCP4 ", 5) != 0
+            && ngx_strncmp(p, "TCP6 ", 5) != 0))
+    {
+        goto invalid;
+    }
+
+    family = (p[3] == '4') ? AF_INET : AF_INET6;
+
+    addr = p + 5;
+
+    p = ngx_strlchr(addr, end, ' ');
+    if (p == NULL) {
+        goto invalid;
+    }
+
+    if (ngx_parse_addr(c->pool, &src, addr, p - addr) != NGX_OK
+        || src.sockaddr->sa_family != family)
+    {
+        goto invalid;
+    }
+
+    /* the destination address is skipped */
+
+    p = ngx_strlchr(p + 1, end, ' ');
+    if (p == NULL) {
+        goto invalid;
+    }
+
+    port = p + 1;
+
+    p = ngx_strlchr(port, end, ' ');
+    if (p == NULL) {
+        goto invalid;
+    }
+
+    n = ngx_atoi(port, p - port);
+
+    if (n == NGX_ERROR || n > 65535) {
+        goto invalid;
+    }
+
+    switch (src.sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        ((struct sockaddr_in6 *) src.sockaddr)->sin6_port = htons(n);
+        break;
+#endif
+
+    default: /* AF_INET */
+        ((struct sockaddr_in *) src.sockaddr)->sin_port = htons(n);
+        break;
+    }
+
+    if (ngx_tcp_proxy_protocol_set_addr(c, src.sockaddr, src.socklen)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return hlen;
+
+invalid:
+
+    len = ngx_min((size_t) (last - buf), NGX_TCP_PROXY_PROTOCOL_V1_MAX_HEADER);
+
+    ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                  "broken PROXY protocol header: \"%*s\"", len, buf);
+
+    return NGX_ERROR;
+}
+
+
+static ssize_t
+ngx_tcp_proxy_protocol_v2_read(ngx_connection_t *c, u_char *buf,
+    u_char *last)
+{
+    size_t                                 len;
+    ssize_t                                hlen;
+    struct sockaddr_in                    *sin;
+    ngx_tcp_proxy_protocol_header_t       *hdr;
+    ngx_tcp_proxy_protocol_inet_addrs_t   *in;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6                   *sin6;
+    ngx_tcp_proxy_protocol_inet6_addrs_t  *in6;
+#endif
+
+    len = ngx_min((size_t) (last - buf), NGX_TCP_PROXY_PROTOCOL_V2_SIG_LEN);
+
+    if (ngx_memcmp(buf, ngx_tcp_proxy_protocol_v2_sig, len) != 0) {
+        goto invalid;
+    }
+
+    if ((size_t) (last - buf) < sizeof(ngx_tcp_proxy_protocol_header_t)) {
+        return NGX_AGAIN;
+    }
+
+    hdr = (ngx_tcp_proxy_protocol_header_t *) buf;
+
+    if ((hdr->version_command & 0xf0) != 0x20) {
+        goto invalid;
+    }
+
+    len = (hdr->len[0] << 8) + hdr->len[1];
+    hlen = sizeof(ngx_tcp_proxy_protocol_header_t) + len;
+
+    if (last - buf < hlen) {
+        return NGX_AGAIN;
+    }
+
+    /* LOCAL, e.g. a health check of the balancer itself */
+
+    if ((hdr->version_command & 0x0f) == 0) {
+        return hlen;
+    }
+
+    if ((hdr->version_command & 0x0f) != 1) {
+        goto invalid;
+    }
+
+    switch (hdr->family_transport >> 4) {
+
+    case NGX_TCP_PROXY_PROTOCOL_AF_INET:
+
+        if (len < sizeof(ngx_tcp_proxy_protocol_inet_addrs_t)) {
+            goto invalid;
+        }
+
+        in = (ngx_tcp_proxy_protocol_inet_addrs_t *) (hdr + 1);
+
+        sin = ngx_pcalloc(c->pool, sizeof(struct sockaddr_in));
+        if (sin == NULL) {
+            return NGX_ERROR;
+        }
+
+        sin->sin_family = AF_INET;
+        ngx_memcpy(&sin->sin_addr, in->src_addr, 4);
+        ngx_memcpy(&sin->sin_port, in->src_port, 2);
+
+        if (ngx_tcp_proxy_protocol_set_addr(c, (struct sockaddr *) sin,
+                                            sizeof(struct sockaddr_in))
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        break;
+
+#if (NGX_HAVE_INET6)
+
+    case NGX_TCP_PROXY_PROTOCOL_AF_INET6:
+
+        if (len < sizeof(ngx_tcp_proxy_protocol_inet6_addrs_t)) {
+            goto invalid;
+        }
+
+        in6 = (ngx_tcp_proxy_protocol_inet6_addrs_t *) (hdr + 1);
+
+        sin6 = ngx_pcalloc(c->pool, sizeof(struct sockaddr_in6));
+        if (sin6 == NULL) {
+            return NGX_ERROR;
+        }
+
+        sin6->sin6_family = AF_INET6;
+        ngx_memcpy(&sin6->sin6_addr, in6->src_addr, 16);
+        ngx_memcpy(&sin6->sin6_port, in6->src_port, 2);
+
+        if (ngx_tcp_proxy_protocol_set_addr(c, (struct sockaddr *) sin6,
+                                            sizeof(struct sockaddr_in6))
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        break;
+
+#endif
+
+    default:
+
+        /* AF_UNSPEC or AF_UNIX: the connection address is kept */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, c->log, 0,
+                       "tcp PROXY protocol v2 family %ui ignored",
+                       (ngx_uint_t) (hdr->family_transport >> 4));
+        break;
+    }
+
+    /* the TLVs, if any, are skipped */
+
+    return hlen;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, c->log, 0, "broken PROXY protocol v2 header");
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_tcp_proxy_protocol_set_addr(ngx_connection_t *c, struct sockaddr *sa,
+    socklen_t socklen)
+{
+    u_char  *p;
+    size_t   len;
+    u_char   text[NGX_SOCKADDR_STRLEN];
+
+    len = ngx_sock_ntop(sa, text, NGX_SOCKADDR_STRLEN, 0);
+
+    p = ngx_pnalloc(c->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(p, text, len);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, c->log, 0,
+                   "tcp PROXY protocol client %*s", len, p);
+
+    c->sockaddr = sa;
+    c->socklen = socklen;
+
+    c->addr_text.len = len;
+    c->addr_text.data = p;
+
+    return NGX_OK;
+}
+
+
+/*
+ * the local address is the destination, the addresses of different
+ * families are sent as IPv6, and anything else, e.g. a unix socket,
+ * as AF_UNSPEC, so the receiver keeps the addresses of the connection
+ */
+
+u_char *
+ngx_tcp_proxy_protocol_write(ngx_connection_t *c, u_char *buf)
+{
+    u_char           *p;
+    in_port_t         port;
+    struct sockaddr  *src, *dst;
+
+    if (ngx_connection_local_sockaddr(c, NULL, 0) != NGX_OK) {
+        return NULL;
+    }
+
+    src = c->sockaddr;
+    dst = c->local_sockaddr;
+
+    p = ngx_cpymem(buf, ngx_tcp_proxy_protocol_v2_sig,
+                   NGX_TCP_PROXY_PROTOCOL_V2_SIG_LEN);
+
+    /* version 2, PROXY */
+
+    *p++ = 0x21;
+
+    if (src->sa_family == AF_INET && dst->sa_family == AF_INET) {
+
+        /* TCP over IPv4 */
+
+        *p++ = 0x11;
+        *p++ = 0;
+        *p++ = sizeof(ngx_tcp_proxy_protocol_inet_addrs_t);
+
+        p = ngx_cpymem(p, &((struct sockaddr_in *) src)->sin_addr, 4);
+        p = ngx_cpymem(p, &((struct sockaddr_in *) dst)->sin_addr, 4);
+
+#if (NGX_HAVE_INET6)
+
+    } else if ((src->sa_family == AF_INET || src->sa_family == AF_INET6)
+               && (dst->sa_family == AF_INET || dst->sa_family == AF_INET6))
+    {
+        /* TCP over IPv6 */
+
+        *p++ = 0x21;
+        *p++ = 0;
+        *p++ = sizeof(ngx_tcp_proxy_protocol_inet6_addrs_t);
+
+        p = ngx_tcp_proxy_protocol_write_addr6(src, p);
+        p = ngx_tcp_proxy_protocol_write_addr6(dst, p);
+
+#endif
+
+    } else {
+        *p++ = 0x00;
+        *p++ = 0;
+        *p++ = 0;
+
+        return p;
+    }
+
+    port = ngx_tcp_proxy_protocol_port(src);
+    p = ngx_cpymem(p, &port, 2);
+
+    port = ngx_tcp_proxy_protocol_port(dst);
+    p = ngx_cpymem(p, &port, 2);
+
+    return p;
+}
+
+
+/* in the network byte order */
+
+static in_port_t
+ngx_tcp_proxy_protocol_port(struct sockaddr *sa)
+{
+    switch (sa->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        return ((struct sockaddr_in6 *) sa)->sin6_port;
+#endif
+
+    default: /* AF_INET */
+        return ((struct sockaddr_in *) sa)->sin_port;
+    }
+}
+
+
+#if (NGX_HAVE_INET6)
+
+static u_char *
+ngx_tcp_proxy_protocol_write_addr6(struct sockaddr *sa, u_char *p)
+{
+    if (sa->sa_family == AF_INET6) {
+        return ngx_cpymem(p, &((struct sockaddr_in6 *) sa)->sin6_addr, 16);
+    }
+
+    /* an IPv4-mapped IPv6 address */
+
+    ngx_memzero(p, 10);
+    p += 10;
+
+    *p++ = 0xff;
+    *p++ = 0xff;
+
+    return ngx_cpymem(p, &((struct sockaddr_in *) sa)->sin_addr, 4);
+}
+
+#endif
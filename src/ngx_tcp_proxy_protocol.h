@@ -0,0 +1,37 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#ifndef _NGX_TCP_PROXY_PROTOCOL_H_INCLUDED_
+#define _NGX_TCP_PROXY_PROTOCOL_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/* "PROXY TCP6 " two addresses, two ports and CRLF */
+#define NGX_TCP_PROXY_PROTOCOL_V1_MAX_HEADER  107
+
+/* the signature, the command, the family, the length and TCP6 addresses */
+#define NGX_TCP_PROXY_PROTOCOL_V2_MAX_HEADER  (16 + 36)
+
+
+/*
+ * parses a v1 or v2 header at the start of the data read: the length
+ * of the header is returned, NGX_AGAIN if it is incomplete, NGX_ERROR
+ * if it is invalid; the source address of the header, if any, replaces
+ * c->sockaddr and c->addr_text
+ */
+
+ssize_t ngx_tcp_proxy_protocol_read(ngx_connection_t *c, u_char *buf,
+    u_char *last);
+
+/* writes a v2 header of the client and the local address of c */
+
+u_char *ngx_tcp_proxy_protocol_write(ngx_connection_t *c, u_char *buf);
+
+
+#endif /* _NGX_TCP_PROXY_PROTOCOL_H_INCLUDED_ */
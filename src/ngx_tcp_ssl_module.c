@@ -0,0 +1,1001 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_tcp.h>
+
+
+#define NGX_DEFAULT_CIPHERS     "HIGH:!aNULL:!MD5"
+#define NGX_DEFAULT_ECDH_CURVE  "prime256v1"
+
+#ifdef NGX_SSL_TLSv1_3
+#define NGX_DEFAULT_PROTOCOLS   (NGX_SSL_TLSv1_2|NGX_SSL_TLSv1_3)
+#else
+#define NGX_DEFAULT_PROTOCOLS   NGX_SSL_TLSv1_2
+#endif
+
+
+/*
+ * OpenSSL accepts the early data only if the ticket age reported by
+ * the client is within 10 seconds of the real one, so a replay older
+ * than that is rejected by OpenSSL itself
+ */
+
+#define NGX_TCP_SSL_REPLAY_WINDOW  10
+
+
+typedef struct {
+    ngx_rbtree_node_t       node;
+    ngx_queue_t             queue;
+    time_t                  expire;
+    u_char                  random[SSL3_RANDOM_SIZE];
+} ngx_tcp_ssl_replay_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t            rbtree;
+    ngx_rbtree_node_t       sentinel;
+
+    /* the oldest entries are at the tail */
+    ngx_queue_t             queue;
+} ngx_tcp_ssl_replay_shctx_t;
+
+
+typedef struct {
+    ngx_tcp_ssl_replay_shctx_t  *sh;
+    ngx_slab_pool_t             *shpool;
+} ngx_tcp_ssl_replay_ctx_t;
+
+
+static void *ngx_tcp_ssl_create_conf(ngx_conf_t *cf);
+static char *ngx_tcp_ssl_merge_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+
+static char *ngx_tcp_ssl_enable(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_tcp_ssl_starttls(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_tcp_ssl_password_file(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_tcp_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_tcp_ssl_early_data_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_tcp_ssl_replay_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void ngx_tcp_ssl_replay_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+
+#if (NGX_TCP_SSL_EARLY_DATA)
+static int ngx_tcp_ssl_allow_early_data(SSL *ssl_conn, void *arg);
+#endif
+
+
+static ngx_conf_enum_t  ngx_tcp_starttls_state[] = {
+    { ngx_string("off"), NGX_TCP_STARTTLS_OFF },
+    { ngx_string("on"), NGX_TCP_STARTTLS_ON },
+    { ngx_string("only"), NGX_TCP_STARTTLS_ONLY },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_conf_bitmask_t  ngx_tcp_ssl_protocols[] = {
+    { ngx_string("SSLv2"), NGX_SSL_SSLv2 },
+    { ngx_string("SSLv3"), NGX_SSL_SSLv3 },
+    { ngx_string("TLSv1"), NGX_SSL_TLSv1 },
+    { ngx_string("TLSv1.1"), NGX_SSL_TLSv1_1 },
+    { ngx_string("TLSv1.2"), NGX_SSL_TLSv1_2 },
+#ifdef NGX_SSL_TLSv1_3
+    { ngx_string("TLSv1.3"), NGX_SSL_TLSv1_3 },
+#endif
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_command_t  ngx_tcp_ssl_commands[] = {
+
+    { ngx_string("ssl"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_FLAG,
+      ngx_tcp_ssl_enable,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_conf_t, enable),
+      NULL },
+
+    { ngx_string("starttls"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_tcp_ssl_starttls,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_conf_t, starttls),
+      ngx_tcp_starttls_state },
+
+    { ngx_string("ssl_certificate"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_array_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_conf_t, certificates),
+      NULL },
+
+    { ngx_string("ssl_certificate_key"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_array_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_conf_t, certificate_keys),
+      NULL },
+
+    { ngx_string("ssl_password_file"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_tcp_ssl_password_file,
+      NGX_TCP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ssl_dhparam"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_conf_t, dhparam),
+      NULL },
+
+    { ngx_string("ssl_ecdh_curve"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_conf_t, ecdh_curve),
+      NULL },
+
+    { ngx_string("ssl_protocols"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_1MORE,
+      ngx_conf_set_bitmask_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_conf_t, protocols),
+      &ngx_tcp_ssl_protocols },
+
+    { ngx_string("ssl_ciphers"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_conf_t, ciphers),
+      NULL },
+
+    { ngx_string("ssl_prefer_server_ciphers"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_conf_t, prefer_server_ciphers),
+      NULL },
+
+    { ngx_string("ssl_session_cache"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE12,
+      ngx_tcp_ssl_session_cache,
+      NGX_TCP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ssl_session_tickets"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_conf_t, session_tickets),
+      NULL },
+
+    { ngx_string("ssl_session_ticket_key"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_array_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_conf_t, session_ticket_keys),
+      NULL },
+
+    { ngx_string("ssl_ktls"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_conf_t, ktls),
+      NULL },
+
+    { ngx_string("ssl_early_data"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_conf_t, early_data),
+      NULL },
+
+    { ngx_string("ssl_early_data_zone"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_tcp_ssl_early_data_zone,
+      NGX_TCP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("ssl_session_timeout"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_conf_t, session_timeout),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_tcp_module_t  ngx_tcp_ssl_module_ctx = {
+    NULL,                                  /* protocol */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_tcp_ssl_create_conf,               /* create server configuration */
+    ngx_tcp_ssl_merge_conf                 /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_tcp_ssl_module = {
+    NGX_MODULE_V1,
+    &ngx_tcp_ssl_module_ctx,               /* module context */
+    ngx_tcp_ssl_commands,                  /* module directives */
+    NGX_TCP_MODULE,                        /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_str_t  ngx_tcp_ssl_sess_id_ctx = ngx_string("TCP");
+
+
+static void *
+ngx_tcp_ssl_create_conf(ngx_conf_t *cf)
+{
+    ngx_tcp_ssl_conf_t  *scf;
+
+    scf = ngx_pcalloc(cf->pool, sizeof(ngx_tcp_ssl_conf_t));
+    if (scf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     scf->protocols = 0;
+     *     scf->dhparam = { 0, NULL };
+     *     scf->ecdh_curve = { 0, NULL };
+     *     scf->ciphers = { 0, NULL };
+     *     scf->shm_zone = NULL;
+     *     scf->early_data_zone = NULL;
+     */
+
+    scf->enable = NGX_CONF_UNSET;
+    scf->starttls = NGX_CONF_UNSET_UINT;
+    scf->certificates = NGX_CONF_UNSET_PTR;
+    scf->certificate_keys = NGX_CONF_UNSET_PTR;
+    scf->passwords = NGX_CONF_UNSET_PTR;
+    scf->prefer_server_ciphers = NGX_CONF_UNSET;
+    scf->ktls = NGX_CONF_UNSET;
+    scf->early_data = NGX_CONF_UNSET;
+    scf->builtin_session_cache = NGX_CONF_UNSET;
+    scf->session_timeout = NGX_CONF_UNSET;
+    scf->session_tickets = NGX_CONF_UNSET;
+    scf->session_ticket_keys = NGX_CONF_UNSET_PTR;
+
+    return scf;
+}
+
+
+static char *
+ngx_tcp_ssl_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_tcp_ssl_conf_t *prev = parent;
+    ngx_tcp_ssl_conf_t *conf = child;
+
+    char                *mode;
+    ngx_pool_cleanup_t  *cln;
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+    ngx_conf_merge_uint_value(conf->starttls, prev->starttls,
+                              NGX_TCP_STARTTLS_OFF);
+
+    ngx_conf_merge_value(conf->session_timeout,
+                         prev->session_timeout, 300);
+
+    ngx_conf_merge_value(conf->prefer_server_ciphers,
+                         prev->prefer_server_ciphers, 0);
+
+    ngx_conf_merge_value(conf->ktls, prev->ktls, 0);
+    ngx_conf_merge_value(conf->early_data, prev->early_data, 0);
+
+    if (conf->early_data_zone == NULL) {
+        conf->early_data_zone = prev->early_data_zone;
+    }
+
+    ngx_conf_merge_bitmask_value(conf->protocols, prev->protocols,
+                                 (NGX_CONF_BITMASK_SET
+                                  |NGX_DEFAULT_PROTOCOLS));
+
+    ngx_conf_merge_ptr_value(conf->certificates, prev->certificates, NULL);
+    ngx_conf_merge_ptr_value(conf->certificate_keys, prev->certificate_keys,
+                             NULL);
+
+    ngx_conf_merge_ptr_value(conf->passwords, prev->passwords, NULL);
+
+    ngx_conf_merge_str_value(conf->dhparam, prev->dhparam, "");
+
+    ngx_conf_merge_str_value(conf->ecdh_curve, prev->ecdh_curve,
+                             NGX_DEFAULT_ECDH_CURVE);
+
+    ngx_conf_merge_str_value(conf->ciphers, prev->ciphers,
+                             NGX_DEFAULT_CIPHERS);
+
+    conf->ssl.log = cf->log;
+
+    if (conf->enable) {
+        mode = "ssl";
+
+    } else if (conf->starttls != NGX_TCP_STARTTLS_OFF) {
+        mode = "starttls";
+
+    } else {
+        mode = "";
+    }
+
+    if (conf->file == NULL) {
+        conf->file = prev->file;
+        conf->line = prev->line;
+    }
+
+    if (*mode) {
+
+        if (conf->certificates == NULL || conf->certificates->nelts == 0) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "no \"ssl_certificate\" is defined for "
+                          "the \"%s\" directive in %s:%ui",
+                          mode, conf->file, conf->line);
+            return NGX_CONF_ERROR;
+        }
+
+        if (conf->certificate_keys == NULL
+            || conf->certificate_keys->nelts < conf->certificates->nelts)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "no \"ssl_certificate_key\" is defined for "
+                          "certificate \"%V\" and "
+                          "the \"%s\" directive in %s:%ui",
+                          ((ngx_str_t *) conf->certificates->elts)
+                          + conf->certificates->nelts - 1,
+                          mode, conf->file, conf->line);
+            return NGX_CONF_ERROR;
+        }
+
+    } else {
+
+        /* "listen ... ssl" needs the certificate only */
+
+        if (conf->certificates == NULL || conf->certificates->nelts == 0) {
+            return NGX_CONF_OK;
+        }
+
+        if (conf->certificate_keys == NULL
+            || conf->certificate_keys->nelts < conf->certificates->nelts)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "no \"ssl_certificate_key\" is defined "
+                          "for certificate \"%V\"",
+                          ((ngx_str_t *) conf->certificates->elts)
+                          + conf->certificates->nelts - 1);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (ngx_ssl_create(&conf->ssl, conf->protocols, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cln->handler = ngx_ssl_cleanup_ctx;
+    cln->data = &conf->ssl;
+
+    if (ngx_ssl_certificates(cf, &conf->ssl, conf->certificates,
+                             conf->certificate_keys, conf->passwords)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (SSL_CTX_set_cipher_list(conf->ssl.ctx,
+                                (const char *) conf->ciphers.data)
+        == 0)
+    {
+        ngx_ssl_error(NGX_LOG_EMERG, cf->log, 0,
+                      "SSL_CTX_set_cipher_list(\"%V\") failed",
+                      &conf->ciphers);
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->prefer_server_ciphers) {
+        SSL_CTX_set_options(conf->ssl.ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+    }
+
+    /*
+     * OpenSSL enables kTLS after the handshake if the cipher allows it and
+     * the kernel has the tls module, otherwise the session stays in
+     * the user space; see ngx_tcp_ssl_handshake_handler()
+     */
+
+    if (conf->ktls) {
+#if (NGX_TCP_SSL_KTLS)
+        SSL_CTX_set_options(conf->ssl.ctx, SSL_OP_ENABLE_KTLS);
+#else
+        ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                      "\"ssl_ktls\" is not supported by this build, "
+                      "ignored");
+#endif
+    }
+
+    if (ngx_ssl_dhparam(cf, &conf->ssl, &conf->dhparam) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_ssl_ecdh_curve(cf, &conf->ssl, &conf->ecdh_curve) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    /*
+     * a full handshake is the most expensive part of a TLS session, so
+     * the sessions are resumed on any worker: through the shared cache
+     * by the session id, or statelessly by a ticket
+     */
+
+    ngx_conf_merge_value(conf->builtin_session_cache,
+                         prev->builtin_session_cache, NGX_SSL_NONE_SCACHE);
+
+    if (conf->shm_zone == NULL) {
+        conf->shm_zone = prev->shm_zone;
+    }
+
+    if (ngx_ssl_session_cache(&conf->ssl, &ngx_tcp_ssl_sess_id_ctx,
+                              conf->certificates, conf->builtin_session_cache,
+                              conf->shm_zone, conf->session_timeout)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_conf_merge_value(conf->session_tickets,
+                         prev->session_tickets, 1);
+
+#ifdef SSL_OP_NO_TICKET
+    if (!conf->session_tickets) {
+        SSL_CTX_set_options(conf->ssl.ctx, SSL_OP_NO_TICKET);
+    }
+#endif
+
+    /*
+     * the keys are rotated by adding a new file first and reloading:
+     * the tickets issued with the older keys listed are still accepted
+     */
+
+    ngx_conf_merge_ptr_value(conf->session_ticket_keys,
+                             prev->session_ticket_keys, NULL);
+
+    if (ngx_ssl_session_ticket_keys(cf, &conf->ssl, conf->session_ticket_keys)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    /*
+     * the early data may be replayed by an attacker, so they are enabled
+     * only for the servers whose protocol has idempotent requests, and
+     * a client random is accepted once by all workers; the own replay
+     * protection of OpenSSL works within one process only
+     */
+
+    if (conf->early_data) {
+#if (NGX_TCP_SSL_EARLY_DATA)
+        if (conf->early_data_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "no \"ssl_early_data_zone\" is defined for "
+                          "the \"ssl_early_data\" directive");
+            return NGX_CONF_ERROR;
+        }
+
+#ifdef NGX_SSL_TLSv1_3
+        if (!(conf->protocols & NGX_SSL_TLSv1_3))
+#endif
+        {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "\"ssl_early_data\" requires TLSv1.3 "
+                          "in \"ssl_protocols\"");
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_ssl_early_data(cf, &conf->ssl, 1) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        SSL_CTX_set_options(conf->ssl.ctx, SSL_OP_NO_ANTI_REPLAY);
+        SSL_CTX_set_allow_early_data_cb(conf->ssl.ctx,
+                                        ngx_tcp_ssl_allow_early_data, conf);
+#else
+        ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                      "\"ssl_early_data\" is not supported by this build, "
+                      "ignored");
+#endif
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_tcp_ssl_enable(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_tcp_ssl_conf_t  *scf = conf;
+
+    char  *rv;
+
+    rv = ngx_conf_set_flag_slot(cf, cmd, conf);
+
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    if (scf->enable && (ngx_int_t) scf->starttls > NGX_TCP_STARTTLS_OFF) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"starttls\" directive conflicts with \"ssl on\"");
+        return NGX_CONF_ERROR;
+    }
+
+    scf->file = cf->conf_file->file.name.data;
+    scf->line = cf->conf_file->line;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_tcp_ssl_starttls(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_tcp_ssl_conf_t  *scf = conf;
+
+    char  *rv;
+
+    rv = ngx_conf_set_enum_slot(cf, cmd, conf);
+
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    if (scf->enable == 1 && (ngx_int_t) scf->starttls > NGX_TCP_STARTTLS_OFF) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"ssl\" directive conflicts with \"starttls\"");
+        return NGX_CONF_ERROR;
+    }
+
+    scf->file = cf->conf_file->file.name.data;
+    scf->line = cf->conf_file->line;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_tcp_ssl_password_file(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_tcp_ssl_conf_t  *scf = conf;
+
+    ngx_str_t  *value;
+
+    if (scf->passwords != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    scf->passwords = ngx_ssl_read_password_file(cf, &value[1]);
+
+    if (scf->passwords == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * "ssl_session_cache off | none | [builtin[:size]] [shared:name:size]",
+ * the shared cache keeps the sessions in an rbtree by the session id and
+ * expires them in the LRU order, see ngx_ssl_session_cache_init()
+ */
+
+static char *
+ngx_tcp_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_tcp_ssl_conf_t  *scf = conf;
+
+    size_t       len;
+    ngx_str_t   *value, name, size;
+    ngx_int_t    n;
+    ngx_uint_t   i, j;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strcmp(value[i].data, "off") == 0) {
+            scf->builtin_session_cache = NGX_SSL_NO_SCACHE;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "none") == 0) {
+            scf->builtin_session_cache = NGX_SSL_NONE_SCACHE;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "builtin") == 0) {
+            scf->builtin_session_cache = NGX_SSL_DFLT_BUILTIN_SCACHE;
+            continue;
+        }
+
+        if (value[i].len > sizeof("builtin:") - 1
+            && ngx_strncmp(value[i].data, "builtin:", sizeof("builtin:") - 1)
+               == 0)
+        {
+            n = ngx_atoi(value[i].data + sizeof("builtin:") - 1,
+                         value[i].len - (sizeof("builtin:") - 1));
+
+            if (n == NGX_ERROR) {
+                goto invalid;
+            }
+
+            scf->builtin_session_cache = n;
+
+            continue;
+        }
+
+        if (value[i].len > sizeof("shared:") - 1
+            && ngx_strncmp(value[i].data, "shared:", sizeof("shared:") - 1)
+               == 0)
+        {
+            len = 0;
+
+            for (j = sizeof("shared:") - 1; j < value[i].len; j++) {
+                if (value[i].data[j] == ':') {
+                    break;
+                }
+
+                len++;
+            }
+
+            if (len == 0 || j == value[i].len) {
+                goto invalid;
+            }
+
+            name.len = len;
+            name.data = value[i].data + sizeof("shared:") - 1;
+
+            size.len = value[i].len - j - 1;
+            size.data = name.data + len + 1;
+
+            n = ngx_parse_size(&size);
+
+            if (n == NGX_ERROR) {
+                goto invalid;
+            }
+
+            if (n < (ngx_int_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "session cache \"%V\" is too small",
+                                   &value[i]);
+
+                return NGX_CONF_ERROR;
+            }
+
+            scf->shm_zone = ngx_shared_memory_add(cf, &name, n,
+                                                  &ngx_tcp_ssl_module);
+            if (scf->shm_zone == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            scf->shm_zone->init = ngx_ssl_session_cache_init;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (scf->shm_zone && scf->builtin_session_cache == NGX_CONF_UNSET) {
+        scf->builtin_session_cache = NGX_SSL_NO_BUILTIN_SCACHE;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid session cache \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+/*
+ * "ssl_early_data_zone name:size", the client randoms of the early data
+ * accepted are kept in an rbtree for NGX_TCP_SSL_REPLAY_WINDOW seconds
+ */
+
+static char *
+ngx_tcp_ssl_early_data_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_tcp_ssl_conf_t  *scf = conf;
+
+    u_char                    *p;
+    ssize_t                    n;
+    ngx_str_t                 *value, name, size;
+    ngx_tcp_ssl_replay_ctx_t  *ctx;
+
+    if (scf->early_data_zone) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    p = ngx_strlchr(value[1].data, value[1].data + value[1].len, ':');
+
+    if (p == NULL || p == value[1].data) {
+        goto invalid;
+    }
+
+    name.len = p - value[1].data;
+    name.data = value[1].data;
+
+    size.len = value[1].data + value[1].len - p - 1;
+    size.data = p + 1;
+
+    n = ngx_parse_size(&size);
+
+    if (n == NGX_ERROR) {
+        goto invalid;
+    }
+
+    if (n < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_tcp_ssl_replay_ctx_t));
+    if (ctx == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    scf->early_data_zone = ngx_shared_memory_add(cf, &name, n,
+                                                 &ngx_tcp_ssl_module);
+    if (scf->early_data_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (scf->early_data_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    scf->early_data_zone->init = ngx_tcp_ssl_replay_init_zone;
+    scf->early_data_zone->data = ctx;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid zone \"%V\"", &value[1]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_tcp_ssl_replay_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_tcp_ssl_replay_ctx_t  *octx = data;
+
+    size_t                     len;
+    ngx_tcp_ssl_replay_ctx_t  *ctx;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+        return NGX_OK;
+    }
+
+    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_tcp_ssl_replay_shctx_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
+                    ngx_tcp_ssl_replay_insert_value);
+
+    ngx_queue_init(&ctx->sh->queue);
+
+    len = sizeof(" in tcp early data zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in tcp early data zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_tcp_ssl_replay_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t          **p;
+    ngx_tcp_ssl_replay_node_t   *rn, *rnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            rn = (ngx_tcp_ssl_replay_node_t *) node;
+            rnt = (ngx_tcp_ssl_replay_node_t *) temp;
+
+            p = (ngx_memcmp(rn->random, rnt->random, SSL3_RANDOM_SIZE) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+#if (NGX_TCP_SSL_EARLY_DATA)
+
+/*
+ * a replay repeats the ClientHello and so its random: the early data are
+ * rejected if the random has been seen within the window, and then
+ * the handshake goes on as a usual one
+ */
+
+static int
+ngx_tcp_ssl_allow_early_data(SSL *ssl_conn, void *arg)
+{
+    ngx_tcp_ssl_conf_t  *conf = arg;
+
+    int                          rc;
+    time_t                       now;
+    size_t                       len;
+    uint32_t                     hash;
+    ngx_queue_t                 *q;
+    ngx_connection_t            *c;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_tcp_ssl_replay_ctx_t    *ctx;
+    ngx_tcp_ssl_replay_node_t   *rn;
+    u_char                       random[SSL3_RANDOM_SIZE];
+
+    c = ngx_ssl_get_connection(ssl_conn);
+
+    len = SSL_get_client_random(ssl_conn, random, SSL3_RANDOM_SIZE);
+
+    if (len != SSL3_RANDOM_SIZE) {
+        return 0;
+    }
+
+    hash = ngx_crc32_short(random, SSL3_RANDOM_SIZE);
+
+    ctx = conf->early_data_zone->data;
+    now = ngx_time();
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    while (!ngx_queue_empty(&ctx->sh->queue)) {
+        q = ngx_queue_last(&ctx->sh->queue);
+        rn = ngx_queue_data(q, ngx_tcp_ssl_replay_node_t, queue);
+
+        if (rn->expire > now) {
+            break;
+        }
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&ctx->sh->rbtree, &rn->node);
+        ngx_slab_free_locked(ctx->shpool, rn);
+    }
+
+    node = ctx->sh->rbtree.root;
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash != node->key) {
+            node = (hash < node->key) ? node->left : node->right;
+            continue;
+        }
+
+        rn = (ngx_tcp_ssl_replay_node_t *) node;
+
+        rc = ngx_memcmp(random, rn->random, SSL3_RANDOM_SIZE);
+
+        if (rc == 0) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "replayed early data rejected");
+            return 0;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    rn = ngx_slab_alloc_locked(ctx->shpool,
+                               sizeof(ngx_tcp_ssl_replay_node_t));
+    if (rn == NULL) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        /* the random cannot be remembered, so the replay is possible */
+
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "early data rejected, zone \"%V\" is full",
+                      &conf->early_data_zone->shm.name);
+        return 0;
+    }
+
+    rn->node.key = hash;
+    rn->expire = now + NGX_TCP_SSL_REPLAY_WINDOW;
+    ngx_memcpy(rn->random, random, SSL3_RANDOM_SIZE);
+
+    ngx_rbtree_insert(&ctx->sh->rbtree, &rn->node);
+    ngx_queue_insert_head(&ctx->sh->queue, &rn->queue);
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    return 1;
+}
+
+#endif
@@ -0,0 +1,76 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#ifndef _NGX_TCP_SSL_MODULE_H_INCLUDED_
+#define _NGX_TCP_SSL_MODULE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/* OpenSSL hands the record layer over to the kernel, see "ssl_ktls" */
+
+#if (NGX_LINUX && defined SSL_OP_ENABLE_KTLS && defined BIO_get_ktls_send)
+#define NGX_TCP_SSL_KTLS  1
+#endif
+
+/* TLS 1.3 early data with the replays rejected, see "ssl_early_data" */
+
+#if (defined SSL_READ_EARLY_DATA_SUCCESS)
+#define NGX_TCP_SSL_EARLY_DATA  1
+#endif
+
+
+#define NGX_TCP_STARTTLS_OFF   0
+#define NGX_TCP_STARTTLS_ON    1
+#define NGX_TCP_STARTTLS_ONLY  2
+
+
+typedef struct {
+    ngx_flag_t              enable;
+    ngx_flag_t              prefer_server_ciphers;
+    ngx_flag_t              ktls;
+    ngx_flag_t              early_data;
+
+    ngx_ssl_t               ssl;
+
+    ngx_uint_t              starttls;
+    ngx_uint_t              protocols;
+
+    ssize_t                 builtin_session_cache;
+
+    time_t                  session_timeout;
+
+    ngx_str_t               dhparam;
+    ngx_str_t               ecdh_curve;
+    ngx_str_t               ciphers;
+
+    ngx_array_t            *certificates;
+    ngx_array_t            *certificate_keys;
+
+    ngx_array_t            *passwords;
+
+    /* the session cache shared by the workers */
+    ngx_shm_zone_t         *shm_zone;
+
+    /* the client randoms of the early data accepted recently */
+    ngx_shm_zone_t         *early_data_zone;
+
+    ngx_flag_t              session_tickets;
+
+    /* the first key encrypts the tickets, all of them decrypt */
+    ngx_array_t            *session_ticket_keys;
+
+    u_char                 *file;
+    ngx_uint_t              line;
+} ngx_tcp_ssl_conf_t;
+
+
+extern ngx_module_t  ngx_tcp_ssl_module;
+
+
+#endif /* _NGX_TCP_SSL_MODULE_H_INCLUDED_ */
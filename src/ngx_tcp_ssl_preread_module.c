@@ -0,0 +1,616 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_tcp.h>
+
+
+/*
+ * the ClientHello is read into the session buffer without terminating
+ * TLS: the server name it asks for chooses the upstream, and the buffer
+ * is then sent to the upstream as it is, followed by the encrypted stream
+ */
+
+
+#define NGX_TCP_SSL_RECORD_HEADER     5
+#define NGX_TCP_SSL_MAX_RECORD        16384
+#define NGX_TCP_SSL_HANDSHAKE         0x16
+#define NGX_TCP_SSL_CLIENT_HELLO      1
+#define NGX_TCP_SSL_EXT_SERVER_NAME   0
+#define NGX_TCP_SSL_EXT_ALPN          16
+
+#define ngx_tcp_ssl_preread_uint16(p)  (((p)[0] << 8) + (p)[1])
+
+
+static ngx_int_t ngx_tcp_ssl_preread_server_name(ngx_tcp_session_t *s,
+    u_char *p, u_char *last);
+static ngx_int_t ngx_tcp_ssl_preread_alpn(ngx_tcp_session_t *s, u_char *p,
+    u_char *last);
+static void *ngx_tcp_ssl_preread_create_conf(ngx_conf_t *cf);
+static char *ngx_tcp_ssl_preread_merge_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static char *ngx_tcp_ssl_preread_add_route(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static int ngx_libc_cdecl ngx_tcp_ssl_preread_cmp_dns_wildcards(
+    const void *one, const void *two);
+
+
+static ngx_command_t  ngx_tcp_ssl_preread_commands[] = {
+
+    { ngx_string("ssl_preread"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_preread_conf_t, enable),
+      NULL },
+
+    { ngx_string("ssl_preread_buffer_size"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_preread_conf_t, buffer_size),
+      NULL },
+
+    { ngx_string("ssl_preread_timeout"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_preread_conf_t, timeout),
+      NULL },
+
+    { ngx_string("ssl_preread_route_hash_max_size"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_preread_conf_t, hash_max_size),
+      NULL },
+
+    { ngx_string("ssl_preread_route_hash_bucket_size"),
+      NGX_TCP_MAIN_CONF|NGX_TCP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_TCP_SRV_CONF_OFFSET,
+      offsetof(ngx_tcp_ssl_preread_conf_t, hash_bucket_size),
+      NULL },
+
+    { ngx_string("ssl_preread_route"),
+      NGX_TCP_SRV_CONF|NGX_CONF_TAKE2,
+      ngx_tcp_ssl_preread_add_route,
+      NGX_TCP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_tcp_module_t  ngx_tcp_ssl_preread_module_ctx = {
+    NULL,                                  /* protocol */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_tcp_ssl_preread_create_conf,       /* create server configuration */
+    ngx_tcp_ssl_preread_merge_conf         /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_tcp_ssl_preread_module = {
+    NGX_MODULE_V1,
+    &ngx_tcp_ssl_preread_module_ctx,       /* module context */
+    ngx_tcp_ssl_preread_commands,          /* module directives */
+    NGX_TCP_MODULE,                        /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * only a ClientHello in the first record is parsed, a larger one is
+ * passed through with the default route
+ */
+
+ngx_int_t
+ngx_tcp_ssl_preread(ngx_tcp_session_t *s, u_char *pos, u_char *last)
+{
+    u_char            *p, *end, *ext;
+    size_t             n;
+    ngx_uint_t         type;
+    ngx_connection_t  *c;
+
+    c = s->connection;
+
+    if (pos < last
+        && (pos[0] != NGX_TCP_SSL_HANDSHAKE
+            || (last - pos > 1 && pos[1] != 3)))
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_CORE, c->log, 0,
+                       "tcp ssl preread: not a TLS handshake");
+        goto done;
+    }
+
+    if (last - pos < NGX_TCP_SSL_RECORD_HEADER) {
+        return NGX_AGAIN;
+    }
+
+    n = ngx_tcp_ssl_preread_uint16(&pos[3]);
+
+    if ((size_t) (last - pos) < NGX_TCP_SSL_RECORD_HEADER + n) {
+        return NGX_AGAIN;
+    }
+
+    p = pos + NGX_TCP_SSL_RECORD_HEADER;
+    end = p + n;
+
+    /* the handshake header */
+
+    if (end - p < 4 || p[0] != NGX_TCP_SSL_CLIENT_HELLO) {
+        goto invalid;
+    }
+
+    n = (p[1] << 16) + (p[2] << 8) + p[3];
+    p += 4;
+
+    if ((size_t) (end - p) < n) {
+        ngx_log_debug0(NGX_LOG_DEBUG_CORE, c->log, 0,
+                       "tcp ssl preread: ClientHello spans several records");
+        goto done;
+    }
+
+    end = p + n;
+
+    /* the version and the random */
+
+    if (end - p < 34) {
+        goto invalid;
+    }
+
+    p += 34;
+
+    /* the session id */
+
+    if (end - p < 1 || end - p - 1 < p[0]) {
+        goto invalid;
+    }
+
+    p += 1 + p[0];
+
+    /* the cipher suites */
+
+    if (end - p < 2) {
+        goto invalid;
+    }
+
+    n = ngx_tcp_ssl_preread_uint16(p);
+    p += 2;
+
+    if ((size_t) (end - p) < n) {
+        goto invalid;
+    }
+
+    p += n;
+
+    /* the compression methods */
+
+    if (end - p < 1 || end - p - 1 < p[0]) {
+        goto invalid;
+    }
+
+    p += 1 + p[0];
+
+    /* the extensions */
+
+    if (end - p < 2) {
+        goto done;
+    }
+
+    n = ngx_tcp_ssl_preread_uint16(p);
+    p += 2;
+
+    if ((size_t) (end - p) < n) {
+        goto invalid;
+    }
+
+    end = p + n;
+
+    while (end - p >= 4) {
+        type = ngx_tcp_ssl_preread_uint16(p);
+        n = ngx_tcp_ssl_preread_uint16(p + 2);
+        p += 4;
+
+        if ((size_t) (end - p) < n) {
+            goto invalid;
+        }
+
+        ext = p;
+        p += n;
+
+        switch (type) {
+
+        case NGX_TCP_SSL_EXT_SERVER_NAME:
+            if (ngx_tcp_ssl_preread_server_name(s, ext, p) != NGX_OK) {
+                goto invalid;
+            }
+
+            break;
+
+        case NGX_TCP_SSL_EXT_ALPN:
+            if (ngx_tcp_ssl_preread_alpn(s, ext, p) != NGX_OK) {
+                goto invalid;
+            }
+
+            break;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, c->log, 0,
+                   "tcp ssl preread: server name \"%V\", alpn \"%V\"",
+                   &s->host, &s->alpn);
+
+    goto done;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_INFO, c->log, 0, "client sent invalid ClientHello");
+
+done:
+
+    ngx_tcp_ssl_preread_route(s);
+
+    return NGX_OK;
+}
+
+
+/* the first host_name of the list, lowercased for the lookup */
+
+static ngx_int_t
+ngx_tcp_ssl_preread_server_name(ngx_tcp_session_t *s, u_char *p,
+    u_char *last)
+{
+    size_t  n;
+
+    if (last - p < 2
+        || (size_t) (last - p - 2) < (size_t) ngx_tcp_ssl_preread_uint16(p))
+    {
+        return NGX_ERROR;
+    }
+
+    last = p + 2 + ngx_tcp_ssl_preread_uint16(p);
+    p += 2;
+
+    while (last - p >= 3) {
+        n = ngx_tcp_ssl_preread_uint16(p + 1);
+
+        if ((size_t) (last - p - 3) < n) {
+            return NGX_ERROR;
+        }
+
+        if (p[0] == 0 && n) {
+            s->host.data = ngx_pnalloc(s->connection->pool, n);
+            if (s->host.data == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_strlow(s->host.data, p + 3, n);
+            s->host.len = n;
+
+            return NGX_OK;
+        }
+
+        p += 3 + n;
+    }
+
+    return NGX_OK;
+}
+
+
+/* the protocols are joined by commas, e.g. "h2,http/1.1" */
+
+static ngx_int_t
+ngx_tcp_ssl_preread_alpn(ngx_tcp_session_t *s, u_char *p, u_char *last)
+{
+    u_char  *d;
+    size_t   n;
+
+    if (last - p < 2
+        || (size_t) (last - p - 2) < (size_t) ngx_tcp_ssl_preread_uint16(p))
+    {
+        return NGX_ERROR;
+    }
+
+    n = ngx_tcp_ssl_preread_uint16(p);
+    last = p + 2 + n;
+    p += 2;
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    /* a length byte per protocol is enough for the commas */
+
+    d = ngx_pnalloc(s->connection->pool, n);
+    if (d == NULL) {
+        return NGX_ERROR;
+    }
+
+    s->alpn.data = d;
+
+    while (p < last) {
+        n = p[0];
+
+        if ((size_t) (last - p - 1) < n) {
+            return NGX_ERROR;
+        }
+
+        if (d != s->alpn.data) {
+            *d++ = ',';
+        }
+
+        d = ngx_cpymem(d, p + 1, n);
+        p += 1 + n;
+    }
+
+    s->alpn.len = d - s->alpn.data;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_tcp_ssl_preread_route(ngx_tcp_session_t *s)
+{
+    ngx_tcp_ssl_preread_conf_t   *spcf;
+    ngx_tcp_upstream_srv_conf_t  *uscf;
+
+    spcf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_ssl_preread_module);
+
+    uscf = NULL;
+
+    if (s->host.len) {
+        uscf = ngx_hash_find_combined(&spcf->routes,
+                                      ngx_hash_key(s->host.data, s->host.len),
+                                      s->host.data, s->host.len);
+    }
+
+    if (uscf == NULL) {
+        uscf = spcf->default_upstream;
+    }
+
+    if (uscf) {
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, s->connection->log, 0,
+                       "tcp ssl preread: upstream \"%V\"", &uscf->host);
+    }
+
+    s->upstream = uscf;
+}
+
+
+static void *
+ngx_tcp_ssl_preread_create_conf(ngx_conf_t *cf)
+{
+    ngx_tcp_ssl_preread_conf_t  *spcf;
+
+    spcf = ngx_pcalloc(cf->pool, sizeof(ngx_tcp_ssl_preread_conf_t));
+    if (spcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     spcf->routes = { NULL, ... };
+     *     spcf->keys = NULL;
+     *     spcf->default_upstream = NULL;
+     */
+
+    spcf->enable = NGX_CONF_UNSET;
+    spcf->buffer_size = NGX_CONF_UNSET_SIZE;
+    spcf->timeout = NGX_CONF_UNSET_MSEC;
+    spcf->hash_max_size = NGX_CONF_UNSET_UINT;
+    spcf->hash_bucket_size = NGX_CONF_UNSET_UINT;
+
+    return spcf;
+}
+
+
+static char *
+ngx_tcp_ssl_preread_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_tcp_ssl_preread_conf_t *prev = parent;
+    ngx_tcp_ssl_preread_conf_t *conf = child;
+
+    ngx_hash_init_t          hash;
+    ngx_hash_keys_arrays_t  *keys;
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+
+    /* the default fits the largest record with its header */
+
+    ngx_conf_merge_size_value(conf->buffer_size, prev->buffer_size,
+                              NGX_TCP_SSL_RECORD_HEADER
+                              + NGX_TCP_SSL_MAX_RECORD);
+
+    ngx_conf_merge_msec_value(conf->timeout, prev->timeout, 30000);
+    ngx_conf_merge_uint_value(conf->hash_max_size, prev->hash_max_size, 512);
+    ngx_conf_merge_uint_value(conf->hash_bucket_size, prev->hash_bucket_size,
+                              64);
+
+    keys = conf->keys;
+
+    if (keys == NULL) {
+        return NGX_CONF_OK;
+    }
+
+    if (!conf->enable) {
+        ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                      "\"ssl_preread_route\" is ignored without "
+                      "\"ssl_preread on\"");
+    }
+
+    hash.key = ngx_hash_key;
+    hash.max_size = conf->hash_max_size;
+    hash.bucket_size = ngx_align(conf->hash_bucket_size, ngx_cacheline_size);
+
+    /* the errors name the directives to raise */
+
+    hash.name = "ssl_preread_route_hash";
+    hash.pool = cf->pool;
+
+    if (keys->keys.nelts) {
+        hash.hash = &conf->routes.hash;
+        hash.temp_pool = NULL;
+
+        if (ngx_hash_init(&hash, keys->keys.elts, keys->keys.nelts) != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (keys->dns_wc_head.nelts) {
+
+        ngx_qsort(keys->dns_wc_head.elts,
+                  (size_t) keys->dns_wc_head.nelts,
+                  sizeof(ngx_hash_key_t),
+                  ngx_tcp_ssl_preread_cmp_dns_wildcards);
+
+        hash.hash = NULL;
+        hash.temp_pool = cf->temp_pool;
+
+        if (ngx_hash_wildcard_init(&hash, keys->dns_wc_head.elts,
+                                   keys->dns_wc_head.nelts)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        conf->routes.wc_head = (ngx_hash_wildcard_t *) hash.hash;
+    }
+
+    if (keys->dns_wc_tail.nelts) {
+
+        ngx_qsort(keys->dns_wc_tail.elts,
+                  (size_t) keys->dns_wc_tail.nelts,
+                  sizeof(ngx_hash_key_t),
+                  ngx_tcp_ssl_preread_cmp_dns_wildcards);
+
+        hash.hash = NULL;
+        hash.temp_pool = cf->temp_pool;
+
+        if (ngx_hash_wildcard_init(&hash, keys->dns_wc_tail.elts,
+                                   keys->dns_wc_tail.nelts)
+            != NGX_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+        conf->routes.wc_tail = (ngx_hash_wildcard_t *) hash.hash;
+    }
+
+    /* the keys are in the temporary pool */
+
+    conf->keys = NULL;
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * "ssl_preread_route name upstream", the name is as in "server_name":
+ * "example.com", "*.example.com", ".example.com", "www.example.*",
+ * or "default" for the names not listed and the clients without SNI
+ */
+
+static char *
+ngx_tcp_ssl_preread_add_route(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_tcp_ssl_preread_conf_t  *spcf = conf;
+
+    ngx_int_t                     rc;
+    ngx_str_t                    *value, name;
+    ngx_url_t                     u;
+    ngx_tcp_upstream_srv_conf_t  *uscf;
+
+    value = cf->args->elts;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[2];
+    u.no_resolve = 1;
+
+    uscf = ngx_tcp_upstream_add(cf, &u, 0);
+    if (uscf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_strcmp(value[1].data, "default") == 0) {
+
+        if (spcf->default_upstream) {
+            return "has duplicate default route";
+        }
+
+        spcf->default_upstream = uscf;
+
+        return NGX_CONF_OK;
+    }
+
+    if (spcf->keys == NULL) {
+        spcf->keys = ngx_pcalloc(cf->temp_pool,
+                                 sizeof(ngx_hash_keys_arrays_t));
+        if (spcf->keys == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        spcf->keys->pool = cf->pool;
+        spcf->keys->temp_pool = cf->temp_pool;
+
+        if (ngx_hash_keys_array_init(spcf->keys, NGX_HASH_SMALL) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    name = value[1];
+    ngx_strlow(name.data, name.data, name.len);
+
+    rc = ngx_hash_add_key(spcf->keys, &name, uscf, NGX_HASH_WILDCARD_KEY);
+
+    if (rc == NGX_OK) {
+        return NGX_CONF_OK;
+    }
+
+    if (rc == NGX_DECLINED) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid server name \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (rc == NGX_BUSY) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate route for \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_ERROR;
+}
+
+
+static int ngx_libc_cdecl
+ngx_tcp_ssl_preread_cmp_dns_wildcards(const void *one, const void *two)
+{
+    ngx_hash_key_t  *first, *second;
+
+    first = (ngx_hash_key_t *) one;
+    second = (ngx_hash_key_t *) two;
+
+    return ngx_dns_strcmp(first->key.data, second->key.data);
+}
@@ -0,0 +1,47 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#ifndef _NGX_TCP_SSL_PREREAD_MODULE_H_INCLUDED_
+#define _NGX_TCP_SSL_PREREAD_MODULE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+typedef struct {
+    ngx_flag_t                    enable;
+    size_t                        buffer_size;
+    ngx_msec_t                    timeout;
+
+    /* the server names to ngx_tcp_upstream_srv_conf_t */
+    ngx_hash_combined_t           routes;
+    ngx_hash_keys_arrays_t       *keys;
+    ngx_uint_t                    hash_max_size;
+    ngx_uint_t                    hash_bucket_size;
+
+    ngx_tcp_upstream_srv_conf_t  *default_upstream;
+} ngx_tcp_ssl_preread_conf_t;
+
+
+/*
+ * parses the ClientHello at the start of the data read: NGX_AGAIN if it
+ * is incomplete, NGX_OK otherwise, even if the data are not TLS; sets
+ * s->host, s->alpn and s->upstream from the SNI and ALPN extensions
+ */
+
+ngx_int_t ngx_tcp_ssl_preread(ngx_tcp_session_t *s, u_char *pos,
+    u_char *last);
+
+/* sets s->upstream from s->host, or to the default route */
+
+void ngx_tcp_ssl_preread_route(ngx_tcp_session_t *s);
+
+
+extern ngx_module_t  ngx_tcp_ssl_preread_module;
+
+
+#endif /* _NGX_TCP_SSL_PREREAD_MODULE_H_INCLUDED_ */
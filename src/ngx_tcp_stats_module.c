@@ -0,0 +1,884 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_tcp.h>
+
+
+/* the generations of workers that a block has slots for */
+#define NGX_TCP_STATS_GENERATIONS  4
+
+
+typedef struct {
+    ngx_shm_zone_t                 *shm_zone;
+    ngx_tcp_stats_shctx_t          *sh;
+
+    ngx_tcp_core_main_conf_t       *cmcf;
+    ngx_cycle_t                    *cycle;
+} ngx_tcp_stats_main_conf_t;
+
+
+static ngx_int_t ngx_tcp_stats_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_uint_t ngx_tcp_stats_free_slots(ngx_tcp_stats_shctx_t *sh);
+static void ngx_tcp_stats_free_unused(ngx_slab_pool_t *shpool,
+    ngx_tcp_stats_shctx_t *sh);
+static ngx_int_t ngx_tcp_stats_init_process(ngx_cycle_t *cycle);
+static void ngx_tcp_stats_exit_process(ngx_cycle_t *cycle);
+static ngx_int_t ngx_tcp_stats_init_session_handler(ngx_tcp_session_t *s);
+static void ngx_tcp_stats_process_session(ngx_tcp_session_t *s);
+static void ngx_tcp_stats_write_handler(ngx_event_t *wev);
+static ngx_buf_t *ngx_tcp_stats_dump(ngx_tcp_session_t *s,
+    ngx_tcp_stats_main_conf_t *smcf);
+static u_char *ngx_tcp_stats_dump_counters(u_char *p,
+    ngx_tcp_stats_shctx_t *sh, ngx_uint_t n);
+static u_char *ngx_tcp_stats_dump_latency(u_char *p,
+    ngx_tcp_stats_shctx_t *sh, ngx_uint_t n);
+static ngx_uint_t ngx_tcp_stats_bucket(uint64_t usec);
+static uint64_t ngx_tcp_stats_bucket_max(ngx_uint_t i);
+static void *ngx_tcp_stats_create_main_conf(ngx_conf_t *cf);
+static char *ngx_tcp_stats_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_tcp_stats_commands[] = {
+
+    { ngx_string("stats_zone"),
+      NGX_TCP_MAIN_CONF|NGX_CONF_TAKE2,
+      ngx_tcp_stats_zone,
+      NGX_TCP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_tcp_protocol_t  ngx_tcp_stats_protocol = {
+    ngx_string("stats"),
+    ngx_tcp_stats_init_session_handler,
+    NULL,
+    ngx_tcp_stats_process_session,
+    NULL,
+    NULL,
+    0
+};
+
+
+static ngx_tcp_module_t  ngx_tcp_stats_module_ctx = {
+    &ngx_tcp_stats_protocol,               /* protocol */
+
+    ngx_tcp_stats_create_main_conf,        /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL                                   /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_tcp_stats_module = {
+    NGX_MODULE_V1,
+    &ngx_tcp_stats_module_ctx,             /* module context */
+    ngx_tcp_stats_commands,                /* module directives */
+    NGX_TCP_MODULE,                        /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_tcp_stats_init_process,            /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    ngx_tcp_stats_exit_process,            /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/* the slot of this worker, NULL if there is no stats zone */
+ngx_tcp_stats_worker_t           *ngx_tcp_stats_worker;
+
+static ngx_tcp_stats_counters_t  *ngx_tcp_stats_counters;
+static ngx_atomic_uint_t         *ngx_tcp_stats_hists;
+static ngx_uint_t                 ngx_tcp_stats_nservers;
+
+
+static ngx_str_t  ngx_tcp_stats_hist_names[] = {
+    ngx_string("accept"),
+    ngx_string("handshake"),
+    ngx_string("connect"),
+    ngx_string("session")
+};
+
+
+/* the percentiles exported, in thousandths */
+
+static ngx_uint_t  ngx_tcp_stats_percentiles[] = { 500, 900, 990, 999 };
+
+
+#define NGX_TCP_STATS_COUNTERS_LEN                                           \
+    (sizeof("\"accepted\":,\"handled\":,\"active\":,\"failed\":,"            \
+            "\"bytes_in\":,\"bytes_out\":,\"ssl_handshakes\":,"              \
+            "\"ssl_session_reuses\":,\"ssl_ktls\":,"                         \
+            "\"upstream_failures\":,\"handshake_timeouts\":,"                \
+            "\"read_timeouts\":,\"send_timeouts\":,"                         \
+            "\"connect_timeouts\":,\"proxy_timeouts\":")                     \
+     - 1 + 15 * NGX_ATOMIC_T_LEN)
+
+#define NGX_TCP_STATS_LATENCY_LEN                                            \
+    (sizeof(",\"latency\":{}") - 1                                           \
+     + NGX_TCP_STATS_NHISTS                                                  \
+       * (sizeof(",\"handshake\":{\"count\":,\"p50\":,\"p90\":,\"p99\":,"    \
+                 "\"p99.9\":}") - 1                                          \
+          + 5 * NGX_ATOMIC_T_LEN))
+
+
+#define ngx_tcp_stats_slot(sh, n)                                            \
+    ((ngx_tcp_stats_worker_t *) ((sh)->slots + (n) * (sh)->slot_size))
+
+#define ngx_tcp_stats_slot_hists(sh, slot)                                   \
+    ((ngx_atomic_uint_t *)                                                   \
+        (ngx_tcp_stats_slot_counters(slot) + (sh)->nservers + (sh)->naddrs))
+
+
+void
+ngx_tcp_stats_init_session(ngx_tcp_session_t *s, ngx_uint_t addr_index)
+{
+    ngx_tcp_core_srv_conf_t  *cscf;
+
+    if (ngx_tcp_stats_counters == NULL) {
+        return;
+    }
+
+    cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+
+    s->stats = &ngx_tcp_stats_counters[cscf->index];
+    s->addr_stats = &ngx_tcp_stats_counters[ngx_tcp_stats_nservers
+                                            + addr_index];
+    s->hists = ngx_tcp_stats_hists
+               + cscf->index * NGX_TCP_STATS_NHISTS * NGX_TCP_STATS_BUCKETS;
+}
+
+
+uint64_t
+ngx_tcp_stats_now(void)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+void
+ngx_tcp_stats_record_time(ngx_atomic_uint_t *hists, ngx_uint_t hist,
+    uint64_t start)
+{
+    uint64_t  now;
+
+    now = ngx_tcp_stats_now();
+
+    /* the clock may step back */
+
+    if (now < start) {
+        now = start;
+    }
+
+    hists[hist * NGX_TCP_STATS_BUCKETS + ngx_tcp_stats_bucket(now - start)]++;
+}
+
+
+static ngx_uint_t
+ngx_tcp_stats_bucket(uint64_t usec)
+{
+    ngx_uint_t  i, m;
+
+    if (usec < 16) {
+        return (ngx_uint_t) usec;
+    }
+
+    /* m is the highest bit set, the next 3 bits select the sub-bucket */
+
+    for (m = 4; usec >> (m + 1); m++) { /* void */ }
+
+    i = 16 + (m - 4) * 8 + (ngx_uint_t) ((usec >> (m - 3)) & 7);
+
+    return (i < NGX_TCP_STATS_BUCKETS) ? i : NGX_TCP_STATS_BUCKETS - 1;
+}
+
+
+static uint64_t
+ngx_tcp_stats_bucket_max(ngx_uint_t i)
+{
+    ngx_uint_t  m, sub;
+
+    if (i < 16) {
+        return i;
+    }
+
+    m = (i - 16) / 8 + 4;
+    sub = (i - 16) % 8;
+
+    return ((uint64_t) (8 + sub + 1) << (m - 3)) - 1;
+}
+
+
+static ngx_int_t
+ngx_tcp_stats_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_tcp_stats_main_conf_t  *osmcf = data;
+
+    size_t                      size;
+    ngx_uint_t                  nslots, nservers, naddrs, nworkers;
+    ngx_core_conf_t            *ccf;
+    ngx_slab_pool_t            *shpool;
+    ngx_tcp_stats_shctx_t      *sh, *same;
+    ngx_tcp_stats_main_conf_t  *smcf;
+
+    smcf = shm_zone->data;
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(smcf->cycle->conf_ctx,
+                                           ngx_core_module);
+
+    /*
+     * the workers of the previous cycles keep their slots while exiting,
+     * so there are slots for a few reloads in a row
+     */
+
+    nworkers = ccf->worker_processes > 0 ? ccf->worker_processes : 1;
+    nslots = NGX_TCP_STATS_GENERATIONS * nworkers;
+    nservers = smcf->cmcf->servers.nelts;
+    naddrs = smcf->cmcf->addrs.nelts;
+
+    size = ngx_align(sizeof(ngx_tcp_stats_worker_t), NGX_CPU_CACHE_LINE)
+           + (nservers + naddrs) * sizeof(ngx_tcp_stats_counters_t)
+           + nservers * NGX_TCP_STATS_NHISTS * NGX_TCP_STATS_BUCKETS
+             * sizeof(ngx_atomic_uint_t);
+    size = ngx_align(size, NGX_CPU_CACHE_LINE);
+
+    same = NULL;
+
+    if (osmcf && osmcf->sh) {
+        sh = osmcf->sh;
+
+        if (sh->nslots == nslots
+            && sh->nservers == nservers
+            && sh->naddrs == naddrs
+            && sh->slot_size == size)
+        {
+            if (ngx_tcp_stats_free_slots(sh) >= nworkers) {
+                smcf->sh = sh;
+                return NGX_OK;
+            }
+
+            same = sh;
+        }
+
+        /*
+         * the layout has changed, or the slots are still taken by the
+         * workers of the previous reloads: the old workers still write to
+         * the old slots, so the old block is kept until they have exited,
+         * and the blocks of the layouts before it are freed if they have
+         */
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        smcf->sh = shpool->data;
+        return NGX_OK;
+    }
+
+    if (osmcf && osmcf->sh) {
+        ngx_tcp_stats_free_unused(shpool, osmcf->sh);
+    }
+
+    sh = ngx_slab_alloc(shpool, sizeof(ngx_tcp_stats_shctx_t)
+                                + NGX_CPU_CACHE_LINE + nslots * size);
+
+    if (sh == NULL && same) {
+        ngx_log_error(NGX_LOG_WARN, shm_zone->shm.log, 0,
+                      "tcp stats zone \"%V\" is too small for another "
+                      "block, the new workers may be left without slots",
+                      &shm_zone->shm.name);
+
+        smcf->sh = same;
+        return NGX_OK;
+    }
+
+    if (sh == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "tcp stats zone \"%V\" is too small for %ui servers "
+                      "and %ui listen addresses",
+                      &shm_zone->shm.name, nservers, naddrs);
+        return NGX_ERROR;
+    }
+
+    sh->nslots = nslots;
+    sh->nservers = nservers;
+    sh->naddrs = naddrs;
+    sh->slot_size = size;
+
+    /* the slots of the workers do not share cache lines */
+
+    sh->slots = ngx_align_ptr((u_char *) sh + sizeof(ngx_tcp_stats_shctx_t),
+                              NGX_CPU_CACHE_LINE);
+
+    ngx_memzero(sh->slots, nslots * size);
+
+    sh->prev = (osmcf && osmcf->sh) ? osmcf->sh : NULL;
+
+    shpool->data = sh;
+    smcf->sh = sh;
+
+    return NGX_OK;
+}
+
+
+/* the slots that are free, or left by the workers that have died */
+
+static ngx_uint_t
+ngx_tcp_stats_free_slots(ngx_tcp_stats_shctx_t *sh)
+{
+    ngx_pid_t                pid;
+    ngx_uint_t               i, n;
+    ngx_tcp_stats_worker_t  *w;
+
+    n = 0;
+
+    for (i = 0; i < sh->nslots; i++) {
+        w = ngx_tcp_stats_slot(sh, i);
+
+        pid = (ngx_pid_t) w->pid;
+
+        if (pid == 0 || (kill(pid, 0) == -1 && ngx_errno == NGX_ESRCH)) {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+
+/*
+ * frees the blocks of the previous layouts older than sh whose slots are
+ * no longer used: each worker releases its slot on exit, and the slot of
+ * a worker that has died is checked with kill()
+ */
+
+static void
+ngx_tcp_stats_free_unused(ngx_slab_pool_t *shpool, ngx_tcp_stats_shctx_t *sh)
+{
+    ngx_pid_t                pid;
+    ngx_uint_t               i;
+    ngx_tcp_stats_shctx_t   *prev;
+    ngx_tcp_stats_worker_t  *w;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    while (sh->prev) {
+        prev = sh->prev;
+
+        for (i = 0; i < prev->nslots; i++) {
+            w = ngx_tcp_stats_slot(prev, i);
+
+            pid = (ngx_pid_t) w->pid;
+
+            if (pid && (kill(pid, 0) == 0 || ngx_errno != NGX_ESRCH)) {
+                break;
+            }
+        }
+
+        if (i < prev->nslots) {
+            sh = prev;
+            continue;
+        }
+
+        sh->prev = prev->prev;
+
+        ngx_slab_free_locked(shpool, prev);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+static ngx_int_t
+ngx_tcp_stats_init_process(ngx_cycle_t *cycle)
+{
+    ngx_pid_t                   pid;
+    ngx_uint_t                  i, n;
+    ngx_tcp_stats_shctx_t      *sh;
+    ngx_tcp_stats_worker_t     *w;
+    ngx_tcp_stats_counters_t   *counters;
+    ngx_tcp_stats_main_conf_t  *smcf;
+
+    smcf = ngx_tcp_cycle_get_module_main_conf(cycle, ngx_tcp_stats_module);
+
+    if (smcf == NULL || smcf->sh == NULL) {
+        return NGX_OK;
+    }
+
+    sh = smcf->sh;
+
+    /*
+     * a free slot is claimed, or the slot of a worker that has died
+     * without releasing it; the totals of the slot are kept
+     */
+
+    for (i = 0; i < sh->nslots; i++) {
+        w = ngx_tcp_stats_slot(sh, i);
+
+        pid = (ngx_pid_t) w->pid;
+
+        if (pid == 0) {
+            if (ngx_atomic_cmp_set(&w->pid, 0, ngx_pid)) {
+                goto found;
+            }
+
+            continue;
+        }
+
+        if (kill(pid, 0) == -1
+            && ngx_errno == NGX_ESRCH
+            && ngx_atomic_cmp_set(&w->pid, pid, ngx_pid))
+        {
+            goto found;
+        }
+    }
+
+    ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                  "no free slot in tcp stats zone \"%V\"",
+                  &smcf->shm_zone->shm.name);
+
+    return NGX_OK;
+
+found:
+
+    counters = ngx_tcp_stats_slot_counters(w);
+
+    n = sh->nservers + sh->naddrs;
+
+    for (i = 0; i < n; i++) {
+        counters[i].active = 0;
+    }
+
+    ngx_tcp_stats_worker = w;
+    ngx_tcp_stats_counters = counters;
+    ngx_tcp_stats_hists = ngx_tcp_stats_slot_hists(sh, w);
+    ngx_tcp_stats_nservers = sh->nservers;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_tcp_stats_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                  i, n;
+    ngx_slab_pool_t            *shpool;
+    ngx_tcp_stats_counters_t   *counters;
+    ngx_tcp_stats_main_conf_t  *smcf;
+
+    if (ngx_tcp_stats_worker == NULL) {
+        return;
+    }
+
+    smcf = ngx_tcp_cycle_get_module_main_conf(cycle, ngx_tcp_stats_module);
+
+    /* the sessions left open are not closed through the usual path */
+
+    counters = ngx_tcp_stats_counters;
+
+    n = smcf->sh->nservers + smcf->sh->naddrs;
+
+    for (i = 0; i < n; i++) {
+        counters[i].active = 0;
+    }
+
+    ngx_tcp_stats_worker->pid = 0;
+
+    /* the last worker of an old layout frees its block */
+
+    shpool = (ngx_slab_pool_t *) smcf->shm_zone->shm.addr;
+
+    if (smcf->sh != shpool->data) {
+        ngx_tcp_stats_free_unused(shpool, shpool->data);
+    }
+
+    ngx_tcp_stats_worker = NULL;
+    ngx_tcp_stats_counters = NULL;
+    ngx_tcp_stats_hists = NULL;
+}
+
+
+static ngx_int_t
+ngx_tcp_stats_init_session_handler(ngx_tcp_session_t *s)
+{
+    ngx_tcp_stats_main_conf_t  *smcf;
+
+    smcf = ngx_tcp_get_module_main_conf(s, ngx_tcp_stats_module);
+
+    if (smcf->sh == NULL) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "no \"stats_zone\" is defined");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_tcp_stats_process_session(ngx_tcp_session_t *s)
+{
+    ngx_connection_t           *c;
+    ngx_tcp_stats_main_conf_t  *smcf;
+
+    c = s->connection;
+
+    smcf = ngx_tcp_get_module_main_conf(s, ngx_tcp_stats_module);
+
+    s->buffer = ngx_tcp_stats_dump(s, smcf);
+    if (s->buffer == NULL) {
+        ngx_tcp_internal_server_error(s);
+        return;
+    }
+
+    c->log->action = "sending statistics";
+
+    c->write->handler = ngx_tcp_stats_write_handler;
+
+    ngx_tcp_stats_write_handler(c->write);
+}
+
+
+static void
+ngx_tcp_stats_write_handler(ngx_event_t *wev)
+{
+    ssize_t                   n;
+    ngx_buf_t                *b;
+    ngx_connection_t         *c;
+    ngx_tcp_session_t        *s;
+    ngx_tcp_core_srv_conf_t  *cscf;
+
+    c = wev->data;
+    s = c->data;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT, "client timed out");
+        ngx_tcp_stats_inc(s, send_timeouts);
+        c->timedout = 1;
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    b = s->buffer;
+
+    n = c->send(c, b->pos, b->last - b->pos);
+
+    if (n == NGX_ERROR) {
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    if (n > 0) {
+        b->pos += n;
+    }
+
+    if (b->pos == b->last) {
+        ngx_tcp_close_connection(c);
+        return;
+    }
+
+    cscf = ngx_tcp_get_module_srv_conf(s, ngx_tcp_core_module);
+
+    ngx_tcp_add_idle_timer(s, wev, cscf->send_timeout);
+
+    if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+        ngx_tcp_close_connection(c);
+    }
+}
+
+
+static ngx_buf_t *
+ngx_tcp_stats_dump(ngx_tcp_session_t *s, ngx_tcp_stats_main_conf_t *smcf)
+{
+    u_char                    *p;
+    size_t                     size;
+    ngx_buf_t                 *b;
+    ngx_uint_t                 i, j, first;
+    ngx_atomic_uint_t          accepted;
+    ngx_tcp_addr_conf_t      **addrs;
+    ngx_tcp_stats_shctx_t     *sh;
+    ngx_tcp_stats_worker_t    *w;
+    ngx_tcp_stats_counters_t  *c;
+    ngx_tcp_core_srv_conf_t  **cscfp;
+
+    sh = smcf->sh;
+    cscfp = smcf->cmcf->servers.elts;
+    addrs = smcf->cmcf->addrs.elts;
+
+    size = sizeof("{\"workers\":[],\"servers\":[],\"listen\":[]}" CRLF) - 1
+           + sh->nslots * (sizeof(",{\"pid\":,\"accepted\":,"
+                                  "\"session_hits\":,\"session_misses\":}")
+                           - 1 + 4 * NGX_ATOMIC_T_LEN);
+
+    for (i = 0; i < sh->nservers; i++) {
+        size += sizeof(",{\"name\":\"\",}") - 1 + cscfp[i]->server_name.len
+                + NGX_TCP_STATS_COUNTERS_LEN + NGX_TCP_STATS_LATENCY_LEN;
+    }
+
+    for (i = 0; i < sh->naddrs; i++) {
+        size += sizeof(",{\"address\":\"\",}") - 1 + addrs[i]->addr_text.len
+                + NGX_TCP_STATS_COUNTERS_LEN;
+    }
+
+    b = ngx_create_temp_buf(s->connection->pool, size);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    p = ngx_cpymem(b->last, "{\"workers\":[", sizeof("{\"workers\":[") - 1);
+
+    first = 1;
+
+    for (i = 0; i < sh->nslots; i++) {
+        w = ngx_tcp_stats_slot(sh, i);
+
+        if (w->pid == 0) {
+            continue;
+        }
+
+        /* the connections accepted by the worker, e.g. to see "reuseport" */
+
+        c = ngx_tcp_stats_slot_counters(w);
+        accepted = 0;
+
+        for (j = 0; j < sh->nservers; j++) {
+            accepted += c[j].accepted;
+        }
+
+        p = ngx_sprintf(p, "%s{\"pid\":%P,\"accepted\":%uA,"
+                        "\"session_hits\":%uA,\"session_misses\":%uA}",
+                        first ? "" : ",", (ngx_pid_t) w->pid, accepted,
+                        w->session_hits, w->session_misses);
+        first = 0;
+    }
+
+    p = ngx_cpymem(p, "],\"servers\":[", sizeof("],\"servers\":[") - 1);
+
+    for (i = 0; i < sh->nservers; i++) {
+        p = ngx_sprintf(p, "%s{\"name\":\"%V\",",
+                        i ? "," : "", &cscfp[i]->server_name);
+        p = ngx_tcp_stats_dump_counters(p, sh, i);
+        p = ngx_tcp_stats_dump_latency(p, sh, i);
+        *p++ = '}';
+    }
+
+    p = ngx_cpymem(p, "],\"listen\":[", sizeof("],\"listen\":[") - 1);
+
+    for (i = 0; i < sh->naddrs; i++) {
+        p = ngx_sprintf(p, "%s{\"address\":\"%V\",",
+                        i ? "," : "", &addrs[i]->addr_text);
+        p = ngx_tcp_stats_dump_counters(p, sh, sh->nservers + i);
+        *p++ = '}';
+    }
+
+    p = ngx_cpymem(p, "]}" CRLF, sizeof("]}" CRLF) - 1);
+
+    b->last = p;
+
+    return b;
+}
+
+
+/* the object n summed over all slots, including those of exited workers */
+
+static u_char *
+ngx_tcp_stats_dump_counters(u_char *p, ngx_tcp_stats_shctx_t *sh,
+    ngx_uint_t n)
+{
+    ngx_uint_t                 i;
+    ngx_tcp_stats_counters_t  *c, sum;
+
+    ngx_memzero(&sum, sizeof(ngx_tcp_stats_counters_t));
+
+    for (i = 0; i < sh->nslots; i++) {
+        c = &ngx_tcp_stats_slot_counters(ngx_tcp_stats_slot(sh, i))[n];
+
+        sum.accepted += c->accepted;
+        sum.handled += c->handled;
+        sum.active += c->active;
+        sum.failed += c->failed;
+        sum.bytes_in += c->bytes_in;
+        sum.bytes_out += c->bytes_out;
+        sum.ssl_handshakes += c->ssl_handshakes;
+        sum.ssl_session_reuses += c->ssl_session_reuses;
+        sum.ssl_ktls += c->ssl_ktls;
+        sum.upstream_failures += c->upstream_failures;
+        sum.handshake_timeouts += c->handshake_timeouts;
+        sum.read_timeouts += c->read_timeouts;
+        sum.send_timeouts += c->send_timeouts;
+        sum.connect_timeouts += c->connect_timeouts;
+        sum.proxy_timeouts += c->proxy_timeouts;
+    }
+
+    return ngx_sprintf(p, "\"accepted\":%uA,\"handled\":%uA,\"active\":%uA,"
+                       "\"failed\":%uA,\"bytes_in\":%uA,\"bytes_out\":%uA,"
+                       "\"ssl_handshakes\":%uA,\"ssl_session_reuses\":%uA,"
+                       "\"ssl_ktls\":%uA,\"upstream_failures\":%uA,"
+                       "\"handshake_timeouts\":%uA,\"read_timeouts\":%uA,"
+                       "\"send_timeouts\":%uA,\"connect_timeouts\":%uA,"
+                       "\"proxy_timeouts\":%uA",
+                       sum.accepted, sum.handled, sum.active, sum.failed,
+                       sum.bytes_in, sum.bytes_out, sum.ssl_handshakes,
+                       sum.ssl_session_reuses, sum.ssl_ktls,
+                       sum.upstream_failures, sum.handshake_timeouts,
+                       sum.read_timeouts, sum.send_timeouts,
+                       sum.connect_timeouts, sum.proxy_timeouts);
+}
+
+
+/* the percentiles are the upper bounds of the buckets, in microseconds */
+
+static u_char *
+ngx_tcp_stats_dump_latency(u_char *p, ngx_tcp_stats_shctx_t *sh,
+    ngx_uint_t n)
+{
+    uint64_t            rank;
+    ngx_uint_t          h, i, j, k;
+    ngx_atomic_uint_t  *hist, total, sum;
+    ngx_atomic_uint_t   buckets[NGX_TCP_STATS_BUCKETS];
+
+    p = ngx_cpymem(p, ",\"latency\":{", sizeof(",\"latency\":{") - 1);
+
+    for (h = 0; h < NGX_TCP_STATS_NHISTS; h++) {
+
+        ngx_memzero(buckets, sizeof(buckets));
+
+        for (i = 0; i < sh->nslots; i++) {
+            hist = ngx_tcp_stats_slot_hists(sh, ngx_tcp_stats_slot(sh, i))
+                   + (n * NGX_TCP_STATS_NHISTS + h) * NGX_TCP_STATS_BUCKETS;
+
+            for (j = 0; j < NGX_TCP_STATS_BUCKETS; j++) {
+                buckets[j] += hist[j];
+            }
+        }
+
+        total = 0;
+
+        for (j = 0; j < NGX_TCP_STATS_BUCKETS; j++) {
+            total += buckets[j];
+        }
+
+        p = ngx_sprintf(p, "%s\"%V\":{\"count\":%uA",
+                        h ? "," : "", &ngx_tcp_stats_hist_names[h], total);
+
+        sum = 0;
+        j = 0;
+
+        for (k = 0;
+             k < sizeof(ngx_tcp_stats_percentiles) / sizeof(ngx_uint_t);
+             k++)
+        {
+            rank = ((uint64_t) total * ngx_tcp_stats_percentiles[k] + 999)
+                   / 1000;
+
+            while (j < NGX_TCP_STATS_BUCKETS && sum + buckets[j] < rank) {
+                sum += buckets[j];
+                j++;
+            }
+
+            if (ngx_tcp_stats_percentiles[k] % 10) {
+                p = ngx_sprintf(p, ",\"p%ui.%ui\":%uL",
+                                ngx_tcp_stats_percentiles[k] / 10,
+                                ngx_tcp_stats_percentiles[k] % 10,
+                                total ? ngx_tcp_stats_bucket_max(j) : 0);
+
+            } else {
+                p = ngx_sprintf(p, ",\"p%ui\":%uL",
+                                ngx_tcp_stats_percentiles[k] / 10,
+                                total ? ngx_tcp_stats_bucket_max(j) : 0);
+            }
+        }
+
+        *p++ = '}';
+    }
+
+    *p++ = '}';
+
+    return p;
+}
+
+
+static void *
+ngx_tcp_stats_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_tcp_stats_main_conf_t  *smcf;
+
+    smcf = ngx_pcalloc(cf->pool, sizeof(ngx_tcp_stats_main_conf_t));
+    if (smcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     smcf->shm_zone = NULL;
+     *     smcf->sh = NULL;
+     */
+
+    return smcf;
+}
+
+
+static char *
+ngx_tcp_stats_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_tcp_stats_main_conf_t *smcf = conf;
+
+    ssize_t     size;
+    ngx_str_t  *value;
+
+    if (smcf->shm_zone) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[2]);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    smcf->shm_zone = ngx_shared_memory_add(cf, &value[1], size,
+                                           &ngx_tcp_stats_module);
+    if (smcf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (smcf->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    smcf->shm_zone->init = ngx_tcp_stats_init_zone;
+    smcf->shm_zone->data = smcf;
+
+    smcf->cmcf = ngx_tcp_conf_get_module_main_conf(cf, ngx_tcp_core_module);
+    smcf->cycle = cf->cycle;
+
+    return NGX_CONF_OK;
+}
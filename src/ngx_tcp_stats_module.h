@@ -0,0 +1,123 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#ifndef _NGX_TCP_STATS_MODULE_H_INCLUDED_
+#define _NGX_TCP_STATS_MODULE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/*
+ * the counters are written by one worker only, so they are plain
+ * increments; a reader sums the slots of all workers
+ */
+
+typedef struct {
+    ngx_atomic_uint_t               accepted;
+    ngx_atomic_uint_t               handled;
+    ngx_atomic_uint_t               active;
+    ngx_atomic_uint_t               failed;
+    ngx_atomic_uint_t               bytes_in;
+    ngx_atomic_uint_t               bytes_out;
+    ngx_atomic_uint_t               ssl_handshakes;
+    ngx_atomic_uint_t               ssl_session_reuses;
+    ngx_atomic_uint_t               ssl_ktls;
+    ngx_atomic_uint_t               upstream_failures;
+    ngx_atomic_uint_t               handshake_timeouts;
+    ngx_atomic_uint_t               read_timeouts;
+    ngx_atomic_uint_t               send_timeouts;
+    ngx_atomic_uint_t               connect_timeouts;
+    ngx_atomic_uint_t               proxy_timeouts;
+} ngx_tcp_stats_counters_t;
+
+
+typedef struct {
+    ngx_atomic_t                    pid;
+
+    ngx_atomic_uint_t               session_hits;
+    ngx_atomic_uint_t               session_misses;
+} ngx_tcp_stats_worker_t;
+
+
+/*
+ * the latency histograms are log-linear in microseconds: 16 exact
+ * buckets, then 8 buckets per power of two up to 2^32, so a bucket is
+ * at most 1/8 wider than its lower bound
+ */
+
+#define NGX_TCP_STATS_ACCEPT            0
+#define NGX_TCP_STATS_HANDSHAKE         1
+#define NGX_TCP_STATS_CONNECT           2
+#define NGX_TCP_STATS_SESSION           3
+#define NGX_TCP_STATS_NHISTS            4
+
+#define NGX_TCP_STATS_BUCKETS           (16 + 8 * 28)
+
+
+/*
+ * a slot is the worker header followed by the counters of the servers
+ * and of the listen addresses, and then by the histograms of the servers;
+ * each slot starts on a cache line
+ */
+
+typedef struct {
+    ngx_uint_t                      nslots;
+    ngx_uint_t                      nservers;
+    ngx_uint_t                      naddrs;
+    size_t                          slot_size;
+    u_char                         *slots;
+
+    /* the block of the previous layout, until its workers have exited */
+    void                           *prev;
+} ngx_tcp_stats_shctx_t;
+
+
+#define ngx_tcp_stats_slot_counters(slot)                                    \
+    ((ngx_tcp_stats_counters_t *)                                            \
+        ((u_char *) (slot)                                                   \
+         + ngx_align(sizeof(ngx_tcp_stats_worker_t), NGX_CPU_CACHE_LINE)))
+
+
+#define ngx_tcp_stats_add(s, field, n)                                       \
+    do {                                                                     \
+        if ((s)->stats) {                                                    \
+            (s)->stats->field += n;                                          \
+            (s)->addr_stats->field += n;                                     \
+        }                                                                    \
+    } while (0)
+
+#define ngx_tcp_stats_inc(s, field)  ngx_tcp_stats_add(s, field, 1)
+#define ngx_tcp_stats_dec(s, field)  ngx_tcp_stats_add(s, field, -1)
+
+
+#define ngx_tcp_stats_start(s, field)                                        \
+    do {                                                                     \
+        if ((s)->hists) {                                                    \
+            (s)->field = ngx_tcp_stats_now();                                \
+        }                                                                    \
+    } while (0)
+
+#define ngx_tcp_stats_record(s, hist, field)                                 \
+    do {                                                                     \
+        if ((s)->hists) {                                                    \
+            ngx_tcp_stats_record_time((s)->hists, hist, (s)->field);         \
+        }                                                                    \
+    } while (0)
+
+
+void ngx_tcp_stats_init_session(ngx_tcp_session_t *s, ngx_uint_t addr_index);
+uint64_t ngx_tcp_stats_now(void);
+void ngx_tcp_stats_record_time(ngx_atomic_uint_t *hists, ngx_uint_t hist,
+    uint64_t start);
+
+
+extern ngx_tcp_stats_worker_t  *ngx_tcp_stats_worker;
+extern ngx_module_t             ngx_tcp_stats_module;
+
+
+#endif /* _NGX_TCP_STATS_MODULE_H_INCLUDED_ */
@@ -0,0 +1,298 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_tcp.h>
+
+
+/*
+ * the levels are laid out as in the classic kernel timer wheel: level 0
+ * has a slot per tick, a slot of level n covers 256 * 64^(n - 1) ticks
+ * and is cascaded into the lower levels once the ticks before it are over
+ */
+
+#define NGX_TCP_TIMER_WHEEL_LEVEL1  256
+#define NGX_TCP_TIMER_WHEEL_LEVEL2  (256 + 64)
+#define NGX_TCP_TIMER_WHEEL_LEVEL3  (256 + 2 * 64)
+
+#define NGX_TCP_TIMER_WHEEL_MAX     ((ngx_uint_t) 1 << 26)
+
+#define ngx_tcp_timer_wheel_index(tick, shift)  (((tick) >> (shift)) & 63)
+
+
+static void ngx_tcp_timer_wheel_insert(ngx_tcp_timer_wheel_t *w,
+    ngx_tcp_session_t *s);
+static ngx_uint_t ngx_tcp_timer_wheel_cascade(ngx_tcp_timer_wheel_t *w,
+    ngx_uint_t level, ngx_uint_t shift);
+static void ngx_tcp_timer_wheel_handler(ngx_event_t *ev);
+
+
+ngx_tcp_timer_wheel_t *
+ngx_tcp_timer_wheel_create(ngx_conf_t *cf)
+{
+    ngx_uint_t              i;
+    ngx_tcp_timer_wheel_t  *w;
+
+    w = ngx_pcalloc(cf->pool, sizeof(ngx_tcp_timer_wheel_t));
+    if (w == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < NGX_TCP_TIMER_WHEEL_SLOTS; i++) {
+        ngx_queue_init(&w->slots[i]);
+    }
+
+    w->event.data = w;
+    w->event.handler = ngx_tcp_timer_wheel_handler;
+    w->event.log = &cf->cycle->new_log;
+
+    /*
+     * the event is not cancelable: an exiting worker waits for it as it
+     * would for the timers of the sessions, and it is not armed again
+     * once the wheel is empty
+     */
+
+    return w;
+}
+
+
+void
+ngx_tcp_add_idle_timer(ngx_tcp_session_t *s, ngx_event_t *ev,
+    ngx_msec_t timer)
+{
+    ngx_uint_t                 expire, n;
+    ngx_tcp_timer_wheel_t     *w;
+    ngx_tcp_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_tcp_get_module_main_conf(s, ngx_tcp_core_module);
+    w = cmcf->timer_wheel;
+
+    if (w == NULL) {
+        if (s->idle_event && s->idle_event != ev
+            && s->idle_event->timer_set)
+        {
+            ngx_del_timer(s->idle_event);
+        }
+
+        s->idle_event = ev;
+
+        ngx_add_timer(ev, timer);
+        return;
+    }
+
+    if (w->count == 0) {
+        w->msec = ngx_current_msec;
+
+        if (!w->event.timer_set) {
+            ngx_add_timer(&w->event, NGX_TCP_TIMER_WHEEL_TICK);
+        }
+    }
+
+    /* the first tick over not earlier than the timeout */
+
+    n = (ngx_current_msec - w->msec + timer + NGX_TCP_TIMER_WHEEL_TICK - 1)
+        / NGX_TCP_TIMER_WHEEL_TICK;
+
+    expire = w->tick + (n ? n - 1 : 0);
+
+    if (s->idle_event) {
+        s->idle_event = ev;
+        s->idle_expire = expire;
+
+        if ((ngx_int_t) (expire - s->idle_slot) >= 0) {
+            return;
+        }
+
+        ngx_queue_remove(&s->idle_queue);
+
+    } else {
+        w->count++;
+
+        s->idle_event = ev;
+        s->idle_expire = expire;
+    }
+
+    ngx_tcp_timer_wheel_insert(w, s);
+}
+
+
+void
+ngx_tcp_del_idle_timer(ngx_tcp_session_t *s)
+{
+    ngx_tcp_timer_wheel_t     *w;
+    ngx_tcp_core_main_conf_t  *cmcf;
+
+    if (s->idle_event == NULL) {
+        return;
+    }
+
+    cmcf = ngx_tcp_get_module_main_conf(s, ngx_tcp_core_module);
+    w = cmcf->timer_wheel;
+
+    if (w == NULL) {
+        if (s->idle_event->timer_set) {
+            ngx_del_timer(s->idle_event);
+        }
+
+    } else {
+        ngx_queue_remove(&s->idle_queue);
+        w->count--;
+    }
+
+    s->idle_event = NULL;
+}
+
+
+static void
+ngx_tcp_timer_wheel_insert(ngx_tcp_timer_wheel_t *w, ngx_tcp_session_t *s)
+{
+    ngx_uint_t    expire, delta;
+    ngx_queue_t  *slot;
+
+    expire = s->idle_expire;
+    delta = expire - w->tick;
+
+    if ((ngx_int_t) delta < 0) {
+        expire = w->tick;
+        delta = 0;
+    }
+
+    if (delta < 256) {
+        slot = &w->slots[expire & 255];
+
+    } else if (delta < 256 * 64) {
+        slot = &w->slots[NGX_TCP_TIMER_WHEEL_LEVEL1
+                         + ngx_tcp_timer_wheel_index(expire, 8)];
+
+    } else if (delta < 256 * 64 * 64) {
+        slot = &w->slots[NGX_TCP_TIMER_WHEEL_LEVEL2
+                         + ngx_tcp_timer_wheel_index(expire, 14)];
+
+    } else {
+        if (delta >= NGX_TCP_TIMER_WHEEL_MAX) {
+            expire = w->tick + NGX_TCP_TIMER_WHEEL_MAX - 1;
+        }
+
+        slot = &w->slots[NGX_TCP_TIMER_WHEEL_LEVEL3
+                         + ngx_tcp_timer_wheel_index(expire, 20)];
+    }
+
+    s->idle_slot = expire;
+
+    ngx_queue_insert_tail(slot, &s->idle_queue);
+}
+
+
+/* returns the index cascaded, the next level is cascaded after index 0 */
+
+static ngx_uint_t
+ngx_tcp_timer_wheel_cascade(ngx_tcp_timer_wheel_t *w, ngx_uint_t level,
+    ngx_uint_t shift)
+{
+    ngx_uint_t          index;
+    ngx_queue_t         list, *q, *slot;
+    ngx_tcp_session_t  *s;
+
+    index = ngx_tcp_timer_wheel_index(w->tick, shift);
+    slot = &w->slots[level + index];
+
+    if (ngx_queue_empty(slot)) {
+        return index;
+    }
+
+    ngx_queue_init(&list);
+    ngx_queue_add(&list, slot);
+    ngx_queue_init(slot);
+
+    while (!ngx_queue_empty(&list)) {
+        q = ngx_queue_head(&list);
+        ngx_queue_remove(q);
+
+        s = ngx_queue_data(q, ngx_tcp_session_t, idle_queue);
+
+        ngx_tcp_timer_wheel_insert(w, s);
+    }
+
+    return index;
+}
+
+
+static void
+ngx_tcp_timer_wheel_handler(ngx_event_t *ev)
+{
+    ngx_tcp_timer_wheel_t *w = ev->data;
+
+    ngx_uint_t          n, tick;
+    ngx_event_t        *e;
+    ngx_queue_t         list, *q, *slot;
+    ngx_tcp_session_t  *s;
+
+    n = (ngx_current_msec - w->msec) / NGX_TCP_TIMER_WHEEL_TICK;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "tcp timer wheel: %ui ticks, %ui timers", n, w->count);
+
+    while (n-- && w->count) {
+        tick = w->tick;
+
+        if ((tick & 255) == 0
+            && ngx_tcp_timer_wheel_cascade(w, NGX_TCP_TIMER_WHEEL_LEVEL1, 8)
+               == 0
+            && ngx_tcp_timer_wheel_cascade(w, NGX_TCP_TIMER_WHEEL_LEVEL2, 14)
+               == 0)
+        {
+            (void) ngx_tcp_timer_wheel_cascade(w, NGX_TCP_TIMER_WHEEL_LEVEL3,
+                                               20);
+        }
+
+        slot = &w->slots[tick & 255];
+
+        ngx_queue_init(&list);
+
+        if (!ngx_queue_empty(slot)) {
+            ngx_queue_add(&list, slot);
+            ngx_queue_init(slot);
+        }
+
+        w->tick++;
+        w->msec += NGX_TCP_TIMER_WHEEL_TICK;
+
+        /*
+         * a handler may close any session of the list, which unlinks it,
+         * so the list is consumed from its head
+         */
+
+        while (!ngx_queue_empty(&list)) {
+            q = ngx_queue_head(&list);
+            ngx_queue_remove(q);
+
+            s = ngx_queue_data(q, ngx_tcp_session_t, idle_queue);
+
+            if ((ngx_int_t) (s->idle_expire - tick) > 0) {
+
+                /* the timeout was moved later */
+
+                ngx_tcp_timer_wheel_insert(w, s);
+                continue;
+            }
+
+            e = s->idle_event;
+
+            s->idle_event = NULL;
+            w->count--;
+
+            e->timedout = 1;
+
+            e->handler(e);
+        }
+    }
+
+    if (w->count) {
+        ngx_add_timer(ev, NGX_TCP_TIMER_WHEEL_TICK);
+    }
+}
@@ -0,0 +1,53 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#ifndef _NGX_TCP_TIMER_WHEEL_H_INCLUDED_
+#define _NGX_TCP_TIMER_WHEEL_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+#define NGX_TCP_TIMER_WHEEL_TICK    100
+
+/* 256 ticks, then 3 levels of 64 slots each 64 times as long as before */
+#define NGX_TCP_TIMER_WHEEL_SLOTS   (256 + 3 * 64)
+
+
+/*
+ * the idle timeouts of the sessions of a worker: a session is linked
+ * into the slot of its expiration tick, and a timeout moved later only
+ * updates s->idle_expire, the session is moved when its slot is reached
+ */
+
+typedef struct {
+    ngx_queue_t             slots[NGX_TCP_TIMER_WHEEL_SLOTS];
+
+    /* the next tick to expire, it is over at msec + TICK */
+    ngx_uint_t              tick;
+    ngx_msec_t              msec;
+
+    ngx_uint_t              count;
+    ngx_event_t             event;
+} ngx_tcp_timer_wheel_t;
+
+
+ngx_tcp_timer_wheel_t *ngx_tcp_timer_wheel_create(ngx_conf_t *cf);
+
+/*
+ * the idle timeout of a session is an nginx timer of the event, or with
+ * "timer_wheel on" an entry of the worker's wheel; either way the event
+ * handler is called with ev->timedout set
+ */
+
+void ngx_tcp_add_idle_timer(ngx_tcp_session_t *s, ngx_event_t *ev,
+    ngx_msec_t timer);
+void ngx_tcp_del_idle_timer(ngx_tcp_session_t *s);
+
+
+#endif /* _NGX_TCP_TIMER_WHEEL_H_INCLUDED_ */
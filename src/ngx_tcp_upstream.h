@@ -0,0 +1,139 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#ifndef _NGX_TCP_UPSTREAM_H_INCLUDED_
+#define _NGX_TCP_UPSTREAM_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_connect.h>
+
+
+#define NGX_TCP_UPSTREAM_CREATE        0x0001
+#define NGX_TCP_UPSTREAM_WEIGHT        0x0002
+#define NGX_TCP_UPSTREAM_MAX_FAILS     0x0004
+#define NGX_TCP_UPSTREAM_FAIL_TIMEOUT  0x0008
+#define NGX_TCP_UPSTREAM_DOWN          0x0010
+
+
+typedef struct ngx_tcp_upstream_srv_conf_s  ngx_tcp_upstream_srv_conf_t;
+
+
+typedef ngx_int_t (*ngx_tcp_upstream_init_pt)(ngx_conf_t *cf,
+    ngx_tcp_upstream_srv_conf_t *us);
+typedef ngx_int_t (*ngx_tcp_upstream_init_peer_pt)(ngx_tcp_session_t *s,
+    ngx_tcp_upstream_srv_conf_t *us);
+
+
+typedef struct {
+    ngx_tcp_upstream_init_pt        init_upstream;
+    ngx_tcp_upstream_init_peer_pt   init;
+    void                           *data;
+} ngx_tcp_upstream_peer_t;
+
+
+typedef struct {
+    ngx_addr_t                     *addrs;
+    ngx_uint_t                      naddrs;
+    ngx_uint_t                      weight;
+    ngx_uint_t                      max_fails;
+    time_t                          fail_timeout;
+
+    unsigned                        down:1;
+} ngx_tcp_upstream_server_t;
+
+
+struct ngx_tcp_upstream_srv_conf_s {
+    ngx_tcp_upstream_peer_t         peer;
+    void                          **srv_conf;
+
+    ngx_array_t                    *servers;  /* ngx_tcp_upstream_server_t */
+
+    ngx_uint_t                      flags;
+    ngx_str_t                       host;
+    u_char                         *file_name;
+    ngx_uint_t                      line;
+};
+
+
+typedef struct {
+    ngx_array_t                     upstreams;
+                                          /* ngx_tcp_upstream_srv_conf_t * */
+} ngx_tcp_upstream_main_conf_t;
+
+
+/*
+ * the peers of an upstream are kept in one contiguous array per worker,
+ * the balancers address them by index
+ */
+
+typedef struct {
+    struct sockaddr                *sockaddr;
+    socklen_t                       socklen;
+    ngx_str_t                       name;
+
+    ngx_uint_t                      weight;
+    ngx_uint_t                      conns;
+
+    ngx_uint_t                      fails;
+    time_t                          accessed;
+    time_t                          checked;
+
+    ngx_uint_t                      max_fails;
+    time_t                          fail_timeout;
+
+    ngx_uint_t                      down;          /* unsigned  down:1; */
+} ngx_tcp_upstream_rr_peer_t;
+
+
+typedef struct {
+    ngx_uint_t                      number;
+    ngx_str_t                      *name;
+
+    /* peer indices interleaved by weight, walked by a cursor */
+    uint32_t                       *schedule;
+    ngx_uint_t                      nschedule;
+    ngx_uint_t                      cursor;
+
+    ngx_tcp_upstream_rr_peer_t      peer[1];
+} ngx_tcp_upstream_rr_peers_t;
+
+
+typedef struct {
+    ngx_tcp_upstream_rr_peers_t    *peers;
+    ngx_uint_t                      current;
+    uintptr_t                      *tried;
+    uintptr_t                       data;
+} ngx_tcp_upstream_rr_peer_data_t;
+
+
+ngx_tcp_upstream_srv_conf_t *ngx_tcp_upstream_add(ngx_conf_t *cf,
+    ngx_url_t *u, ngx_uint_t flags);
+
+ngx_int_t ngx_tcp_upstream_init_round_robin(ngx_conf_t *cf,
+    ngx_tcp_upstream_srv_conf_t *us);
+ngx_int_t ngx_tcp_upstream_init_round_robin_peer(ngx_tcp_session_t *s,
+    ngx_tcp_upstream_srv_conf_t *us);
+ngx_int_t ngx_tcp_upstream_get_round_robin_peer(ngx_peer_connection_t *pc,
+    void *data);
+void ngx_tcp_upstream_free_round_robin_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+ngx_uint_t ngx_tcp_upstream_rr_peer_available(ngx_tcp_upstream_rr_peer_t *peer,
+    time_t now);
+void ngx_tcp_upstream_rr_peer_use(ngx_peer_connection_t *pc,
+    ngx_tcp_upstream_rr_peer_data_t *rrp, ngx_uint_t n);
+
+
+#define ngx_tcp_conf_upstream_srv_conf(uscf, module)                         \
+    uscf->srv_conf[module.ctx_index]
+
+
+extern ngx_module_t  ngx_tcp_upstream_module;
+
+
+#endif /* _NGX_TCP_UPSTREAM_H_INCLUDED_ */
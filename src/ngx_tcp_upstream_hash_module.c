@@ -0,0 +1,456 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_tcp.h>
+
+
+#define NGX_TCP_UPSTREAM_HASH_REMOTE_ADDR  0x01
+#define NGX_TCP_UPSTREAM_HASH_REMOTE_PORT  0x02
+#define NGX_TCP_UPSTREAM_HASH_SERVER_ADDR  0x04
+
+/* ketama points per weight unit */
+#define NGX_TCP_UPSTREAM_HASH_POINTS       160
+
+/* ring steps tried before falling back to round robin */
+#define NGX_TCP_UPSTREAM_HASH_TRIES        20
+
+
+typedef struct {
+    uint32_t                            hash;
+    uint32_t                            peer;
+} ngx_tcp_upstream_hash_point_t;
+
+
+/*
+ * the ring is one sorted array of points, a lookup is a binary search
+ * for the first point at or after the key hash
+ */
+
+typedef struct {
+    ngx_uint_t                          key;
+    ngx_tcp_upstream_hash_point_t      *points;
+    ngx_uint_t                          npoints;
+} ngx_tcp_upstream_hash_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_tcp_upstream_rr_peer_data_t     rrp;
+
+    ngx_tcp_upstream_hash_conf_t       *hcf;
+    uint32_t                            hash;
+    ngx_uint_t                          tries;
+} ngx_tcp_upstream_hash_peer_data_t;
+
+
+static ngx_int_t ngx_tcp_upstream_init_hash_peer(ngx_tcp_session_t *s,
+    ngx_tcp_upstream_srv_conf_t *us);
+static ngx_int_t ngx_tcp_upstream_get_hash_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_tcp_upstream_free_hash_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static ngx_uint_t ngx_tcp_upstream_hash_find(ngx_tcp_upstream_hash_conf_t *hcf,
+    uint32_t hash);
+static int ngx_libc_cdecl ngx_tcp_upstream_hash_cmp_points(const void *one,
+    const void *two);
+static void *ngx_tcp_upstream_hash_create_conf(ngx_conf_t *cf);
+static char *ngx_tcp_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_tcp_upstream_hash_commands[] = {
+
+    { ngx_string("hash"),
+      NGX_TCP_UPS_CONF|NGX_CONF_1MORE,
+      ngx_tcp_upstream_hash,
+      NGX_TCP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_tcp_module_t  ngx_tcp_upstream_hash_module_ctx = {
+    NULL,                                  /* protocol */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_tcp_upstream_hash_create_conf,     /* create server configuration */
+    NULL                                   /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_tcp_upstream_hash_module = {
+    NGX_MODULE_V1,
+    &ngx_tcp_upstream_hash_module_ctx,     /* module context */
+    ngx_tcp_upstream_hash_commands,        /* module directives */
+    NGX_TCP_MODULE,                        /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_tcp_upstream_init_hash(ngx_conf_t *cf, ngx_tcp_upstream_srv_conf_t *us)
+{
+    uint32_t                       hash, prev;
+    ngx_uint_t                     i, j, k, n;
+    ngx_tcp_upstream_rr_peer_t    *peer;
+    ngx_tcp_upstream_rr_peers_t   *peers;
+    ngx_tcp_upstream_hash_conf_t  *hcf;
+
+    if (ngx_tcp_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_tcp_upstream_init_hash_peer;
+
+    peers = us->peer.data;
+    peer = peers->peer;
+
+    hcf = ngx_tcp_conf_upstream_srv_conf(us, ngx_tcp_upstream_hash_module);
+
+    n = 0;
+
+    for (i = 0; i < peers->number; i++) {
+        n += peer[i].weight * NGX_TCP_UPSTREAM_HASH_POINTS;
+    }
+
+    hcf->points = ngx_palloc(cf->pool,
+                             sizeof(ngx_tcp_upstream_hash_point_t) * n);
+    if (hcf->points == NULL) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * the points of a peer hash its "addr:port" name chained with the
+     * previous point, so they do not move when other peers come and go
+     */
+
+    k = 0;
+
+    for (i = 0; i < peers->number; i++) {
+
+        prev = 0;
+
+        for (j = 0; j < peer[i].weight * NGX_TCP_UPSTREAM_HASH_POINTS; j++) {
+
+            ngx_crc32_init(hash);
+            ngx_crc32_update(&hash, peer[i].name.data, peer[i].name.len);
+            ngx_crc32_update(&hash, (u_char *) &prev, sizeof(uint32_t));
+            ngx_crc32_final(hash);
+
+            hcf->points[k].hash = hash;
+            hcf->points[k].peer = i;
+            k++;
+
+            prev = hash;
+        }
+    }
+
+    ngx_qsort(hcf->points, n, sizeof(ngx_tcp_upstream_hash_point_t),
+              ngx_tcp_upstream_hash_cmp_points);
+
+    hcf->npoints = n;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_tcp_upstream_init_hash_peer(ngx_tcp_session_t *s,
+    ngx_tcp_upstream_srv_conf_t *us)
+{
+    uint32_t                            hash;
+    ngx_uint_t                          n;
+    ngx_connection_t                   *c;
+    struct sockaddr_in                 *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6                *sin6;
+#endif
+    ngx_peer_connection_t              *pc;
+    ngx_tcp_upstream_rr_peers_t        *peers;
+    ngx_tcp_upstream_hash_peer_data_t  *hp;
+
+    hp = ngx_palloc(s->connection->pool,
+                    sizeof(ngx_tcp_upstream_hash_peer_data_t));
+    if (hp == NULL) {
+        return NGX_ERROR;
+    }
+
+    peers = us->peer.data;
+
+    hp->rrp.peers = peers;
+    hp->rrp.current = 0;
+
+    if (peers->number <= 8 * sizeof(uintptr_t)) {
+        hp->rrp.tried = &hp->rrp.data;
+        hp->rrp.data = 0;
+
+    } else {
+        n = (peers->number + (8 * sizeof(uintptr_t) - 1))
+                / (8 * sizeof(uintptr_t));
+
+        hp->rrp.tried = ngx_pcalloc(s->connection->pool,
+                                    n * sizeof(uintptr_t));
+        if (hp->rrp.tried == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    hp->hcf = ngx_tcp_conf_upstream_srv_conf(us, ngx_tcp_upstream_hash_module);
+    hp->tries = 0;
+
+    c = s->connection;
+
+    ngx_crc32_init(hash);
+
+    if (hp->hcf->key & NGX_TCP_UPSTREAM_HASH_REMOTE_ADDR) {
+
+        switch (c->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            sin6 = (struct sockaddr_in6 *) c->sockaddr;
+            ngx_crc32_update(&hash, sin6->sin6_addr.s6_addr, 16);
+            break;
+#endif
+
+        default: /* AF_INET */
+            sin = (struct sockaddr_in *) c->sockaddr;
+            ngx_crc32_update(&hash, (u_char *) &sin->sin_addr.s_addr, 4);
+            break;
+        }
+    }
+
+    if (hp->hcf->key & NGX_TCP_UPSTREAM_HASH_REMOTE_PORT) {
+
+        switch (c->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            sin6 = (struct sockaddr_in6 *) c->sockaddr;
+            ngx_crc32_update(&hash, (u_char *) &sin6->sin6_port, 2);
+            break;
+#endif
+
+        default: /* AF_INET */
+            sin = (struct sockaddr_in *) c->sockaddr;
+            ngx_crc32_update(&hash, (u_char *) &sin->sin_port, 2);
+            break;
+        }
+    }
+
+    if (hp->hcf->key & NGX_TCP_UPSTREAM_HASH_SERVER_ADDR) {
+        ngx_crc32_update(&hash, s->addr_text->data, s->addr_text->len);
+    }
+
+    ngx_crc32_final(hash);
+
+    hp->hash = hash;
+
+    pc = &s->proxy->upstream;
+
+    pc->get = ngx_tcp_upstream_get_hash_peer;
+    pc->free = ngx_tcp_upstream_free_hash_peer;
+    pc->data = hp;
+    pc->tries = peers->number;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_tcp_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_tcp_upstream_hash_peer_data_t  *hp = data;
+
+    time_t                          now;
+    uintptr_t                       m;
+    ngx_uint_t                      i, n;
+    ngx_tcp_upstream_hash_conf_t   *hcf;
+    ngx_tcp_upstream_rr_peers_t    *peers;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, pc->log, 0,
+                   "get hash peer, try: %ui, hash: %uD", pc->tries, hp->hash);
+
+    hcf = hp->hcf;
+    peers = hp->rrp.peers;
+
+    if (hp->tries >= NGX_TCP_UPSTREAM_HASH_TRIES || peers->number == 1) {
+        return ngx_tcp_upstream_get_round_robin_peer(pc, &hp->rrp);
+    }
+
+    now = ngx_time();
+
+    i = ngx_tcp_upstream_hash_find(hcf, hp->hash);
+
+    while (hp->tries < NGX_TCP_UPSTREAM_HASH_TRIES) {
+
+        n = hcf->points[i % hcf->npoints].peer;
+
+        i++;
+        hp->tries++;
+
+        m = (uintptr_t) 1 << n % (8 * sizeof(uintptr_t));
+
+        if (hp->rrp.tried[n / (8 * sizeof(uintptr_t))] & m) {
+            continue;
+        }
+
+        if (!ngx_tcp_upstream_rr_peer_available(&peers->peer[n], now)) {
+            continue;
+        }
+
+        /* the next try starts from the point after this one */
+
+        hp->hash = hcf->points[(i - 1) % hcf->npoints].hash + 1;
+
+        ngx_tcp_upstream_rr_peer_use(pc, &hp->rrp, n);
+
+        return NGX_OK;
+    }
+
+    return ngx_tcp_upstream_get_round_robin_peer(pc, &hp->rrp);
+}
+
+
+static void
+ngx_tcp_upstream_free_hash_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_tcp_upstream_hash_peer_data_t  *hp = data;
+
+    ngx_tcp_upstream_free_round_robin_peer(pc, &hp->rrp, state);
+}
+
+
+static ngx_uint_t
+ngx_tcp_upstream_hash_find(ngx_tcp_upstream_hash_conf_t *hcf, uint32_t hash)
+{
+    ngx_uint_t                      i, j, k;
+    ngx_tcp_upstream_hash_point_t  *point;
+
+    /* find the first point with point->hash >= hash */
+
+    point = hcf->points;
+
+    i = 0;
+    j = hcf->npoints;
+
+    while (i < j) {
+        k = (i + j) / 2;
+
+        if (hash > point[k].hash) {
+            i = k + 1;
+
+        } else {
+            j = k;
+        }
+    }
+
+    /* i == npoints wraps around to the first point in the caller */
+
+    return i;
+}
+
+
+static int ngx_libc_cdecl
+ngx_tcp_upstream_hash_cmp_points(const void *one, const void *two)
+{
+    ngx_tcp_upstream_hash_point_t  *first, *second;
+
+    first = (ngx_tcp_upstream_hash_point_t *) one;
+    second = (ngx_tcp_upstream_hash_point_t *) two;
+
+    if (first->hash < second->hash) {
+        return -1;
+
+    } else if (first->hash > second->hash) {
+        return 1;
+
+    } else {
+        return 0;
+    }
+}
+
+
+static void *
+ngx_tcp_upstream_hash_create_conf(ngx_conf_t *cf)
+{
+    ngx_tcp_upstream_hash_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_tcp_upstream_hash_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->key = 0;
+     *     conf->points = NULL;
+     *     conf->npoints = 0;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_tcp_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_tcp_upstream_hash_conf_t  *hcf = conf;
+
+    ngx_str_t                    *value;
+    ngx_uint_t                    i;
+    ngx_tcp_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_tcp_conf_get_module_srv_conf(cf, ngx_tcp_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strcmp(value[i].data, "$remote_addr") == 0) {
+            hcf->key |= NGX_TCP_UPSTREAM_HASH_REMOTE_ADDR;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "$remote_port") == 0) {
+            hcf->key |= NGX_TCP_UPSTREAM_HASH_REMOTE_PORT;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "$server_addr") == 0) {
+            hcf->key |= NGX_TCP_UPSTREAM_HASH_SERVER_ADDR;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid hash key \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    uscf->peer.init_upstream = ngx_tcp_upstream_init_hash;
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,376 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_tcp.h>
+
+
+/*
+ * the peers are kept in an indexed binary min-heap ordered by
+ * conns / weight, so the least loaded peer is always heap[0];
+ * pos[] maps a peer index back to its heap slot to sift it in O(log n)
+ * once its connection count changes; the peers marked "down" are never
+ * selected and so are left out of the heap
+ */
+
+typedef struct {
+    uint32_t                         *heap;
+    uint32_t                         *pos;
+    ngx_uint_t                        nheap;
+} ngx_tcp_upstream_least_conn_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_tcp_upstream_rr_peer_data_t      rrp;
+
+    ngx_tcp_upstream_least_conn_conf_t  *lcf;
+} ngx_tcp_upstream_lc_peer_data_t;
+
+
+static ngx_int_t ngx_tcp_upstream_init_least_conn_peer(ngx_tcp_session_t *s,
+    ngx_tcp_upstream_srv_conf_t *us);
+static ngx_int_t ngx_tcp_upstream_get_least_conn_peer(
+    ngx_peer_connection_t *pc, void *data);
+static void ngx_tcp_upstream_free_least_conn_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static void ngx_tcp_upstream_least_conn_sift(
+    ngx_tcp_upstream_least_conn_conf_t *lcf,
+    ngx_tcp_upstream_rr_peers_t *peers, ngx_uint_t n);
+static void *ngx_tcp_upstream_least_conn_create_conf(ngx_conf_t *cf);
+static char *ngx_tcp_upstream_least_conn(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_tcp_upstream_least_conn_commands[] = {
+
+    { ngx_string("least_conn"),
+      NGX_TCP_UPS_CONF|NGX_CONF_NOARGS,
+      ngx_tcp_upstream_least_conn,
+      0,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_tcp_module_t  ngx_tcp_upstream_least_conn_module_ctx = {
+    NULL,                                  /* protocol */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_tcp_upstream_least_conn_create_conf, /* create server configuration */
+    NULL                                   /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_tcp_upstream_least_conn_module = {
+    NGX_MODULE_V1,
+    &ngx_tcp_upstream_least_conn_module_ctx, /* module context */
+    ngx_tcp_upstream_least_conn_commands,  /* module directives */
+    NGX_TCP_MODULE,                        /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+#define ngx_tcp_upstream_lc_less(peers, a, b)                                \
+    ((peers)->peer[a].conns * (peers)->peer[b].weight                        \
+     < (peers)->peer[b].conns * (peers)->peer[a].weight)
+
+
+static ngx_int_t
+ngx_tcp_upstream_init_least_conn(ngx_conf_t *cf,
+    ngx_tcp_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                           i, n;
+    ngx_tcp_upstream_rr_peers_t         *peers;
+    ngx_tcp_upstream_least_conn_conf_t  *lcf;
+
+    if (ngx_tcp_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_tcp_upstream_init_least_conn_peer;
+
+    peers = us->peer.data;
+
+    lcf = ngx_tcp_conf_upstream_srv_conf(us,
+                                         ngx_tcp_upstream_least_conn_module);
+
+    lcf->heap = ngx_palloc(cf->pool, sizeof(uint32_t) * peers->number);
+    if (lcf->heap == NULL) {
+        return NGX_ERROR;
+    }
+
+    lcf->pos = ngx_palloc(cf->pool, sizeof(uint32_t) * peers->number);
+    if (lcf->pos == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* all peers start with no connections, so any order is a valid heap */
+
+    n = 0;
+
+    for (i = 0; i < peers->number; i++) {
+
+        if (peers->peer[i].down) {
+            lcf->pos[i] = (uint32_t) -1;
+            continue;
+        }
+
+        lcf->heap[n] = i;
+        lcf->pos[i] = n++;
+    }
+
+    lcf->nheap = n;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_tcp_upstream_init_least_conn_peer(ngx_tcp_session_t *s,
+    ngx_tcp_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                        n;
+    ngx_peer_connection_t            *pc;
+    ngx_tcp_upstream_rr_peers_t      *peers;
+    ngx_tcp_upstream_lc_peer_data_t  *lcp;
+
+    lcp = ngx_palloc(s->connection->pool,
+                     sizeof(ngx_tcp_upstream_lc_peer_data_t));
+    if (lcp == NULL) {
+        return NGX_ERROR;
+    }
+
+    peers = us->peer.data;
+
+    lcp->rrp.peers = peers;
+    lcp->rrp.current = 0;
+
+    if (peers->number <= 8 * sizeof(uintptr_t)) {
+        lcp->rrp.tried = &lcp->rrp.data;
+        lcp->rrp.data = 0;
+
+    } else {
+        n = (peers->number + (8 * sizeof(uintptr_t) - 1))
+                / (8 * sizeof(uintptr_t));
+
+        lcp->rrp.tried = ngx_pcalloc(s->connection->pool,
+                                     n * sizeof(uintptr_t));
+        if (lcp->rrp.tried == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    lcp->lcf = ngx_tcp_conf_upstream_srv_conf(us,
+                                          ngx_tcp_upstream_least_conn_module);
+
+    pc = &s->proxy->upstream;
+
+    pc->get = ngx_tcp_upstream_get_least_conn_peer;
+    pc->free = ngx_tcp_upstream_free_least_conn_peer;
+    pc->data = lcp;
+    pc->tries = peers->number;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_tcp_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_tcp_upstream_lc_peer_data_t  *lcp = data;
+
+    time_t                        now;
+    uintptr_t                     m;
+    ngx_uint_t                    i, n, best;
+    ngx_tcp_upstream_rr_peers_t  *peers;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, pc->log, 0,
+                   "get least conn peer, try: %ui", pc->tries);
+
+    now = ngx_time();
+
+    peers = lcp->rrp.peers;
+
+    if (lcp->lcf->nheap == 0) {
+        pc->name = peers->name;
+        return NGX_BUSY;
+    }
+
+    /* normally the heap top is taken */
+
+    n = lcp->lcf->heap[0];
+    m = (uintptr_t) 1 << n % (8 * sizeof(uintptr_t));
+
+    if (!(lcp->rrp.tried[n / (8 * sizeof(uintptr_t))] & m)
+        && ngx_tcp_upstream_rr_peer_available(&peers->peer[n], now))
+    {
+        goto found;
+    }
+
+    /* the top is failed or already tried: scan the whole array */
+
+    best = peers->number;
+
+    for (i = 0; i < peers->number; i++) {
+
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if (lcp->rrp.tried[i / (8 * sizeof(uintptr_t))] & m) {
+            continue;
+        }
+
+        if (!ngx_tcp_upstream_rr_peer_available(&peers->peer[i], now)) {
+            continue;
+        }
+
+        if (best == peers->number
+            || ngx_tcp_upstream_lc_less(peers, i, best))
+        {
+            best = i;
+        }
+    }
+
+    if (best == peers->number) {
+        pc->name = peers->name;
+        return NGX_BUSY;
+    }
+
+    n = best;
+
+found:
+
+    ngx_tcp_upstream_rr_peer_use(pc, &lcp->rrp, n);
+
+    ngx_tcp_upstream_least_conn_sift(lcp->lcf, peers, n);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_tcp_upstream_free_least_conn_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_tcp_upstream_lc_peer_data_t  *lcp = data;
+
+    ngx_tcp_upstream_free_round_robin_peer(pc, &lcp->rrp, state);
+
+    ngx_tcp_upstream_least_conn_sift(lcp->lcf, lcp->rrp.peers,
+                                     lcp->rrp.current);
+}
+
+
+static void
+ngx_tcp_upstream_least_conn_sift(ngx_tcp_upstream_least_conn_conf_t *lcf,
+    ngx_tcp_upstream_rr_peers_t *peers, ngx_uint_t n)
+{
+    uint32_t    *heap, *pos;
+    ngx_uint_t   i, p, c;
+
+    heap = lcf->heap;
+    pos = lcf->pos;
+
+    if (peers->peer[n].down) {
+        return;
+    }
+
+    i = pos[n];
+
+    /* up */
+
+    while (i > 0) {
+        p = (i - 1) / 2;
+
+        if (!ngx_tcp_upstream_lc_less(peers, n, heap[p])) {
+            break;
+        }
+
+        heap[i] = heap[p];
+        pos[heap[i]] = i;
+        i = p;
+    }
+
+    /* down */
+
+    for ( ;; ) {
+        c = 2 * i + 1;
+
+        if (c >= lcf->nheap) {
+            break;
+        }
+
+        if (c + 1 < lcf->nheap
+            && ngx_tcp_upstream_lc_less(peers, heap[c + 1], heap[c]))
+        {
+            c++;
+        }
+
+        if (!ngx_tcp_upstream_lc_less(peers, heap[c], n)) {
+            break;
+        }
+
+        heap[i] = heap[c];
+        pos[heap[i]] = i;
+        i = c;
+    }
+
+    heap[i] = n;
+    pos[n] = i;
+}
+
+
+static void *
+ngx_tcp_upstream_least_conn_create_conf(ngx_conf_t *cf)
+{
+    ngx_tcp_upstream_least_conn_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_tcp_upstream_least_conn_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->heap = NULL;
+     *     conf->pos = NULL;
+     *     conf->nheap = 0;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_tcp_upstream_least_conn(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_tcp_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_tcp_conf_get_module_srv_conf(cf, ngx_tcp_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_tcp_upstream_init_least_conn;
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,313 @@
+
+/*
+ * Copyright (C) Ngwsx
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_tcp.h>
+
+
+static ngx_int_t ngx_tcp_upstream_cmp_weights(const void *one,
+    const void *two);
+
+
+static ngx_tcp_upstream_rr_peers_t  *ngx_tcp_upstream_sort_peers;
+
+
+ngx_int_t
+ngx_tcp_upstream_init_round_robin(ngx_conf_t *cf,
+    ngx_tcp_upstream_srv_conf_t *us)
+{
+    uint32_t                      *schedule, *order;
+    ngx_uint_t                     i, j, k, n, w, max;
+    ngx_tcp_upstream_server_t     *server;
+    ngx_tcp_upstream_rr_peers_t   *peers;
+
+    us->peer.init = ngx_tcp_upstream_init_round_robin_peer;
+
+    server = us->servers->elts;
+
+    n = 0;
+
+    for (i = 0; i < us->servers->nelts; i++) {
+        n += server[i].naddrs;
+    }
+
+    if (n == 0) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "no servers in upstream \"%V\" in %s:%ui",
+                      &us->host, us->file_name, us->line);
+        return NGX_ERROR;
+    }
+
+    peers = ngx_pcalloc(cf->pool, sizeof(ngx_tcp_upstream_rr_peers_t)
+                              + sizeof(ngx_tcp_upstream_rr_peer_t) * (n - 1));
+    if (peers == NULL) {
+        return NGX_ERROR;
+    }
+
+    peers->number = n;
+    peers->name = &us->host;
+
+    n = 0;
+    w = 0;
+    max = 0;
+
+    for (i = 0; i < us->servers->nelts; i++) {
+        for (j = 0; j < server[i].naddrs; j++) {
+            peers->peer[n].sockaddr = server[i].addrs[j].sockaddr;
+            peers->peer[n].socklen = server[i].addrs[j].socklen;
+            peers->peer[n].name = server[i].addrs[j].name;
+            peers->peer[n].weight = server[i].weight;
+            peers->peer[n].max_fails = server[i].max_fails;
+            peers->peer[n].fail_timeout = server[i].fail_timeout;
+            peers->peer[n].down = server[i].down;
+
+            w += server[i].weight;
+
+            if (server[i].weight > max) {
+                max = server[i].weight;
+            }
+
+            n++;
+        }
+    }
+
+    /*
+     * the interleaved weighted round-robin schedule: the round r lists
+     * every peer whose weight is r or more, so a peer of weight w appears
+     * w times spread over the schedule, and the pick is a cursor step
+     */
+
+    order = ngx_palloc(cf->temp_pool, sizeof(uint32_t) * n);
+    if (order == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        order[i] = i;
+    }
+
+    ngx_tcp_upstream_sort_peers = peers;
+
+    ngx_sort(order, n, sizeof(uint32_t), ngx_tcp_upstream_cmp_weights);
+
+    schedule = ngx_palloc(cf->pool, sizeof(uint32_t) * w);
+    if (schedule == NULL) {
+        return NGX_ERROR;
+    }
+
+    k = 0;
+
+    for (w = 1; w <= max; w++) {
+        for (i = 0; i < n && peers->peer[order[i]].weight >= w; i++) {
+            schedule[k++] = order[i];
+        }
+    }
+
+    peers->schedule = schedule;
+    peers->nschedule = k;
+    peers->cursor = 0;
+
+    us->peer.data = peers;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_tcp_upstream_init_round_robin_peer(ngx_tcp_session_t *s,
+    ngx_tcp_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                        n;
+    ngx_peer_connection_t            *pc;
+    ngx_tcp_upstream_rr_peers_t      *peers;
+    ngx_tcp_upstream_rr_peer_data_t  *rrp;
+
+    rrp = ngx_palloc(s->connection->pool,
+                     sizeof(ngx_tcp_upstream_rr_peer_data_t));
+    if (rrp == NULL) {
+        return NGX_ERROR;
+    }
+
+    peers = us->peer.data;
+
+    rrp->peers = peers;
+    rrp->current = 0;
+
+    if (peers->number <= 8 * sizeof(uintptr_t)) {
+        rrp->tried = &rrp->data;
+        rrp->data = 0;
+
+    } else {
+        n = (peers->number + (8 * sizeof(uintptr_t) - 1))
+                / (8 * sizeof(uintptr_t));
+
+        rrp->tried = ngx_pcalloc(s->connection->pool, n * sizeof(uintptr_t));
+        if (rrp->tried == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    pc = &s->proxy->upstream;
+
+    pc->get = ngx_tcp_upstream_get_round_robin_peer;
+    pc->free = ngx_tcp_upstream_free_round_robin_peer;
+    pc->data = rrp;
+    pc->tries = peers->number;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_tcp_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_tcp_upstream_rr_peer_data_t  *rrp = data;
+
+    time_t                        now;
+    uint32_t                      n;
+    uintptr_t                     m;
+    ngx_uint_t                    i;
+    ngx_tcp_upstream_rr_peers_t  *peers;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, pc->log, 0,
+                   "get rr peer, try: %ui", pc->tries);
+
+    now = ngx_time();
+
+    peers = rrp->peers;
+
+    /* normally the first schedule slot is taken */
+
+    for (i = 0; i < peers->nschedule; i++) {
+
+        n = peers->schedule[peers->cursor];
+
+        if (++peers->cursor == peers->nschedule) {
+            peers->cursor = 0;
+        }
+
+        m = (uintptr_t) 1 << n % (8 * sizeof(uintptr_t));
+
+        if (rrp->tried[n / (8 * sizeof(uintptr_t))] & m) {
+            continue;
+        }
+
+        if (!ngx_tcp_upstream_rr_peer_available(&peers->peer[n], now)) {
+            continue;
+        }
+
+        ngx_tcp_upstream_rr_peer_use(pc, rrp, n);
+
+        return NGX_OK;
+    }
+
+    pc->name = peers->name;
+
+    return NGX_BUSY;
+}
+
+
+void
+ngx_tcp_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_tcp_upstream_rr_peer_data_t  *rrp = data;
+
+    time_t                       now;
+    ngx_tcp_upstream_rr_peer_t  *peer;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, pc->log, 0,
+                   "free rr peer %ui %ui", pc->tries, state);
+
+    peer = &rrp->peers->peer[rrp->current];
+
+    peer->conns--;
+
+    if (state & NGX_PEER_FAILED) {
+        now = ngx_time();
+
+        peer->fails++;
+        peer->accessed = now;
+        peer->checked = now;
+
+        if (peer->max_fails && peer->fails >= peer->max_fails) {
+            ngx_log_error(NGX_LOG_WARN, pc->log, 0,
+                          "upstream server temporarily disabled");
+        }
+
+    } else if (peer->accessed < peer->checked) {
+        peer->fails = 0;
+    }
+
+    if (pc->tries) {
+        pc->tries--;
+    }
+}
+
+
+ngx_uint_t
+ngx_tcp_upstream_rr_peer_available(ngx_tcp_upstream_rr_peer_t *peer,
+    time_t now)
+{
+    if (peer->down) {
+        return 0;
+    }
+
+    if (peer->max_fails
+        && peer->fails >= peer->max_fails
+        && now - peer->checked <= peer->fail_timeout)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+void
+ngx_tcp_upstream_rr_peer_use(ngx_peer_connection_t *pc,
+    ngx_tcp_upstream_rr_peer_data_t *rrp, ngx_uint_t n)
+{
+    time_t                       now;
+    ngx_tcp_upstream_rr_peer_t  *peer;
+
+    peer = &rrp->peers->peer[n];
+
+    rrp->current = n;
+    rrp->tried[n / (8 * sizeof(uintptr_t))] |=
+                                    (uintptr_t) 1 << n % (8 * sizeof(uintptr_t));
+
+    now = ngx_time();
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    peer->conns++;
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+}
+
+
+static ngx_int_t
+ngx_tcp_upstream_cmp_weights(const void *one, const void *two)
+{
+    ngx_uint_t  w1, w2;
+
+    w1 = ngx_tcp_upstream_sort_peers->peer[*(uint32_t *) one].weight;
+    w2 = ngx_tcp_upstream_sort_peers->peer[*(uint32_t *) two].weight;
+
+    /* heavier peers first */
+
+    if (w1 == w2) {
+        return 0;
+    }
+
+    return (w1 > w2) ? -1 : 1;
+}